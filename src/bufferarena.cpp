@@ -0,0 +1,152 @@
+#include "bufferarena.h"
+
+#define __CUDA_RUNTIME_H__
+#include "cuda.h"
+
+// Taille minimale d'un buffer, et alignement des lignes des buffers GPU
+#define __ARENA_MIN_SIZE__ 4096
+#define __ARENA_PITCH__ 512
+
+/***********************/
+bufferArena::bufferArena()
+    :mFrameAllocations(0),
+      mFrameBytes(0),
+      mTotalAllocations(0),
+      mReservedBytes(0)
+{
+}
+
+/***********************/
+bufferArena::~bufferArena()
+{
+    for(size_t i=0; i<mBuffers.size(); i++)
+        freeBuffer(mBuffers[i]);
+}
+
+/***********************/
+void bufferArena::newFrame()
+{
+    mFrameAllocations = 0;
+    mFrameBytes = 0;
+}
+
+/***********************/
+cv::Mat bufferArena::getMat(int pSlot, int pRows, int pCols, int pType)
+{
+    cv::Mat lHeader(1, 1, pType, NULL);
+    size_t lStep = pCols*lHeader.elemSize();
+
+    void* lData = getBuffer(pSlot, lStep*pRows, false);
+    if(lData == NULL)
+        return cv::Mat();
+
+    return cv::Mat(pRows, pCols, pType, lData, lStep);
+}
+
+/***********************/
+void* bufferArena::getDeviceBuffer(int pSlot, int pWidth, int pHeight, int pElemSize, int &pStep)
+{
+    pStep = ((pWidth*pElemSize + __ARENA_PITCH__ - 1)/__ARENA_PITCH__)*__ARENA_PITCH__;
+    return getBuffer(pSlot, (size_t)pStep*pHeight, true);
+}
+
+/***********************/
+void bufferArena::addAllocation()
+{
+    mFrameAllocations++;
+    mTotalAllocations++;
+}
+
+/***********************/
+unsigned int bufferArena::getFrameAllocations()
+{
+    return mFrameAllocations;
+}
+
+/***********************/
+size_t bufferArena::getFrameBytes()
+{
+    return mFrameBytes;
+}
+
+/***********************/
+unsigned int bufferArena::getTotalAllocations()
+{
+    return mTotalAllocations;
+}
+
+/***********************/
+size_t bufferArena::getReservedBytes()
+{
+    return mReservedBytes;
+}
+
+/***********************/
+void* bufferArena::getBuffer(int pSlot, size_t pSize, bool pDevice)
+{
+    if(pSlot < 0)
+        return NULL;
+
+    if((size_t)pSlot >= mBuffers.size())
+    {
+        buffer lEmpty;
+        lEmpty.data = NULL;
+        lEmpty.size = 0;
+        lEmpty.device = false;
+        mBuffers.resize(pSlot+1, lEmpty);
+    }
+
+    buffer &lBuffer = mBuffers[pSlot];
+
+    // Le buffer actuel convient, on le réutilise tel quel
+    if(lBuffer.data != NULL && lBuffer.device == pDevice && lBuffer.size >= pSize)
+        return lBuffer.data;
+
+    // Sinon, on passe à la classe de taille supérieure
+    freeBuffer(lBuffer);
+
+    size_t lSize = sizeClass(pSize);
+    if(pDevice)
+    {
+        if(cudaMalloc(&lBuffer.data, lSize) != 0)
+            lBuffer.data = NULL;
+    }
+    else
+        lBuffer.data = cv::fastMalloc(lSize);
+
+    if(lBuffer.data == NULL)
+        return NULL;
+
+    lBuffer.size = lSize;
+    lBuffer.device = pDevice;
+    mReservedBytes += lSize;
+    mFrameBytes += lSize;
+    addAllocation();
+
+    return lBuffer.data;
+}
+
+/***********************/
+void bufferArena::freeBuffer(buffer &pBuffer)
+{
+    if(pBuffer.data == NULL)
+        return;
+
+    if(pBuffer.device)
+        cudaFree(pBuffer.data);
+    else
+        cv::fastFree(pBuffer.data);
+
+    mReservedBytes -= pBuffer.size;
+    pBuffer.data = NULL;
+    pBuffer.size = 0;
+}
+
+/***********************/
+size_t bufferArena::sizeClass(size_t pSize)
+{
+    size_t lSize = __ARENA_MIN_SIZE__;
+    while(lSize < pSize)
+        lSize *= 2;
+    return lSize;
+}
@@ -0,0 +1,65 @@
+/* Classe conservant d'une image à l'autre les buffers utilisés pour la
+ * segmentation (coûts, labels, buffers temporaires), sur l'hôte comme sur
+ * le GPU. Chaque buffer occupe un emplacement, et n'est réalloué que lorsque
+ * la taille demandée dépasse sa classe de taille (puissance de 2).
+ * Les allocations sont comptées, afin de vérifier qu'il n'y en a plus
+ * une fois la taille de la zone segmentée stabilisée.
+ */
+
+#ifndef BUFFERARENA_H
+#define BUFFERARENA_H
+
+#include <vector>
+
+#include "opencv2/opencv.hpp"
+
+class bufferArena
+{
+public:
+    bufferArena();
+    ~bufferArena();
+
+    // Début d'une nouvelle image : remise à zéro du compteur d'allocations
+    void newFrame();
+
+    // Matrice hôte continue, valide jusqu'au prochain appel sur le même emplacement
+    cv::Mat getMat(int pSlot, int pRows, int pCols, int pType);
+    // Buffer 2D sur le GPU, pStep étant renvoyé en octets
+    void* getDeviceBuffer(int pSlot, int pWidth, int pHeight, int pElemSize, int &pStep);
+
+    // Signale une allocation faite en dehors de l'arène (par une lib externe, par ex.)
+    void addAllocation();
+
+    // Compteurs
+    unsigned int getFrameAllocations();
+    size_t getFrameBytes(); // octets alloués depuis le début de l'image
+    unsigned int getTotalAllocations();
+    size_t getReservedBytes();
+
+private:
+    /***********/
+    // Attributs
+    /***********/
+    struct buffer
+    {
+        void* data;
+        size_t size;
+        bool device;
+    };
+
+    std::vector<buffer> mBuffers;
+
+    unsigned int mFrameAllocations;
+    size_t mFrameBytes;
+    unsigned int mTotalAllocations;
+    size_t mReservedBytes;
+
+    /**********/
+    // Méthodes
+    /**********/
+    void* getBuffer(int pSlot, size_t pSize, bool pDevice);
+    void freeBuffer(buffer &pBuffer);
+    static size_t sizeClass(size_t pSize);
+};
+
+#endif // BUFFERARENA_H
@@ -1,18 +1,73 @@
 #include "colorsegment.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "glm/gtc/matrix_transform.hpp"
 #include "glm/gtc/type_ptr.hpp"
+#include "threadpool.h"
 
 //#define __DEBUG_GC__
 
+// Paramètres des superpixels (SLIC)
+#define __SLIC_ITERATIONS__ 4
+#define __SLIC_COMPACTNESS__ 10.f
+// Pas de la table d'exponentielle des coûts de lissage, et hauteur
+// minimale d'une bande de lignes calculée par un thread
+#define __SMOOTH_TABLE_SCALE__ 1024.f
+#define __SMOOTH_MIN_BAND__ 16
+// Période de vérification des évènements de la fenêtre GL, en ms
+#define __GL_EVENT_PERIOD__ 20
+// Emplacements d'entrée : indice, et marqueur de données non encore lues
+#define __SLOT_INDEX__ 0x3
+#define __SLOT_FRESH__ 0x4
+
 /**********************/
 colorSegment::colorSegment()
-    :mShaderValid(false),
+    :mIsGLReady(false),
+      mIsHeadless(false),
+      mIsPolling(false),
+      mGraphType(GRAPH_FBO),
+      mIsNativeLabels(false),
+      mIsRegionLabels(false),
+      mShaderValid(false),
       mSigmaCam(0.3),
       mMaxSmoothCost(20),
       mCudaDatabuffer(NULL)
 {
+    mIsRunning = false;
     mInputCounter = 0;
     mLabelCounter = 0;
+    mReadCounter = 0;
+    mSolvedTicket = 0;
+    mCurrentTicket = 0;
+
+    mGraphcutSize = 0;
+    mGraphcutRatio = 0.f;
+    mGraphcutDuration = 0.f;
+    mPreSolveDuration = 0.f;
+    mFrameAllocations = 0;
+
+    mPyramidScale = 2;
+    mThreadCount = 1;
+    mExpTableSigma = 0.f;
+    mExpTableCost = 0;
+    mTimeBudget = 0.f;
+    mIsConverged = true;
+    mResidual = 0;
+    mSuperpixelSize = 8;
+    mWakeLatency = 0.f;
+    mWorkerLoad = 0.f;
+    mRenderDuration = 0.f;
+    mReadbackWaitDuration = 0.f;
+    mReadbackCopyDuration = 0.f;
+    mReadbackHead = 0;
+    mPendingReadbacks = 0;
+    mMetrics = frameMetrics();
+    mSolvedMetrics = frameMetrics();
+    mGraphAllocations = 0;
+    mPreviousGraphType = mGraphType;
+
+    mCudaGraphcutState = NULL;
 
     mImgSize[0] = 640;
     mImgSize[1] = 480;
@@ -28,11 +83,22 @@ colorSegment::colorSegment()
         mCPUData[i] = cv::Mat(mImgSize[1]*2, mImgSize[0]*2, CV_16UC1);
     }
 
-    // Vérification qu'on a bien du CUDA sous le capot
-    initNPP();
+    // Vérification qu'on a bien du CUDA sous le capot,
+    // sinon on se rabat sur le solveur CPU
+    mIsNPP = initNPP();
+    if(mIsNPP)
+        mSolver = SOLVER_NPP;
+    else
+    {
+        std::cerr << "Using CPU graph-cut solver." << std::endl;
+        mSolver = SOLVER_CPU;
+    }
 
     // Allocation des labels
-    mLabels = cv::Mat::zeros(mFBOSize[1], mFBOSize[0], CV_8UC1);
+    // Hors de la zone segmentée, les labels valent 1
+    mLabels = cv::Mat::ones(mFBOSize[1], mFBOSize[0], CV_8UC1);
+    mNativeLabels = cv::Mat::ones(mImgSize[1], mImgSize[0], CV_8UC1);
+    mRegionLabels = cv::Mat::zeros(mImgSize[1], mImgSize[0], CV_8UC1);
 
     mXMin = 0;
     mXMax = mImgSize[0];
@@ -43,19 +109,32 @@ colorSegment::colorSegment()
 /**********************/
 colorSegment::~colorSegment()
 {
-    if(mIsRunning)
-    {
-        mIsRunning = false;
-        mMainLoop->join();
-    }
+    stop();
 
-    if(mCudaDatabuffer)
-        nppiFree(mCudaDatabuffer);
+    // Les buffers eux-mêmes sont libérés par mArena
+    if(mCudaGraphcutState != NULL)
+        nppiGraphcutFree(mCudaGraphcutState);
 }
 
 /**********************/
 bool colorSegment::init()
 {
+    // Allocation des emplacements d'entrée, une fois pour toutes
+    for(int i=0; i<3; i++)
+    {
+        mInputSlots[i].img = cv::Mat::zeros(mImgSize[1], mImgSize[0], CV_8UC3);
+        mInputSlots[i].costs = cv::Mat::zeros(mImgSize[1], mImgSize[0], CV_16UC2);
+        mInputSlots[i].ticket = 0;
+        mInputSlots[i].regionCount = 0;
+        mInputSlots[i].inputBytes = 0;
+    }
+    mWriteSlot = 0;
+    mReadySlot = 1;
+    mReadSlot = 2;
+
+    // Positionné avant le lancement du thread, pour qu'un appel immédiat
+    // à stop() ne soit pas ignoré
+    mIsRunning = true;
     mMainLoop = boost::shared_ptr<boost::thread>(new boost::thread(boost::bind(&colorSegment::mainLoop, this)));
 
     if(mMainLoop)
@@ -70,16 +149,101 @@ bool colorSegment::init(unsigned int pWidth, unsigned int pHeight)
     mImgSize[0] = pWidth;
     mImgSize[1] = pHeight;
 
-    mDataCosts = cv::Mat(pHeight, pWidth, CV_16UC1);
-    mImg = cv::Mat(pHeight, pWidth, CV_8UC3);
-
     return init();
 }
 
 /**********************/
 void colorSegment::stop()
 {
+    if(!mMainLoop)
+        return;
+
+    mImgMutex.lock();
+    mIsRunning = false;
+    mImgMutex.unlock();
+
+    // Réveil du thread de calcul, et des appels à getSegment en attente.
+    // mLabelMutex est pris pour qu'un appel ne puisse pas manquer ce réveil
+    // entre sa lecture de mIsRunning et son attente
+    mInputCondition.notify_all();
+    mLabelMutex.lock();
+    mLabelCondition.notify_all();
+    mLabelMutex.unlock();
+
+    mMainLoop->join();
+    mMainLoop.reset();
+}
+
+/**********************/
+void colorSegment::setPolling(bool pPolling)
+{
+    mIsPolling = pPolling;
+}
+
+/**********************/
+bool colorSegment::setSolver(solverType pSolver)
+{
+    if(pSolver == SOLVER_NPP && !mIsNPP)
+    {
+        std::cerr << "NPP solver requested, but CUDA is not available." << std::endl;
+        return false;
+    }
+
+    mSolver = pSolver;
+    return true;
+}
+
+/**********************/
+bool colorSegment::setHeadless(bool pHeadless)
+{
+#ifndef HAVE_EGL
+    if(pHeadless)
+    {
+        std::cerr << "Headless mode requested, but EGL was not found at configure time." << std::endl;
+        return false;
+    }
+#endif
+
+    mIsHeadless = pHeadless;
+    return true;
+}
+
+/**********************/
+void colorSegment::setGraphType(graphType pType)
+{
+    mGraphType = pType;
+}
+
+/**********************/
+void colorSegment::setThreadCount(unsigned int pCount)
+{
+    mThreadCount = std::max(1u, pCount);
+    mGraphcut.setThreadCount(pCount);
+}
+
+/**********************/
+void colorSegment::setDynamic(bool pDynamic)
+{
+    mGraphcut.setDynamic(pDynamic);
+}
+
+/**********************/
+void colorSegment::setPyramidScale(unsigned int pScale)
+{
+    // Seules les résolutions 1/2 et 1/4 sont proposées
+    mPyramidScale = (pScale >= 4) ? 4 : 2;
+}
+
+/**********************/
+void colorSegment::setSuperpixelSize(unsigned int pSize)
+{
+    mSuperpixelSize = std::max(2u, pSize);
+}
 
+/**********************/
+void colorSegment::setTimeBudget(float pBudget)
+{
+    mTimeBudget = std::max(0.f, pBudget);
 }
 
 /**********************/
@@ -89,9 +253,11 @@ void colorSegment::setMaxSmoothCost(unsigned int pCost)
 }
 
 /**********************/
-bool colorSegment::setCosts(cv::Mat &pImg, cv::Mat &pBGCosts, cv::Mat &pFGCosts, cv::Mat pBG, cv::Mat pFG,
-                            unsigned int pXMin, unsigned int pXMax, unsigned int pYMin, unsigned int pYMax)
+unsigned int colorSegment::setCosts(cv::Mat &pImg, cv::Mat &pBGCosts, cv::Mat &pFGCosts, cv::Mat pBG, cv::Mat pFG,
+                                    unsigned int pXMin, unsigned int pXMax, unsigned int pYMin, unsigned int pYMax)
 {
+    auto lStartTime = std::chrono::high_resolution_clock::now();
+
     // On vérifie que toutes ces données ont le bon format
     bool lValid = true;
     lValid &= checkMatrix(pImg, CV_8UC3);
@@ -101,45 +267,7 @@ bool colorSegment::setCosts(cv::Mat &pImg, cv::Mat &pBGCosts, cv::Mat &pFGCosts,
     lValid &= checkMatrix(pFG, CV_8UC1);
 
     if(!lValid)
-        return false;
-
-    // On calcul notre matrice des coûts, combinaison des coûts de données
-    // du FG, BG, et des zones déjà fixée par pBG et pFG
-    // Du fait de l'utilisation en opengl plus tard, on décalera le zéro à 32767
-    // (OpenGL n'est pas fan des valeurs négatives)
-    cv::Mat lCosts = cv::Mat(mImgSize[1], mImgSize[0], CV_16UC2);
-
-    cv::MatConstIterator_<ushort> lBGIt = pBGCosts.begin<ushort>();
-    cv::MatConstIterator_<ushort> lFGIt = pFGCosts.begin<ushort>();
-    cv::MatConstIterator_<uchar> lBGMaskIt = pBG.begin<uchar>();
-    cv::MatConstIterator_<uchar> lFGMaskIt = pFG.begin<uchar>();
-    cv::MatIterator_<cv::Vec2w> lCostsIt = lCosts.begin<cv::Vec2w>();
-
-    for(; lCostsIt<lCosts.end<cv::Vec2w>(); lCostsIt++, lBGIt++, lFGIt++, lBGMaskIt++, lFGMaskIt++)
-    {
-        (*lCostsIt)[0] = 0;
-        (*lCostsIt)[1] = 0;
-
-        // Si on est dans un des masques, on le note comme tel
-        // avec une valeur facilement repérable !
-        if(*lFGMaskIt == 255)
-            (*lCostsIt)[0] = 65535;
-        else if(*lBGMaskIt == 255)
-            (*lCostsIt)[1] = 65535;
-        // Sinon, on copie juste les valeurs des coûts
-        else
-        {
-            (*lCostsIt)[0] = *lFGIt;
-            (*lCostsIt)[1] = *lBGIt;
-        }
-    }
-
-    // On fini par copier tout ça dans les matrices qui seront effectivement
-    // utilisées pour initialiser les textures GL
-    mImgMutex.lock();
-    cv::flip(lCosts, mDataCosts, 0);
-    cv::flip(pImg, mImg, 0);
-
+        return 0;
 
     if(pXMin >= 0 && pXMin < (unsigned int)mImgSize[0]-1)
         mXMin = pXMin;
@@ -151,118 +279,351 @@ bool colorSegment::setCosts(cv::Mat &pImg, cv::Mat &pBGCosts, cv::Mat &pFGCosts,
     if((pYMax < (unsigned int)mImgSize[1]) && pYMax > pYMin)
         mYMax = pYMax;
 
-    mImgMutex.unlock();
+    // Les données sont écrites directement dans l'emplacement réservé au
+    // producteur, retournées verticalement pour être dans le sens utilisé par
+    // GL et les solveurs. Seule la zone segmentée est écrite, avec les deux
+    // pixels voisins lus par le shader à droite et en bas
+    inputSlot &lSlot = mInputSlots[mWriteSlot];
+    cv::Rect lDataRoi(mXMin, mYMin, mXMax-mXMin+2, mYMax-mYMin+2);
+    lDataRoi &= cv::Rect(0, 0, mImgSize[0], mImgSize[1]);
+    writeCosts(lSlot.costs, pBGCosts, pFGCosts, pBG, pFG, lDataRoi);
+    lSlot.inputBytes = lDataRoi.area()*sizeof(cv::Vec2w);
+    lSlot.regionCount = 0;
+
+    lSlot.xMin = mXMin;
+    lSlot.xMax = mXMax;
+    lSlot.yMin = mYMin;
+    lSlot.yMax = mYMax;
+
+    return publishSlot(pImg, lStartTime);
+}
 
-    // Opération atomique, on signale que les textures ont changé
-    mInputCounter++;
+/**********************/
+unsigned int colorSegment::setCosts(cv::Mat &pImg, std::vector<costRegion> &pRegions)
+{
+    auto lStartTime = std::chrono::high_resolution_clock::now();
 
-    return true;
+    // Chaque zone doit être valide : sinon, c'est tout le groupe qui est refusé
+    bool lValid = checkMatrix(pImg, CV_8UC3) && !pRegions.empty();
+    for(size_t i=0; i<pRegions.size() && lValid; i++)
+    {
+        costRegion &lRegion = pRegions[i];
+        lValid &= checkMatrix(lRegion.bgCosts, CV_16UC1);
+        lValid &= checkMatrix(lRegion.fgCosts, CV_16UC1);
+        lValid &= checkMatrix(lRegion.bg, CV_8UC1);
+        lValid &= checkMatrix(lRegion.fg, CV_8UC1);
+        lValid &= lRegion.xMin < lRegion.xMax && lRegion.xMax <= (unsigned int)mImgSize[0];
+        lValid &= lRegion.yMin < lRegion.yMax && lRegion.yMax <= (unsigned int)mImgSize[1];
+    }
+
+    if(!lValid)
+        return 0;
+
+    inputSlot &lSlot = mInputSlots[mWriteSlot];
+    while(lSlot.regionCosts.size() < pRegions.size())
+        lSlot.regionCosts.push_back(cv::Mat(mImgSize[1], mImgSize[0], CV_16UC2));
+    lSlot.regionRois.resize(pRegions.size());
+
+    // Seule la zone de chaque objet est écrite. Les limites de l'emplacement
+    // englobent toutes les zones, pour les stats
+    cv::Rect lBounds;
+    lSlot.inputBytes = 0;
+    for(size_t i=0; i<pRegions.size(); i++)
+    {
+        costRegion &lRegion = pRegions[i];
+        cv::Rect lRoi(lRegion.xMin, lRegion.yMin, lRegion.xMax - lRegion.xMin, lRegion.yMax - lRegion.yMin);
+        writeCosts(lSlot.regionCosts[i], lRegion.bgCosts, lRegion.fgCosts, lRegion.bg, lRegion.fg, lRoi);
+        lSlot.regionRois[i] = lRoi;
+        lSlot.inputBytes += lRoi.area()*sizeof(cv::Vec2w);
+        lBounds = (i == 0) ? lRoi : (lBounds | lRoi);
+    }
+    lSlot.regionCount = pRegions.size();
+
+    lSlot.xMin = lBounds.x;
+    lSlot.xMax = lBounds.x + lBounds.width;
+    lSlot.yMin = lBounds.y;
+    lSlot.yMax = lBounds.y + lBounds.height;
+
+    return publishSlot(pImg, lStartTime);
+}
+
+/**********************/
+void colorSegment::writeCosts(cv::Mat &pCosts, cv::Mat &pBGCosts, cv::Mat &pFGCosts, cv::Mat &pBG, cv::Mat &pFG, cv::Rect pRoi)
+{
+    // On calcul notre matrice des coûts, combinaison des coûts de données
+    // du FG, BG, et des zones déjà fixée par pBG et pFG
+    // Du fait de l'utilisation en opengl plus tard, on décalera le zéro à 32767
+    // (OpenGL n'est pas fan des valeurs négatives)
+    for(int y=pRoi.y; y<pRoi.y+pRoi.height; y++)
+    {
+        int lSourceY = mImgSize[1]-1-y;
+        const ushort* lBGRow = pBGCosts.ptr<ushort>(lSourceY);
+        const ushort* lFGRow = pFGCosts.ptr<ushort>(lSourceY);
+        const uchar* lBGMaskRow = pBG.ptr<uchar>(lSourceY);
+        const uchar* lFGMaskRow = pFG.ptr<uchar>(lSourceY);
+        cv::Vec2w* lCostsRow = pCosts.ptr<cv::Vec2w>(y);
+
+        for(int x=pRoi.x; x<pRoi.x+pRoi.width; x++)
+        {
+            // Si on est dans un des masques, on le note comme tel
+            // avec une valeur facilement repérable !
+            if(lFGMaskRow[x] == 255)
+            {
+                lCostsRow[x][0] = 65535;
+                lCostsRow[x][1] = 0;
+            }
+            else if(lBGMaskRow[x] == 255)
+            {
+                lCostsRow[x][0] = 0;
+                lCostsRow[x][1] = 65535;
+            }
+            // Sinon, on copie juste les valeurs des coûts
+            else
+            {
+                lCostsRow[x][0] = lFGRow[x];
+                lCostsRow[x][1] = lBGRow[x];
+            }
+        }
+    }
+}
+
+/**********************/
+unsigned int colorSegment::publishSlot(cv::Mat &pImg, std::chrono::high_resolution_clock::time_point pStartTime)
+{
+    inputSlot &lSlot = mInputSlots[mWriteSlot];
+
+    // Seules les lignes de la zone segmentée sont copiées, plus celle du
+    // dessous lue par les coûts de lissage, sauf si l'image entière est
+    // affichée dans la fenêtre GL
+    int lFirst = 0;
+    int lLast = mImgSize[1];
+    if(mIsHeadless || mGraphType != GRAPH_FBO || lSlot.regionCount > 0)
+    {
+        lFirst = lSlot.yMin;
+        lLast = std::min((int)lSlot.yMax+1, mImgSize[1]);
+    }
+    for(int y=lFirst; y<lLast; y++)
+        memcpy(lSlot.img.ptr(y), pImg.ptr(mImgSize[1]-1-y), mImgSize[0]*3);
+    lSlot.inputBytes += (lLast-lFirst)*mImgSize[0]*3;
+
+    unsigned int lTicket = ++mInputCounter;
+    lSlot.ticket = lTicket;
+    lSlot.time = std::chrono::high_resolution_clock::now();
+    lSlot.buildDuration = std::chrono::duration_cast<std::chrono::microseconds>(lSlot.time - pStartTime).count() / 1000.f;
+
+    // Publication de l'emplacement : on récupère en échange le précédent
+    // emplacement publié, que le thread de calcul n'a pas (ou plus) en main
+    unsigned int lPrevious = mReadySlot.fetch_and_store(mWriteSlot | __SLOT_FRESH__);
+    mWriteSlot = lPrevious & __SLOT_INDEX__;
+
+    // Le mutex ne protège aucune donnée : il évite seulement que le signal
+    // arrive entre le test du thread de calcul et sa mise en attente
+    mImgMutex.lock();
+    mImgMutex.unlock();
+    mInputCondition.notify_one();
+
+    return lTicket;
 }
 
 /**********************/
 bool colorSegment::getSegment(cv::Mat &pSegment)
 {
-    cv::Mat lLabel;
+    return readSegment(pSegment, NULL);
+}
+
+/**********************/
+bool colorSegment::getSegment(cv::Mat &pSegment, unsigned int pTicket, unsigned int pTimeout, unsigned int *pSolvedTicket)
+{
+    return waitSegment(pSegment, NULL, pTicket, pTimeout, pSolvedTicket);
+}
+
+/**********************/
+bool colorSegment::getSegment(cv::Mat &pSegment, cv::Rect &pRoi)
+{
+    return readSegment(pSegment, &pRoi);
+}
 
-    static int lPreviousCounter = std::numeric_limits<int>::max();
-    int lCurrentCounter;
+/**********************/
+bool colorSegment::getSegment(cv::Mat &pSegment, cv::Rect &pRoi, unsigned int pTicket, unsigned int pTimeout, unsigned int *pSolvedTicket)
+{
+    return waitSegment(pSegment, &pRoi, pTicket, pTimeout, pSolvedTicket);
+}
 
-    lCurrentCounter = mLabelCounter;
-    if(lCurrentCounter != lPreviousCounter)
+/**********************/
+bool colorSegment::readSegment(cv::Mat &pSegment, cv::Rect *pRoi)
+{
+    unsigned int lCurrentCounter = mLabelCounter;
+    if(lCurrentCounter != mReadCounter)
     {
-        // On récupère la segmentation actuelle
+        mReadCounter = lCurrentCounter;
+
         mLabelMutex.lock();
-        lLabel = mLabels.clone();
+        copySegment(pSegment, pRoi);
         mLabelMutex.unlock();
 
-        // On la reformate pour enlever les noeuds en trop
-        pSegment = cv::Mat(mImgSize[1], mImgSize[0], CV_8UC1);
+        return true;
+    }
+
+    return false;
+}
+
+/**********************/
+bool colorSegment::waitSegment(cv::Mat &pSegment, cv::Rect *pRoi, unsigned int pTicket, unsigned int pTimeout, unsigned int *pSolvedTicket)
+{
+    if(pTicket == 0)
+        return false;
+
+    boost::unique_lock<boost::mutex> lLock(mLabelMutex);
+
+    // Attente de la résolution de l'image demandée (ou d'une image plus récente,
+    // si le thread de calcul a sauté celle-ci)
+    boost::system_time lDeadline = boost::get_system_time() + boost::posix_time::milliseconds(pTimeout);
+    while(mSolvedTicket < pTicket)
+    {
+        if(!mIsRunning)
+            return false;
+        if(!mLabelCondition.timed_wait(lLock, lDeadline))
+            return false;
+    }
+
+    copySegment(pSegment, pRoi);
+    mReadCounter = mLabelCounter;
+    if(pSolvedTicket != NULL)
+        *pSolvedTicket = mSolvedTicket;
+
+    return true;
+}
+
+/**********************/
+void colorSegment::publishMetrics()
+{
+    // Allocations faites depuis le début de l'image traitée par le thread
+    mMetrics.allocations = mArena.getFrameAllocations() + mGraphcut.getAllocationCount() - mGraphAllocations;
+    mMetrics.allocatedBytes = mArena.getFrameBytes();
+    mSolvedMetrics = mMetrics;
+}
+
+/**********************/
+void colorSegment::copySegment(cv::Mat &pSegment, cv::Rect *pRoi)
+{
+    // pSegment n'est réalloué que si ses dimensions ne conviennent pas,
+    // ce qui permet à l'appelant de réutiliser la même matrice
+    cv::Rect lRoi(0, 0, mImgSize[0], mImgSize[1]);
+
+    // Après une résolution groupée, c'est le numéro de l'objet qui est copié,
+    // la zone englobant celles de tous les objets
+    if(mIsRegionLabels)
+    {
+        if(pRoi != NULL)
+        {
+            lRoi = cv::Rect();
+            for(size_t i=0; i<mRegionLabelsRois.size(); i++)
+                lRoi = (i == 0) ? mRegionLabelsRois[i] : (lRoi | mRegionLabelsRois[i]);
+            *pRoi = lRoi;
+        }
+        mRegionLabels(lRoi).copyTo(pSegment);
+        return;
+    }
 
-        for(int y=0; y<mFBOSize[1]; y+=2)
+    // Avec le graphe natif, les labels sont directement à la bonne résolution
+    if(mIsNativeLabels)
+    {
+        if(pRoi != NULL)
         {
-            for(int x=0; x<mFBOSize[0]; x+=2)
-            {
-                pSegment.at<char>(y/2, x/2) = lLabel.at<char>(y, x)*255;
-            }
+            lRoi = mNativeLabelsRoi;
+            *pRoi = lRoi;
         }
+        mNativeLabels(lRoi).convertTo(pSegment, CV_8U, 255);
+        return;
+    }
 
-        return true;
+    // Sinon on reformate la segmentation actuelle pour enlever les noeuds en trop
+    if(pRoi != NULL)
+    {
+        lRoi = cv::Rect(mLabelsRoi.x/2, mLabelsRoi.y/2, mLabelsRoi.width/2, mLabelsRoi.height/2);
+        *pRoi = lRoi;
     }
+    pSegment.create(lRoi.height, lRoi.width, CV_8UC1);
 
-    return false;
+    for(int y=0; y<lRoi.height; y++)
+    {
+        const uchar* lLabelRow = mLabels.ptr<uchar>((lRoi.y+y)*2) + lRoi.x*2;
+        uchar* lSegmentRow = pSegment.ptr<uchar>(y);
+        for(int x=0; x<lRoi.width; x++)
+        {
+            lSegmentRow[x] = lLabelRow[x*2]*255;
+        }
+    }
 }
 
 /**********************/
-cv::Mat colorSegment::smoothCostsColor(cv::Mat &pImg)
+cv::Mat colorSegment::smoothCostsColor(cv::Mat &pImg, cv::Rect pRoi)
 {
     cv::Mat lCosts;
 
     if(!checkMatrix(pImg, CV_8UC3))
         return lCosts;
 
-    // Conversion de l'image en HSV
-    cv::Mat lHSV;
-    cv::cvtColor(pImg, lHSV, CV_BGR2HSV);
+    // Seule la zone pRoi est calculée, ce qui demande les pixels
+    // voisins à droite et en bas
+    pRoi &= cv::Rect(0, 0, pImg.cols, pImg.rows);
+    cv::Rect lExtended(pRoi.x, pRoi.y, std::min(pRoi.width+1, pImg.cols-pRoi.x), std::min(pRoi.height+1, pImg.rows-pRoi.y));
+    cv::Mat lImg = pImg(lExtended);
 
-    // Recherche des contours (Canny edge detector)
-    cv::Mat lGray;
-    cv::Mat lEdges;
+#ifdef __DEBUG_GC__
+    auto lStartTime = std::chrono::high_resolution_clock::now();
+#endif
 
-    cv::cvtColor(pImg, lGray, CV_BGR2GRAY);
-    cv::Canny(lGray, lEdges, 30.f, 50.f);
+    // Les matrices intermédiaires sont prises dans mArena, et ont déjà
+    // les bonnes dimensions : cvtColor ne les réalloue pas
+    // Conversion de l'image en HSV, et en niveaux de gris
+    cv::Mat lHSV = mArena.getMat(SLOT_HSV, pImg.rows, pImg.cols, CV_8UC3)(lExtended);
+    cv::Mat lGray = mArena.getMat(SLOT_GRAY, pImg.rows, pImg.cols, CV_8UC1)(lExtended);
+    cv::cvtColor(lImg, lHSV, CV_BGR2HSV);
+    cv::cvtColor(lImg, lGray, CV_BGR2GRAY);
 
-    // Calcul des coûts. On a besoin de 3 itérateurs :
-    // celui sur le pixel en cours, le pixel à droite, le pixel en bas
-    // Les coûts sur les bords doivent être nuls, on les annulera plus tard
-    lCosts = cv::Mat::zeros(pImg.rows, pImg.cols, CV_16UC2);
-    cv::MatIterator_<cv::Vec2w> lCostsIt = lCosts.begin<cv::Vec2w>();
-    cv::MatConstIterator_<cv::Vec3b> lPixIt = lHSV.begin<cv::Vec3b>();
-    cv::MatConstIterator_<cv::Vec3b> lPixHIt = lPixIt++;
-    cv::MatConstIterator_<cv::Vec3b> lPixVIt = lPixIt + pImg.cols;
-    cv::MatConstIterator_<uchar> lGrayIt = lGray.begin<uchar>();
-    cv::MatConstIterator_<uchar> lGrayHIt = lGrayIt++;
-    cv::MatConstIterator_<uchar> lGrayVIt = lGrayIt + pImg.cols;
+    // Tables de conversion HSV vers cartésien, et d'exponentielle
+    updateSmoothTables();
 
-    cv::MatConstIterator_<cv::Vec3b> lEnd = lHSV.end<cv::Vec3b>();
+    // La matrice a la taille de l'image, mais rien n'est écrit hors de pRoi
+    lCosts = mArena.getMat(SLOT_SMOOTH, pImg.rows, pImg.cols, CV_16UC2);
 
-    for(; lPixIt < lEnd; lPixIt++, lCostsIt++, lPixHIt++, lPixVIt++
-        , lGrayIt++, lGrayHIt++, lGrayVIt++)
+    // Calcul par bandes de lignes, chaque ligne étant indépendante
+    int lBandCount = std::min((int)mThreadCount, pRoi.height/__SMOOTH_MIN_BAND__);
+    if(lBandCount > 1)
     {
-        // On vérifie que l'itérateur vertical ne sort pas de l'image
-        if(lPixVIt >= lEnd)
+        // Les bandes sont réparties sur le pool partagé avec les GMM
+        threadPool::getInstance().parallelFor(0, lBandCount, 1, [&] (int pFirst, int pLast)
         {
-            lPixVIt = lHSV.begin<cv::Vec3b>();
-            lGrayVIt = lGray.begin<uchar>();
-        }
-
-        cv::Vec3f lP, lQ, lR; // Nos trois pixels convertis dans des formats plus traditionnels
-        float lX, lY;
-        lX = (float)(*lPixIt)[0] * 2.f;
-        lY = (float)(*lPixIt)[1] / 255.f;
-        lP[0] = lY*cos(lX*M_PI/180.f);
-        lP[1] = lY*sin(lX*M_PI/180.f);
-        lP[2] = (float)(*lPixIt)[2] / 255.f;
+            for(int t=pFirst; t<pLast; t++)
+                smoothCostsRows(lHSV, lGray, lCosts, pRoi, pRoi.height*t/lBandCount, pRoi.height*(t+1)/lBandCount);
+        } );
+    }
+    else
+        smoothCostsRows(lHSV, lGray, lCosts, pRoi, 0, pRoi.height);
 
-        lX = (float)(*lPixHIt)[0] * 2.f;
-        lY = (float)(*lPixHIt)[1] / 255.f;
-        lQ[0] = lY*cos(lX*M_PI/180.f);
-        lQ[1] = lY*sin(lX*M_PI/180.f);
-        lQ[2] = (float)(*lPixHIt)[2] / 255.f;
+#ifdef __DEBUG_GC__
+    // Comparaison avec le calcul direct, pixel par pixel
+    auto lEndTime = std::chrono::high_resolution_clock::now();
 
-        lX = (float)(*lPixVIt)[0] * 2.f;
-        lY = (float)(*lPixVIt)[1] / 255.f;
-        lR[0] = lY*cos(lX*M_PI/180.f);
-        lR[1] = lY*sin(lX*M_PI/180.f);
-        lR[2] = (float)(*lPixVIt)[2] / 255.f;
+    cv::Mat lReference = cv::Mat::zeros(pImg.rows, pImg.cols, CV_16UC2);
+    smoothCostsReference(pImg, pRoi, lReference);
+    auto lReferenceTime = std::chrono::high_resolution_clock::now();
 
-        (*lCostsIt)[0] = expf(-((lP[0]-lQ[0])*(lP[0]-lQ[0])+(lP[1]-lQ[1])*(lP[1]-lQ[1])+(lP[2]-lQ[2])*(lP[2]-lQ[2]))/(2.f*mSigmaCam*mSigmaCam)) * mMaxSmoothCost;
-        if(*lGrayIt == 0 && *lGrayHIt == 0)
-            (*lCostsIt)[0] += mCannyCost;
+    int lDifferences = 0;
+    for(int y=pRoi.y; y<pRoi.y+pRoi.height; y++)
+        for(int x=pRoi.x; x<pRoi.x+pRoi.width; x++)
+        {
+            const cv::Vec2w &lRef = lReference.at<cv::Vec2w>(y, x);
+            const cv::Vec2w &lCost = lCosts.at<cv::Vec2w>(y, x);
+            if(lRef[0] != lCost[0] || lRef[1] != lCost[1])
+                lDifferences++;
+        }
 
-        (*lCostsIt)[1] = expf(-((lP[0]-lR[0])*(lP[0]-lR[0])+(lP[1]-lR[1])*(lP[1]-lR[1])+(lP[2]-lR[2])*(lP[2]-lR[2]))/(2.f*mSigmaCam*mSigmaCam)) * mMaxSmoothCost;
-        if(*lGrayIt == 0 && *lGrayVIt == 0)
-            (*lCostsIt)[1] += mCannyCost;
-    }
+    std::cerr << "Smooth costs: " << std::chrono::duration_cast<std::chrono::microseconds>(lEndTime - lStartTime).count() / 1000.f
+              << " ms against " << std::chrono::duration_cast<std::chrono::microseconds>(lReferenceTime - lEndTime).count() / 1000.f
+              << " ms, " << lDifferences << " different costs out of " << pRoi.area() << std::endl;
+#endif
 
 #ifdef __DEBUG_GC__
     std::vector<cv::Mat> channels;
@@ -278,36 +639,238 @@ cv::Mat colorSegment::smoothCostsColor(cv::Mat &pImg)
 }
 
 /**********************/
-bool colorSegment::initGL()
+void colorSegment::updateSmoothTables()
 {
-    // Initialisation de tout ce qui est GL
-    if(!glfwInit())
+    // Teinte (sur 180) et saturation vers le plan chromatique
+    if(mHueTable.empty())
     {
-        std::cerr << "Failed to create GL context." << std::endl;
-        glfwTerminate();
-        return false;
+        mHueTable.resize(180*256*2);
+        for(int h=0; h<180; h++)
+            for(int s=0; s<256; s++)
+            {
+                float lX = (float)h * 2.f;
+                float lY = (float)s / 255.f;
+                mHueTable[(h*256+s)*2] = lY*cos(lX*M_PI/180.f);
+                mHueTable[(h*256+s)*2+1] = lY*sin(lX*M_PI/180.f);
+            }
     }
 
-    glfwOpenWindowHint(GLFW_FSAA_SAMPLES, 0);
-    glfwOpenWindowHint(GLFW_OPENGL_VERSION_MAJOR, 3);
-    glfwOpenWindowHint(GLFW_OPENGL_VERSION_MINOR, 2);
-    glfwOpenWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    // Coût en fonction du carré de la distance entre deux couleurs, qui ne
+    // dépasse pas 5 (2 dans le plan chromatique, 1 pour la valeur)
+    if(mExpTable.empty() || mExpTableSigma != mSigmaCam || mExpTableCost != mMaxSmoothCost)
+    {
+        int lSize = (int)(5.f*__SMOOTH_TABLE_SCALE__) + 2;
+        mExpTable.resize(lSize);
+        for(int i=0; i<lSize; i++)
+            mExpTable[i] = expf(-((float)i/__SMOOTH_TABLE_SCALE__)/(2.f*mSigmaCam*mSigmaCam)) * mMaxSmoothCost;
+
+        mExpTableSigma = mSigmaCam;
+        mExpTableCost = mMaxSmoothCost;
+    }
+}
 
-    if(!glfwOpenWindow(mImgSize[0], mImgSize[1], 0, 0, 0, 0, 0, 0, GLFW_WINDOW))
+/**********************/
+void colorSegment::smoothCostsRows(const cv::Mat &pHSV, const cv::Mat &pGray, cv::Mat &pCosts, cv::Rect pRoi, int pBegin, int pEnd)
+{
+    // Coordonnées cartésiennes des lignes courante et suivante, la colonne
+    // supplémentaire étant celle du voisin de droite du dernier pixel
+    int lWidth = pRoi.width;
+    std::vector<float> lRows(6*(lWidth+1));
+    float* lCurrent = &lRows[0];
+    float* lNext = &lRows[3*(lWidth+1)];
+
+    auto toCartesian = [&] (int pRow, float* pDest)
     {
-        std::cerr << "Failed to crqeate GL window." << std::endl;
-        glfwTerminate();
-        return false;
+        const uchar* lPix = pHSV.ptr<uchar>(pRow);
+        float* lA = pDest;
+        float* lB = pDest + (lWidth+1);
+        float* lV = pDest + 2*(lWidth+1);
+        for(int x=0; x<pHSV.cols; x++)
+        {
+            const float* lEntry = &mHueTable[(lPix[x*3]*256 + lPix[x*3+1])*2];
+            lA[x] = lEntry[0];
+            lB[x] = lEntry[1];
+            lV[x] = (float)lPix[x*3+2] / 255.f;
+        }
+        // Au bord de l'image, le voisin de droite est le pixel lui-même
+        if(pHSV.cols == lWidth)
+        {
+            lA[lWidth] = lA[lWidth-1];
+            lB[lWidth] = lB[lWidth-1];
+            lV[lWidth] = lV[lWidth-1];
+        }
+    };
+
+    const float* lTable = &mExpTable[0];
+    int lTableMax = (int)mExpTable.size() - 2;
+    auto lookup = [&] (float pDistance) -> ushort
+    {
+        float lPos = pDistance * __SMOOTH_TABLE_SCALE__;
+        int lIndex = std::min((int)lPos, lTableMax);
+        float lFrac = lPos - (float)lIndex;
+        return (ushort)(lTable[lIndex] + (lTable[lIndex+1] - lTable[lIndex])*lFrac);
+    };
+
+    toCartesian(pBegin, lCurrent);
+    for(int y=pBegin; y<pEnd; y++)
+    {
+        int lDown = std::min(y+1, pHSV.rows-1);
+        toCartesian(lDown, lNext);
+
+        const float* lA = lCurrent;
+        const float* lB = lCurrent + (lWidth+1);
+        const float* lV = lCurrent + 2*(lWidth+1);
+        const float* lAN = lNext;
+        const float* lBN = lNext + (lWidth+1);
+        const float* lVN = lNext + 2*(lWidth+1);
+        const uchar* lGrayRow = pGray.ptr<uchar>(y);
+        const uchar* lGrayVRow = pGray.ptr<uchar>(lDown);
+        cv::Vec2w* lCostsRow = pCosts.ptr<cv::Vec2w>(pRoi.y+y) + pRoi.x;
+
+        // Carrés des distances vers la droite et vers le bas, 4 par 4
+        float lRight[4], lBottom[4];
+        int x = 0;
+#ifdef __SSE2__
+        for(; x+4<=lWidth; x+=4)
+        {
+            __m128 lPA = _mm_loadu_ps(lA+x);
+            __m128 lPB = _mm_loadu_ps(lB+x);
+            __m128 lPV = _mm_loadu_ps(lV+x);
+
+            __m128 lDA = _mm_sub_ps(lPA, _mm_loadu_ps(lA+x+1));
+            __m128 lDB = _mm_sub_ps(lPB, _mm_loadu_ps(lB+x+1));
+            __m128 lDV = _mm_sub_ps(lPV, _mm_loadu_ps(lV+x+1));
+            _mm_storeu_ps(lRight, _mm_add_ps(_mm_add_ps(_mm_mul_ps(lDA, lDA), _mm_mul_ps(lDB, lDB)), _mm_mul_ps(lDV, lDV)));
+
+            lDA = _mm_sub_ps(lPA, _mm_loadu_ps(lAN+x));
+            lDB = _mm_sub_ps(lPB, _mm_loadu_ps(lBN+x));
+            lDV = _mm_sub_ps(lPV, _mm_loadu_ps(lVN+x));
+            _mm_storeu_ps(lBottom, _mm_add_ps(_mm_add_ps(_mm_mul_ps(lDA, lDA), _mm_mul_ps(lDB, lDB)), _mm_mul_ps(lDV, lDV)));
+
+            for(int i=0; i<4; i++)
+            {
+                lCostsRow[x+i][0] = lookup(lRight[i]);
+                if(lGrayRow[x+i] == 0 && lGrayRow[std::min(x+i+1, pGray.cols-1)] == 0)
+                    lCostsRow[x+i][0] += mCannyCost;
+                lCostsRow[x+i][1] = lookup(lBottom[i]);
+                if(lGrayRow[x+i] == 0 && lGrayVRow[x+i] == 0)
+                    lCostsRow[x+i][1] += mCannyCost;
+            }
+        }
+#endif
+        for(; x<lWidth; x++)
+        {
+            float lDA = lA[x]-lA[x+1], lDB = lB[x]-lB[x+1], lDV = lV[x]-lV[x+1];
+            lCostsRow[x][0] = lookup(lDA*lDA + lDB*lDB + lDV*lDV);
+            if(lGrayRow[x] == 0 && lGrayRow[std::min(x+1, pGray.cols-1)] == 0)
+                lCostsRow[x][0] += mCannyCost;
+
+            lDA = lA[x]-lAN[x]; lDB = lB[x]-lBN[x]; lDV = lV[x]-lVN[x];
+            lCostsRow[x][1] = lookup(lDA*lDA + lDB*lDB + lDV*lDV);
+            if(lGrayRow[x] == 0 && lGrayVRow[x] == 0)
+                lCostsRow[x][1] += mCannyCost;
+        }
+
+        std::swap(lCurrent, lNext);
+    }
+}
+
+#ifdef __DEBUG_GC__
+/**********************/
+void colorSegment::smoothCostsReference(cv::Mat &pImg, cv::Rect pRoi, cv::Mat &pCosts)
+{
+    // Calcul direct, avec les fonctions trigonométriques et exponentielle
+    cv::Rect lExtended(pRoi.x, pRoi.y, std::min(pRoi.width+1, pImg.cols-pRoi.x), std::min(pRoi.height+1, pImg.rows-pRoi.y));
+    cv::Mat lHSV, lGray;
+    cv::cvtColor(pImg(lExtended), lHSV, CV_BGR2HSV);
+    cv::cvtColor(pImg(lExtended), lGray, CV_BGR2GRAY);
+    cv::Mat lCosts = pCosts;
+
+    for(int y=0; y<pRoi.height; y++)
+    {
+        int lDown = std::min(y+1, lExtended.height-1);
+        const cv::Vec3b* lPixRow = lHSV.ptr<cv::Vec3b>(y);
+        const cv::Vec3b* lPixVRow = lHSV.ptr<cv::Vec3b>(lDown);
+        const uchar* lGrayRow = lGray.ptr<uchar>(y);
+        const uchar* lGrayVRow = lGray.ptr<uchar>(lDown);
+        cv::Vec2w* lCostsRow = lCosts.ptr<cv::Vec2w>(pRoi.y+y) + pRoi.x;
+
+        for(int x=0; x<pRoi.width; x++)
+        {
+            int lRight = std::min(x+1, lExtended.width-1);
+
+            cv::Vec3f lP, lQ, lR; // Nos trois pixels convertis dans des formats plus traditionnels
+            float lX, lY;
+            lX = (float)lPixRow[x][0] * 2.f;
+            lY = (float)lPixRow[x][1] / 255.f;
+            lP[0] = lY*cos(lX*M_PI/180.f);
+            lP[1] = lY*sin(lX*M_PI/180.f);
+            lP[2] = (float)lPixRow[x][2] / 255.f;
+
+            lX = (float)lPixRow[lRight][0] * 2.f;
+            lY = (float)lPixRow[lRight][1] / 255.f;
+            lQ[0] = lY*cos(lX*M_PI/180.f);
+            lQ[1] = lY*sin(lX*M_PI/180.f);
+            lQ[2] = (float)lPixRow[lRight][2] / 255.f;
+
+            lX = (float)lPixVRow[x][0] * 2.f;
+            lY = (float)lPixVRow[x][1] / 255.f;
+            lR[0] = lY*cos(lX*M_PI/180.f);
+            lR[1] = lY*sin(lX*M_PI/180.f);
+            lR[2] = (float)lPixVRow[x][2] / 255.f;
+
+            lCostsRow[x][0] = expf(-((lP[0]-lQ[0])*(lP[0]-lQ[0])+(lP[1]-lQ[1])*(lP[1]-lQ[1])+(lP[2]-lQ[2])*(lP[2]-lQ[2]))/(2.f*mSigmaCam*mSigmaCam)) * mMaxSmoothCost;
+            if(lGrayRow[x] == 0 && lGrayRow[lRight] == 0)
+                lCostsRow[x][0] += mCannyCost;
+
+            lCostsRow[x][1] = expf(-((lP[0]-lR[0])*(lP[0]-lR[0])+(lP[1]-lR[1])*(lP[1]-lR[1])+(lP[2]-lR[2])*(lP[2]-lR[2]))/(2.f*mSigmaCam*mSigmaCam)) * mMaxSmoothCost;
+            if(lGrayRow[x] == 0 && lGrayVRow[x] == 0)
+                lCostsRow[x][1] += mCannyCost;
+        }
+    }
+}
+#endif
+
+/**********************/
+bool colorSegment::initGL()
+{
+    // Initialisation de tout ce qui est GL
+    if(mIsHeadless)
+    {
+        // Pas de fenêtre : contexte EGL sans surface
+        if(!initEGL())
+            return false;
     }
+    else
+    {
+        if(!glfwInit())
+        {
+            std::cerr << "Failed to create GL context." << std::endl;
+            glfwTerminate();
+            return false;
+        }
+
+        glfwOpenWindowHint(GLFW_FSAA_SAMPLES, 0);
+        glfwOpenWindowHint(GLFW_OPENGL_VERSION_MAJOR, 3);
+        glfwOpenWindowHint(GLFW_OPENGL_VERSION_MINOR, 2);
+        glfwOpenWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
-    glfwSetWindowTitle("colorSegment");
-    glfwSwapInterval(1);
+        if(!glfwOpenWindow(mImgSize[0], mImgSize[1], 0, 0, 0, 0, 0, 0, GLFW_WINDOW))
+        {
+            std::cerr << "Failed to crqeate GL window." << std::endl;
+            glfwTerminate();
+            return false;
+        }
+
+        glfwSetWindowTitle("colorSegment");
+        glfwSwapInterval(1);
+    }
     glClearColor(0.f, 0.f, 0.f, 1.f);
 
     prepareGeometry();
     prepareTexture();
     prepareFBO();
-    //preparePBO();
+    preparePBO();
 
     mShaderValid = compileShader();
     if(!mShaderValid)
@@ -318,12 +881,83 @@ bool colorSegment::initGL()
     return true;
 }
 
-/************************************/
-bool colorSegment::initNPP()
+/**********************/
+bool colorSegment::initEGL()
 {
-    NppGpuComputeCapability lResult = nppGetGpuComputeCapability();
+#ifdef HAVE_EGL
+    mEGLDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if(mEGLDisplay == EGL_NO_DISPLAY || !eglInitialize(mEGLDisplay, NULL, NULL))
+    {
+        std::cerr << "Failed to initialize EGL display." << std::endl;
+        return false;
+    }
 
-    switch(lResult)
+    const EGLint lConfigAttribs[] = {EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+                                     EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+                                     EGL_NONE};
+    EGLConfig lConfig;
+    EGLint lConfigCount = 0;
+    if(!eglChooseConfig(mEGLDisplay, lConfigAttribs, &lConfig, 1, &lConfigCount) || lConfigCount == 0
+       || !eglBindAPI(EGL_OPENGL_API))
+    {
+        std::cerr << "No suitable EGL configuration." << std::endl;
+        eglTerminate(mEGLDisplay);
+        return false;
+    }
+
+    // Même contexte que celui demandé à GLFW : OpenGL 3.2 core
+    const EGLint lContextAttribs[] = {EGL_CONTEXT_MAJOR_VERSION, 3,
+                                      EGL_CONTEXT_MINOR_VERSION, 2,
+                                      EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+                                      EGL_NONE};
+    mEGLContext = eglCreateContext(mEGLDisplay, lConfig, EGL_NO_CONTEXT, lContextAttribs);
+    if(mEGLContext == EGL_NO_CONTEXT)
+    {
+        std::cerr << "Failed to create EGL context." << std::endl;
+        eglTerminate(mEGLDisplay);
+        return false;
+    }
+
+    // Tout le rendu se fait dans le FBO : on se passe de surface si le pilote
+    // le permet, sinon on se contente d'un pbuffer minimal
+    mEGLSurface = EGL_NO_SURFACE;
+    if(!eglMakeCurrent(mEGLDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, mEGLContext))
+    {
+        const EGLint lPbufferAttribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+        mEGLSurface = eglCreatePbufferSurface(mEGLDisplay, lConfig, lPbufferAttribs);
+        if(mEGLSurface == EGL_NO_SURFACE || !eglMakeCurrent(mEGLDisplay, mEGLSurface, mEGLSurface, mEGLContext))
+        {
+            std::cerr << "Failed to make EGL context current." << std::endl;
+            releaseEGL();
+            return false;
+        }
+    }
+
+    return true;
+#else
+    std::cerr << "Headless mode needs EGL, which was not found at configure time." << std::endl;
+    return false;
+#endif
+}
+
+/**********************/
+void colorSegment::releaseEGL()
+{
+#ifdef HAVE_EGL
+    eglMakeCurrent(mEGLDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if(mEGLSurface != EGL_NO_SURFACE)
+        eglDestroySurface(mEGLDisplay, mEGLSurface);
+    eglDestroyContext(mEGLDisplay, mEGLContext);
+    eglTerminate(mEGLDisplay);
+#endif
+}
+
+/************************************/
+bool colorSegment::initNPP()
+{
+    NppGpuComputeCapability lResult = nppGetGpuComputeCapability();
+
+    switch(lResult)
     {
     case NPP_CUDA_1_0:
         std::cerr << "CUDA version 1.0 detected." << std::endl;
@@ -366,9 +1000,9 @@ bool colorSegment::initCUDA()
     // Sélection du device GL
 //    cutilSafeCall(cudaGLSetGLDevice(cutGetMaxGflopsDeviceId()));
 
-//    cutilSafeCall(cudaGraphicsGLRegisterBuffer(&mCudaResources[0], mPBO[0], cudaGraphicsMapFlagsReadOnly));
-//    cutilSafeCall(cudaGraphicsGLRegisterBuffer(&mCudaResources[1], mPBO[1], cudaGraphicsMapFlagsReadOnly));
-//    cutilSafeCall(cudaGraphicsGLRegisterBuffer(&mCudaResources[2], mPBO[2], cudaGraphicsMapFlagsReadOnly));
+//    cutilSafeCall(cudaGraphicsGLRegisterBuffer(&mCudaResources[0], mReadbacks[0].pbo[0], cudaGraphicsMapFlagsReadOnly));
+//    cutilSafeCall(cudaGraphicsGLRegisterBuffer(&mCudaResources[1], mReadbacks[0].pbo[1], cudaGraphicsMapFlagsReadOnly));
+//    cutilSafeCall(cudaGraphicsGLRegisterBuffer(&mCudaResources[2], mReadbacks[0].pbo[2], cudaGraphicsMapFlagsReadOnly));
 
 //    return true;
 }
@@ -376,45 +1010,229 @@ bool colorSegment::initCUDA()
 /**********************/
 void colorSegment::mainLoop()
 {
-    static unsigned int lPreviousValue = std::numeric_limits<unsigned int>::max();
-    unsigned int lCurrentValue;
-
-    initGL();
     //initCUDA();
 
-    mIsRunning = true;
+    // Mesure du temps CPU consommé par ce thread entre deux images
+    timespec lCpuTime;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &lCpuTime);
+    double lPreviousCpuTime = lCpuTime.tv_sec + lCpuTime.tv_nsec*1e-9;
+    auto lPreviousWakeTime = std::chrono::high_resolution_clock::now();
+
     while(mIsRunning)
     {
-        // Mise à jour des textures
-        lCurrentValue = mInputCounter;
-        if(lCurrentValue != lPreviousValue)
+        // Le contexte GL n'est créé que si on en a besoin
+        graphType lGraphType = mGraphType;
+        if(lGraphType == GRAPH_FBO && !mIsGLReady)
         {
-            mImgMutex.lock();
-            updateTextures(mImg, mDataCosts);
-            mXMin_t = mXMin;
-            mXMax_t = mXMax;
-            mYMin_t = mYMin;
-            mYMax_t = mYMax;
-            mImgMutex.unlock();
-
-            // Rendu OpenGL
-            drawGL();
-
-            // Cuda / Npp
-            computeCuda();
+            mIsGLReady = initGL();
+            if(!mIsGLReady)
+            {
+                std::cerr << "Unable to initialize GL, stopping segmentation." << std::endl;
+                break;
+            }
         }
-        lPreviousValue = lCurrentValue;
 
-        if(glfwGetKey(GLFW_KEY_ESC) || !glfwGetWindowParam(GLFW_OPENED))
-            mIsRunning = false;
+        // Attente de nouvelles données. Si une fenêtre GL est ouverte, on se
+        // réveille régulièrement pour traiter ses évènements (voir plus bas)
+        if(!mIsPolling)
+        {
+            boost::unique_lock<boost::mutex> lLock(mImgMutex);
+            while(mIsRunning && !(mReadySlot & __SLOT_FRESH__))
+            {
+                if(mIsGLReady && !mIsHeadless)
+                {
+                    boost::system_time lTimeout = boost::get_system_time() + boost::posix_time::milliseconds(__GL_EVENT_PERIOD__);
+                    if(!mInputCondition.timed_wait(lLock, lTimeout))
+                        break;
+                }
+                else
+                    mInputCondition.wait(lLock);
+            }
+        }
+        if(!mIsRunning)
+            break;
+
+        // Prise en main des dernières données publiées, le précédent emplacement
+        // étant rendu au producteur
+        if(mReadySlot & __SLOT_FRESH__)
+        {
+            mReadSlot = mReadySlot.fetch_and_store(mReadSlot) & __SLOT_INDEX__;
+            inputSlot &lSlot = mInputSlots[mReadSlot];
+
+#ifdef __DEBUG_GC__
+            cv::Mat lDebugImg, lDebugCosts;
+#endif
+            // Compteurs d'allocations et de transferts pour cette image
+            mArena.newFrame();
+            mGraphAllocations = mGraphcut.getAllocationCount();
+
+            // Ticket des données lues, transmis avec les labels, ainsi que
+            // les mesures de cette image
+            mCurrentTicket = lSlot.ticket;
+            mMetrics = frameMetrics();
+            mMetrics.ticket = lSlot.ticket;
+            mMetrics.costBuild = lSlot.buildDuration;
+            mMetrics.inputBytes = lSlot.inputBytes;
+
+            // Latence de réveil, et charge CPU du thread depuis l'image précédente
+            auto lWakeTime = std::chrono::high_resolution_clock::now();
+            mWakeLatency = std::chrono::duration_cast<std::chrono::microseconds>(lWakeTime - lSlot.time).count() / 1000.f;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &lCpuTime);
+            double lCurrentCpuTime = lCpuTime.tv_sec + lCpuTime.tv_nsec*1e-9;
+            double lWallTime = std::chrono::duration_cast<std::chrono::microseconds>(lWakeTime - lPreviousWakeTime).count() * 1e-6;
+            if(lWallTime > 0.0)
+                mWorkerLoad = (float)((lCurrentCpuTime - lPreviousCpuTime) / lWallTime);
+            lPreviousCpuTime = lCurrentCpuTime;
+            lPreviousWakeTime = lWakeTime;
+            mMetrics.queueWait = mWakeLatency;
+
+            // Les rendus encore en vol sont terminés avant de passer au graphe natif
+            if(lGraphType != GRAPH_FBO || lSlot.regionCount > 0)
+                finishReadbacks(0);
+
+            // Plusieurs zones : un seul graphe natif, quel que soit le mode choisi
+            if(lSlot.regionCount > 0)
+            {
+                mXMin_t = lSlot.xMin;
+                mXMax_t = lSlot.xMax;
+                mYMin_t = lSlot.yMin;
+                mYMax_t = lSlot.yMax;
+
+                solveRegions(lSlot);
+                mFrameAllocations = mArena.getFrameAllocations() + mGraphcut.getAllocationCount() - mGraphAllocations;
+                continue;
+            }
+
+            mXMin_t = lSlot.xMin;
+            mXMax_t = lSlot.xMax;
+            mYMin_t = lSlot.yMin;
+            mYMax_t = lSlot.yMax;
+
+            if(lGraphType == GRAPH_FBO)
+            {
+                // Il faut un emplacement libre pour le rapatriement de ce rendu
+                finishReadbacks(__READBACK_COUNT__-1);
+                auto lUploadTime = std::chrono::high_resolution_clock::now();
+                updateTextures(lSlot.img, lSlot.costs);
+                mMetrics.upload = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - lUploadTime).count() / 1000.f;
+            }
+            else
+            {
+                auto lSetupTime = std::chrono::high_resolution_clock::now();
+                updateGraphReuse(lGraphType);
+                buildNativeGraph(mGraphcut, lSlot.img, lSlot.costs, lGraphType);
+                mMetrics.graphSetup = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - lSetupTime).count() / 1000.f;
+            }
+#ifdef __DEBUG_GC__
+            lDebugImg = lSlot.img.clone();
+            lDebugCosts = lSlot.costs.clone();
+#endif
+
+            if(lGraphType == GRAPH_FBO)
+            {
+                // Rendu OpenGL, le rapatriement des textures étant asynchrone
+                drawGL();
+
+                // Si de nouvelles données attendent déjà, ce rapatriement se
+                // termine pendant leur rendu, et seuls les précédents sont résolus
+                // (Cuda / Npp, ou CPU). Sinon, on n'attend pas pour le résoudre
+                unsigned int lKeep = (mReadySlot & __SLOT_FRESH__) ? 1 : 0;
+#ifdef __DEBUG_GC__
+                lKeep = 0; // la comparaison porte sur l'image courante
+#endif
+                finishReadbacks(lKeep);
+
+#ifdef __DEBUG_GC__
+                // Comparaison avec le graphe natif
+                graphCut lNativeGraph;
+                buildNativeGraph(lNativeGraph, lDebugImg, lDebugCosts, GRAPH_NATIVE);
+                lNativeGraph.maxflow();
+
+                cv::Mat lNativeLabels = cv::Mat::zeros(mYMax_t - mYMin_t, mXMax_t - mXMin_t, CV_8UC1);
+                lNativeGraph.getLabels(lNativeLabels.data, lNativeLabels.cols);
+
+                int lDifferences = 0;
+                mLabelMutex.lock();
+                for(int y=0; y<lNativeLabels.rows; y++)
+                    for(int x=0; x<lNativeLabels.cols; x++)
+                        if(lNativeLabels.at<uchar>(y, x) != mLabels.at<uchar>((mYMin_t+y)*2, (mXMin_t+x)*2))
+                            lDifferences++;
+                mLabelMutex.unlock();
+
+                std::cerr << "Native graph: " << lDifferences << " different labels out of "
+                          << lNativeLabels.rows*lNativeLabels.cols << std::endl;
+#endif
+            }
+            else
+            {
+                computeNative(lGraphType);
+
+#ifdef __DEBUG_GC__
+                if(lGraphType == GRAPH_PYRAMID || lGraphType == GRAPH_SUPERPIXEL)
+                {
+                    // Comparaison avec la résolution complète
+                    float lApproxDuration = mGraphcutDuration;
+
+                    graphCut lFullGraph;
+                    buildNativeGraph(lFullGraph, lDebugImg, lDebugCosts, GRAPH_NATIVE);
+                    auto lStartTime = std::chrono::high_resolution_clock::now();
+                    lFullGraph.maxflow();
+                    auto lEndTime = std::chrono::high_resolution_clock::now();
+                    float lFullDuration = std::chrono::duration_cast<std::chrono::microseconds>(lEndTime - lStartTime).count() / 1000.f;
+
+                    cv::Mat lFullLabels = cv::Mat::zeros(mYMax_t - mYMin_t, mXMax_t - mXMin_t, CV_8UC1);
+                    lFullGraph.getLabels(lFullLabels.data, lFullLabels.cols);
+
+                    int lDifferences = 0;
+                    mLabelMutex.lock();
+                    for(int y=0; y<lFullLabels.rows; y++)
+                        for(int x=0; x<lFullLabels.cols; x++)
+                            if(lFullLabels.at<uchar>(y, x) != mNativeLabels.at<uchar>(mYMin_t+y, mXMin_t+x))
+                                lDifferences++;
+                    mLabelMutex.unlock();
+
+                    std::cerr << (lGraphType == GRAPH_PYRAMID ? "Pyramid: " : "Superpixels: ")
+                              << lDifferences << " different labels out of "
+                              << lFullLabels.rows*lFullLabels.cols << ", " << lApproxDuration
+                              << " ms against " << lFullDuration << " ms at full resolution" << std::endl;
+                }
+#endif
+            }
+
+            mFrameAllocations = mArena.getFrameAllocations() + mGraphcut.getAllocationCount() - mGraphAllocations;
+        }
+
+        // glfwGetKey et glfwGetWindowParam ne renvoient que l'état relevé par
+        // le dernier traitement des évènements : il est fait ici, y compris
+        // lors des réveils sans nouvelle image
+        if(mIsGLReady && !mIsHeadless)
+        {
+            glfwPollEvents();
+            if(glfwGetKey(GLFW_KEY_ESC) || !glfwGetWindowParam(GLFW_OPENED))
+                mIsRunning = false;
+        }
     }
+    mIsRunning = false;
 
-    glfwTerminate();
+    // Plus aucun label ne sera calculé
+    mLabelMutex.lock();
+    mLabelCondition.notify_all();
+    mLabelMutex.unlock();
+
+    if(mIsGLReady)
+    {
+        if(mIsHeadless)
+            releaseEGL();
+        else
+            glfwTerminate();
+    }
 }
 
 /**********************/
 void colorSegment::drawGL()
 {
+    auto lStartTime = std::chrono::high_resolution_clock::now();
+
     // On ne touche pas aux textures pendant le rendu
     // (non mais)
     // Envoi des données au shader
@@ -432,7 +1250,10 @@ void colorSegment::drawGL()
     // Résolution
     glUniform2fv(mResolutionLocation, 1, lImgSize);
 
+    // Le rendu (effacement compris) est limité à la zone segmentée
     glViewport(0, 0, mFBOSize[0], mFBOSize[1]);
+    glEnable(GL_SCISSOR_TEST);
+    glScissor(mXMin_t*2, mYMin_t*2, (mXMax_t-mXMin_t)*2, (mYMax_t-mYMin_t)*2);
     glUniform1i(mPassLocation, (GLint)1);
     GLenum lFBOBuf[] = {GL_COLOR_ATTACHMENT0,
                         GL_COLOR_ATTACHMENT1,
@@ -440,44 +1261,141 @@ void colorSegment::drawGL()
     glDrawBuffers(3, lFBOBuf);
     glClear(GL_COLOR_BUFFER_BIT);
     glDrawArrays(GL_TRIANGLES, 0, 6);
-
-    // Copie des trois textures attachées dans les trois PBO
-    /*glActiveTexture(GL_TEXTURE7);
+    glDisable(GL_SCISSOR_TEST);
+
+    // Rapatriement asynchrone de la zone segmentée des trois textures
+    // attachées, dans les PBO de l'emplacement suivant
+    readback &lReadback = mReadbacks[mReadbackHead];
+    lReadback.xMin = mXMin_t;
+    lReadback.xMax = mXMax_t;
+    lReadback.yMin = mYMin_t;
+    lReadback.yMax = mYMax_t;
+    lReadback.ticket = mCurrentTicket;
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, mFBO);
     for(int i=0; i<3; i++)
     {
-        glBindBuffer(GL_PIXEL_PACK_BUFFER, mPBO[i]);
-        glBindTexture(GL_TEXTURE_2D, mFBOTexture[i]);
-        glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_UNSIGNED_SHORT, NULL);
-        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
-    }*/
+        glReadBuffer(GL_COLOR_ATTACHMENT0+i);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, lReadback.pbo[i]);
+        glReadPixels(mXMin_t*2, mYMin_t*2, (mXMax_t-mXMin_t)*2, (mYMax_t-mYMin_t)*2, GL_RED, GL_UNSIGNED_SHORT, NULL);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    mMetrics.readbackBytes += (mXMax_t-mXMin_t)*2*(mYMax_t-mYMin_t)*2*3*sizeof(ushort);
+    lReadback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 
-    // Rendu de la fenêtre principale
+    mReadbackHead = (mReadbackHead+1) % __READBACK_COUNT__;
+    mPendingReadbacks++;
+
+    // Rendu de la fenêtre principale, s'il y en a une
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if(!mIsHeadless)
+    {
+        // Résolution
+        glUniform2iv(mResolutionLocation, 1, (GLint*)mImgSize);
 
-    // Résolution
-    glUniform2iv(mResolutionLocation, 1, (GLint*)mImgSize);
+        glViewport(0, 0, mImgSize[0], mImgSize[1]);
+        glUniform1i(mPassLocation, (GLint)0);
+        GLenum lBackbuffer[] = {GL_BACK};
+        glDrawBuffers(1, lBackbuffer);
+        glClear(GL_COLOR_BUFFER_BIT);
+        glDrawArrays(GL_TRIANGLES, 0, 6);
 
-    glViewport(0, 0, mImgSize[0], mImgSize[1]);
-    glUniform1i(mPassLocation, (GLint)0);
-    GLenum lBackbuffer[] = {GL_BACK};
-    glDrawBuffers(1, lBackbuffer);
-    glClear(GL_COLOR_BUFFER_BIT);
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+        glfwSwapBuffers();
+    }
 
-    glfwSwapBuffers();
+    // Seule la soumission des commandes est mesurée ici, l'attente
+    // du rapatriement l'étant dans finishReadbacks
+    auto lEndTime = std::chrono::high_resolution_clock::now();
+    mRenderDuration = std::chrono::duration_cast<std::chrono::microseconds>(lEndTime - lStartTime).count() / 1000.f;
 
-    // Copie des trois textures dans la mémoire cpu
-    glActiveTexture(GL_TEXTURE7);
-    for(int i=0; i<3; i++)
+    // Les mesures suivent le rendu jusqu'à sa résolution
+    mMetrics.render = mRenderDuration;
+    lReadback.metrics = mMetrics;
+}
+
+/**********************/
+void colorSegment::finishReadbacks(unsigned int pKeep)
+{
+    if(mPendingReadbacks <= pKeep)
+        return;
+
+    // Les données de l'image en cours sont rétablies une fois les
+    // rendus précédents résolus
+    unsigned int lXMin = mXMin_t, lXMax = mXMax_t, lYMin = mYMin_t, lYMax = mYMax_t;
+    unsigned int lTicket = mCurrentTicket;
+    frameMetrics lMetrics = mMetrics;
+
+    while(mPendingReadbacks > pKeep)
     {
-        glBindTexture(GL_TEXTURE_2D, mFBOTexture[i]);
-        glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_UNSIGNED_SHORT, mCPUData[i].data);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        unsigned int lIndex = (mReadbackHead + __READBACK_COUNT__ - mPendingReadbacks) % __READBACK_COUNT__;
+        readback &lReadback = mReadbacks[lIndex];
+
+        // La résolution porte sur les données de ce rendu
+        mXMin_t = lReadback.xMin;
+        mXMax_t = lReadback.xMax;
+        mYMin_t = lReadback.yMin;
+        mYMax_t = lReadback.yMax;
+        mCurrentTicket = lReadback.ticket;
+        mMetrics = lReadback.metrics;
+
+        auto lStartTime = std::chrono::high_resolution_clock::now();
+        GLenum lStatus;
+        do
+        {
+            lStatus = glClientWaitSync(lReadback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        } while(lStatus == GL_TIMEOUT_EXPIRED);
+        glDeleteSync(lReadback.fence);
+        auto lWaitTime = std::chrono::high_resolution_clock::now();
+
+        // Copie de la zone dans les buffers CPU, à sa place
+        int lWidth = (mXMax_t-mXMin_t)*2;
+        int lHeight = (mYMax_t-mYMin_t)*2;
+        for(int i=0; i<3; i++)
+        {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, lReadback.pbo[i]);
+            const ushort* lData = (const ushort*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, lWidth*lHeight*sizeof(ushort), GL_MAP_READ_BIT);
+            if(lData != NULL)
+            {
+                for(int y=0; y<lHeight; y++)
+                    memcpy(mCPUData[i].ptr<ushort>(mYMin_t*2+y) + mXMin_t*2, lData + y*lWidth, lWidth*sizeof(ushort));
+                glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            }
+        }
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        auto lEndTime = std::chrono::high_resolution_clock::now();
+
+        mReadbackWaitDuration = std::chrono::duration_cast<std::chrono::microseconds>(lWaitTime - lStartTime).count() / 1000.f;
+        mReadbackCopyDuration = std::chrono::duration_cast<std::chrono::microseconds>(lEndTime - lWaitTime).count() / 1000.f;
+        mMetrics.readback = mReadbackWaitDuration + mReadbackCopyDuration;
+
+        mPendingReadbacks--;
+
+        // Cuda / Npp, ou CPU
+        updateGraphReuse(GRAPH_FBO);
+        if(mSolver == SOLVER_NPP)
+            computeCuda();
+        else
+            computeCpu();
     }
 
-    //cv::imwrite("first.png", mCPUData[0]);
-    //cv::imwrite("second.png", mCPUData[1]);
-    //cv::imwrite("third.png", mCPUData[2]);
+    mXMin_t = lXMin;
+    mXMax_t = lXMax;
+    mYMin_t = lYMin;
+    mYMax_t = lYMax;
+    mCurrentTicket = lTicket;
+    mMetrics = lMetrics;
+}
+
+/**********************/
+void colorSegment::updateGraphReuse(graphType pType)
+{
+    // Le flot de l'image précédente n'est réutilisable que pour un graphe
+    // identique : sinon, résolution complète
+    cv::Rect lRoi(mXMin_t, mYMin_t, mXMax_t-mXMin_t, mYMax_t-mYMin_t);
+    if(lRoi != mPreviousRoi || pType != mPreviousGraphType)
+        mGraphcut.reset();
+    mPreviousRoi = lRoi;
+    mPreviousGraphType = pType;
 }
 
 /**********************/
@@ -491,221 +1409,871 @@ void colorSegment::computeCuda()
     //lSize.width = mFBOSize[0];
     //lSize.height = mFBOSize[1];
 
-    mGraphcutSize = lSize.width*lSize.height;
-    mGraphcutRatio = (float)lSize.width/(float)lSize.height;
+    auto lStartTime = std::chrono::high_resolution_clock::now();
+
+    mGraphcutSize = lSize.width*lSize.height;
+    mGraphcutRatio = (float)lSize.width/(float)lSize.height;
+
+    // Le décallage entre le début des données totales, et le début de la zone étudiée
+    int lDeltaBuffer = mXMin_t*2 + mYMin_t*2*mFBOSize[0];
+    //int lDeltaBuffer = 0;
+
+    // Trois envois vers le GPU : terminaux, coûts vers la droite et vers le bas
+    mMetrics.uploadBytes += 3*lSize.width*lSize.height*sizeof(Npp16u);
+
+    // Tous les buffers GPU proviennent de mArena : ils ne sont réalloués
+    // que si la zone segmentée dépasse leur classe de taille
+    mCudaDatabuffer = (Npp16u*)mArena.getDeviceBuffer(SLOT_DATA, lSize.width, lSize.height, sizeof(Npp16u), mCudaDatabufferStep);
+    if(mCudaDatabuffer == NULL)
+    {
+        std::cerr << "Problem detected with CUDA. Exiting." << std::endl;
+        exit(1);
+    }
+
+    NppStatus lStatus;
+    NppiSize lRoiSize;
+
+#ifdef __DEBUG_GC__
+    std::cout << "delta=" << lDeltaBuffer << " - width=" << lSize.width << " - height=" << lSize.height << std::endl;
+#endif
+
+    // On copie les résultats du rendu GL
+    // Pour les différentiels de coût des terminaux, on les converti simplement,
+    // en soustrayant 32768 (2^15) puisque ceux-ci peuvent être négatifs et cela a
+    // été pris en compte dans le rendu GL
+    int lTerminalsStep;
+    Npp32s* lTerminals = (Npp32s*)mArena.getDeviceBuffer(SLOT_TERMINALS, lSize.width, lSize.height, sizeof(Npp32s), lTerminalsStep);
+    cudaMemcpy2D(mCudaDatabuffer, mCudaDatabufferStep, mCPUData[0].data+lDeltaBuffer*sizeof(ushort), mFBOSize[0]*sizeof(ushort),
+                               lSize.width*sizeof(ushort), lSize.height, cudaMemcpyHostToDevice);
+    lStatus = nppiConvert_16u32s_C1R(mCudaDatabuffer, mCudaDatabufferStep, lTerminals, lTerminalsStep, lSize);
+    lStatus = nppiSubC_32s_C1IRSfs((Npp32s)32767, lTerminals, lTerminalsStep, lSize, 1);
+
+    // Debug
+#ifdef __DEBUG_GC__
+    cv::Mat lMat = cv::Mat::zeros(lSize.height, lSize.width, CV_16UC1);
+    cudaMemcpy2D(lMat.data, lSize.width*sizeof(ushort), mCudaDatabuffer, mCudaDatabufferStep, lSize.width*sizeof(ushort), lSize.height, cudaMemcpyDeviceToHost);
+    cv::imwrite("terminals.png", lMat);
+#endif
+
+    // On converti simplement les coûts vers le bas
+    int lDownStep;
+    Npp32s* lDown = (Npp32s*)mArena.getDeviceBuffer(SLOT_DOWN, lSize.width, lSize.height, sizeof(Npp32s), lDownStep);
+    cudaMemcpy2D(mCudaDatabuffer, mCudaDatabufferStep, mCPUData[2].data+lDeltaBuffer*sizeof(ushort), mFBOSize[0]*sizeof(ushort),
+                               lSize.width*sizeof(ushort), lSize.height, cudaMemcpyHostToDevice);
+    // On met la dernière à zéro malgré tout, par sécurité
+    lRoiSize.width = lSize.width;
+    lRoiSize.height = 1;
+    lStatus = nppiSet_16u_C1R(0, mCudaDatabuffer, mCudaDatabufferStep, lRoiSize);
+    lStatus = nppiSet_16u_C1R(0, mCudaDatabuffer+mCudaDatabufferStep/2*(lSize.height-1), mCudaDatabufferStep, lRoiSize);
+    lStatus = nppiConvert_16u32s_C1R(mCudaDatabuffer, mCudaDatabufferStep, lDown, lDownStep, lSize);
+
+    // Debug
+#ifdef __DEBUG_GC__
+    lMat = cv::Mat::zeros(lSize.height, lSize.width, CV_16UC1);
+    cudaMemcpy2D(lMat.data,  lSize.width*sizeof(ushort), mCudaDatabuffer, mCudaDatabufferStep, lSize.width*sizeof(ushort), lSize.height, cudaMemcpyDeviceToHost);
+    cv::imwrite("down.png", lMat);
+#endif
+
+    // Pour les coûts vers le haut, il faut décaler les coûts précédents vers le bas
+    int lBufferStep, lTmp1Step;
+    Npp16u* lBuffer = (Npp16u*)mArena.getDeviceBuffer(SLOT_BUFFER, lSize.width, lSize.height, sizeof(Npp16u), lBufferStep);
+    Npp16u* lTmp1 = (Npp16u*)mArena.getDeviceBuffer(SLOT_TMP1, lSize.width, lSize.height, sizeof(Npp16u), lTmp1Step);
+
+    NppiRect lRect;
+    lRect.x = 0;
+    lRect.y = 0;
+    lRect.width = lSize.width;
+    lRect.height = lSize.height;
+
+    lStatus = nppiRotate_16u_C1R(mCudaDatabuffer, lSize, mCudaDatabufferStep, lRect, lBuffer, lBufferStep, lRect, 0, 0, -1, NPPI_INTER_NN);
+    // On s'assure que la première ligne est à zéro
+    lStatus = nppiMirror_16u_C1R(lBuffer, lBufferStep, lTmp1, lTmp1Step, lSize, NPP_HORIZONTAL_AXIS);
+    lRoiSize.width = lSize.width;
+    lRoiSize.height = 1;
+    lStatus = nppiSet_16u_C1R(0, lTmp1, lTmp1Step, lRoiSize);
+    lStatus = nppiSet_16u_C1R(0, lTmp1+lTmp1Step/2*(lSize.height-1), lTmp1Step, lRoiSize);
+    lStatus = nppiMirror_16u_C1R(lTmp1, lTmp1Step, lBuffer, lBufferStep, lSize, NPP_HORIZONTAL_AXIS);
+
+    int lUpStep;
+    Npp32s* lUp = (Npp32s*)mArena.getDeviceBuffer(SLOT_UP, lSize.width, lSize.height, sizeof(Npp32s), lUpStep);
+    lStatus = nppiConvert_16u32s_C1R(lBuffer, lBufferStep, lUp, lUpStep, lSize);
+
+    // Debug
+#ifdef __DEBUG_GC__
+    lMat = cv::Mat::zeros(lSize.height, lSize.width, CV_16UC1);
+    cudaMemcpy2D(lMat.data, lSize.width*sizeof(ushort), lBuffer, lBufferStep, lSize.width*sizeof(ushort), lSize.height, cudaMemcpyDeviceToHost);
+    cv::imwrite("up.png", lMat);
+#endif
+
+    // Pour les coûts vers la droite et la gauche, ils doivent être transposés
+    // Ne nous privons donc pas !
+    int lTmp2Step;
+    int lMaxSize = std::max(lSize.width, lSize.height);
+
+    NppiSize lSquareSize;
+    lSquareSize.width = lMaxSize;
+    lSquareSize.height = lMaxSize;
+    NppiRect lSquareRect;
+    lSquareRect.x = 0;
+    lSquareRect.y = 0;
+    lSquareRect.width = lMaxSize;
+    lSquareRect.height = lMaxSize;
+
+    // Les mêmes buffers temporaires, agrandis si besoin
+    lBuffer = (Npp16u*)mArena.getDeviceBuffer(SLOT_BUFFER, lMaxSize, lMaxSize, sizeof(Npp16u), lBufferStep);
+    lTmp1 = (Npp16u*)mArena.getDeviceBuffer(SLOT_TMP1, lMaxSize, lMaxSize, sizeof(Npp16u), lTmp1Step);
+    Npp16u* lTmp2 = (Npp16u*)mArena.getDeviceBuffer(SLOT_TMP2, lMaxSize, lMaxSize, sizeof(Npp16u), lTmp2Step);
+
+    cudaMemcpy2D(mCudaDatabuffer, mCudaDatabufferStep, mCPUData[1].data+lDeltaBuffer*sizeof(ushort), mFBOSize[0]*sizeof(ushort),
+                               lSize.width*sizeof(ushort), lSize.height, cudaMemcpyHostToDevice);
+    lStatus = nppiCopy_16u_C1R(mCudaDatabuffer, mCudaDatabufferStep, lBuffer, lBufferStep, lSize);
+    lStatus = nppiMirror_16u_C1R(lBuffer, lBufferStep, lTmp1, lTmp1Step, lSize, NPP_VERTICAL_AXIS);
+    // Le -1 de la ligne suivante est nécessaire pour conserver un graphe cohérent
+    lStatus = nppiRotate_16u_C1R(lTmp1, lSquareSize, lTmp1Step, lSquareRect, lTmp2, lTmp2Step, lSquareRect, 90, 0, lSize.width-1, NPPI_INTER_NN);
+    // On s'assure que les pixels à droite sont nuls
+    lRoiSize.width = lSize.height;
+    lRoiSize.height = 1;
+    lStatus = nppiSet_16u_C1R(0, lTmp2, lTmp2Step, lRoiSize);
+    lStatus = nppiSet_16u_C1R(0, lTmp2+lTmp2Step/2*(lSize.width-1), lTmp2Step, lRoiSize);
+    // On obtient directement les coûts vers la droite
+    NppiSize lTSize;
+    lTSize.width = lSize.height;
+    lTSize.height = lSize.width;
+
+    int lRightStep;
+    Npp32s* lRight = (Npp32s*)mArena.getDeviceBuffer(SLOT_RIGHT, lSize.height, lSize.width, sizeof(Npp32s), lRightStep);
+    lStatus = nppiConvert_16u32s_C1R(lTmp2, lTmp2Step, lRight, lRightStep, lTSize);
+
+    // Debug
+#ifdef __DEBUG_GC__
+    lMat = cv::Mat::zeros(lSize.width, lSize.height, CV_16UC1);
+    cudaMemcpy2D(lMat.data, lSize.height*sizeof(ushort), lTmp2, lTmp2Step, lSize.height*sizeof(ushort), lSize.width, cudaMemcpyDeviceToHost);
+    cv::imwrite("right.png", lMat);
+#endif
+
+    // On décale vers la droite pour avoir les coûts vers la gauche
+    lStatus = nppiRotate_16u_C1R(lTmp2, lSquareSize, lTmp2Step, lSquareRect, lTmp1, lTmp1Step, lSquareRect, 0, 0, -1, NPPI_INTER_NN);
+    // On s'assure que les pixels à gauche sont nuls
+    lRoiSize.width = lMaxSize;
+    lRoiSize.height = 1;
+    lStatus = nppiSet_16u_C1R(0, lTmp1, lTmp1Step, lRoiSize);
+    lStatus = nppiSet_16u_C1R(0, lTmp1+(lTmp1Step/2)*(lSize.width-1), lTmp1Step, lRoiSize);
+    // Et on converti le résultat
+    int lLeftStep;
+    Npp32s* lLeft = (Npp32s*)mArena.getDeviceBuffer(SLOT_LEFT, lSize.height, lSize.width, sizeof(Npp32s), lLeftStep);
+    lStatus = nppiConvert_16u32s_C1R(lTmp1, lTmp1Step, lLeft, lLeftStep, lTSize);
+
+    // Debug
+#ifdef __DEBUG_GC__
+    lMat = cv::Mat::zeros(lSize.width, lSize.height, CV_16UC1);
+    cudaMemcpy2D(lMat.data, lSize.height*sizeof(ushort), lTmp1, lTmp1Step, lSize.height*sizeof(ushort), lSize.width, cudaMemcpyDeviceToHost);
+    cv::imwrite("left.png", lMat);
+#endif
+
+    // L'état du graphcut dépend de la taille de la zone : il n'est recréé
+    // que lorsque celle-ci change
+    if(mCudaGraphcutState == NULL || lSize.width != mCudaGraphcutSize.width || lSize.height != mCudaGraphcutSize.height)
+    {
+        if(mCudaGraphcutState != NULL)
+            nppiGraphcutFree(mCudaGraphcutState);
+
+        int lGCBufferSize, lGCBufferStep;
+        nppiGraphcutGetSize(lSize, &lGCBufferSize);
+        mCudaGCBuffer = (Npp8u*)mArena.getDeviceBuffer(SLOT_GC_BUFFER, lGCBufferSize, 1, 1, lGCBufferStep);
+        nppiGraphcutInitAlloc(lSize, &mCudaGraphcutState, mCudaGCBuffer);
+        mArena.addAllocation();
+
+        mCudaGraphcutSize = lSize;
+    }
+
+    mCudaLabels = (Npp8u*)mArena.getDeviceBuffer(SLOT_LABELS, lSize.width, lSize.height, sizeof(Npp8u), mCudaLabelsStep);
+
+    // Graphcut !
+#ifdef __DEBUG_GC__
+    std::cerr << "Start graphcut ...";
+#endif
+    auto lSolveTime = std::chrono::high_resolution_clock::now();
+    mMetrics.graphSetup = std::chrono::duration_cast<std::chrono::microseconds>(lSolveTime - lStartTime).count() / 1000.f;
+    lStatus = nppiGraphcut_32s8u(lTerminals, lLeft, lRight, lUp, lDown, lDownStep, lLeftStep,
+                                           lSize, mCudaLabels, mCudaLabelsStep, mCudaGraphcutState);
+    // Le solveur NPP ne peut pas être interrompu, il va toujours jusqu'au bout
+    mIsConverged = true;
+    mResidual = 0;
+    mMetrics.maxflow = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - lSolveTime).count() / 1000.f;
+
+#ifdef __DEBUG_GC__
+    if(lStatus < 0)
+        std::cerr << "...a error has occured...";
+    else if(lStatus > 0)
+        std::cerr << "...a warning has occured...";
+
+    std::cerr << "... ended." << std::endl;
+#endif
+
+    // Copie du résultat dans mLabels
+    mLabelCounter++;
+    mLabelMutex.lock();
+    auto lCopyTime = std::chrono::high_resolution_clock::now();
+    mIsNativeLabels = false;
+    mIsRegionLabels = false;
+    // On remet à 1 la zone précédente, puis on copie juste la partie segmentée
+    resetLabels(mLabels, mLabelsRoi, cv::Rect(mXMin_t*2, mYMin_t*2, lSize.width, lSize.height));
+    cudaMemcpy2D(mLabels.data+lDeltaBuffer, mFBOSize[0], mCudaLabels, mCudaLabelsStep, lSize.width, lSize.height, cudaMemcpyDeviceToHost);
+    mMetrics.labelBytes += lSize.width*lSize.height;
+    //cv::imwrite("segment.png", mLabels);
+    mMetrics.labelCopy = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - lCopyTime).count() / 1000.f;
+    mSolvedTicket = mCurrentTicket;
+    publishMetrics();
+    mLabelMutex.unlock();
+    mLabelCondition.notify_all();
+
+    auto lEndTime = std::chrono::high_resolution_clock::now();
+    mGraphcutDuration = std::chrono::duration_cast<std::chrono::microseconds>(lEndTime - lStartTime).count() / 1000.f;
+}
+
+/**********************/
+void colorSegment::computeCpu()
+{
+    // Même zone de travail que pour computeCuda()
+    int lWidth = (mXMax_t - mXMin_t)*2;
+    int lHeight = (mYMax_t - mYMin_t)*2;
+
+    mGraphcutSize = lWidth*lHeight;
+    mGraphcutRatio = (float)lWidth/(float)lHeight;
+
+    int lDeltaBuffer = mXMin_t*2 + mYMin_t*2*mFBOSize[0];
+
+    auto lStartTime = std::chrono::high_resolution_clock::now();
+
+    // Les textures du FBO sont utilisées directement : terminaux décalés de 32767,
+    // coûts vers la droite et vers le bas (ceux vers la gauche et le haut s'en déduisent)
+    mGraphcut.setGrid(lWidth, lHeight);
+    mGraphcut.setCapacities((ushort*)mCPUData[0].data+lDeltaBuffer, (ushort*)mCPUData[1].data+lDeltaBuffer,
+                            (ushort*)mCPUData[2].data+lDeltaBuffer, mFBOSize[0], 32767);
+    auto lSolveTime = std::chrono::high_resolution_clock::now();
+    mMetrics.graphSetup = std::chrono::duration_cast<std::chrono::microseconds>(lSolveTime - lStartTime).count() / 1000.f;
+
+#ifdef __DEBUG_GC__
+    std::cerr << "Start CPU graphcut ...";
+#endif
+    mGraphcut.setTimeBudget(mTimeBudget);
+    mGraphcut.maxflow();
+    mIsConverged = mGraphcut.isConverged();
+    mResidual = mGraphcut.getResidual();
+    mMetrics.maxflow = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - lSolveTime).count() / 1000.f;
+    mMetrics.augmentations = mGraphcut.getAugmentationCount();
+    mMetrics.orphans = mGraphcut.getOrphanCount();
+#ifdef __DEBUG_GC__
+    std::cerr << "... ended." << std::endl;
+#endif
+
+    // Copie du résultat dans mLabels
+    mLabelCounter++;
+    mLabelMutex.lock();
+    auto lCopyTime = std::chrono::high_resolution_clock::now();
+    mIsNativeLabels = false;
+    mIsRegionLabels = false;
+    resetLabels(mLabels, mLabelsRoi, cv::Rect(mXMin_t*2, mYMin_t*2, lWidth, lHeight));
+    mGraphcut.getLabels(mLabels.data+lDeltaBuffer, mFBOSize[0]);
+    mMetrics.labelCopy = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - lCopyTime).count() / 1000.f;
+    mSolvedTicket = mCurrentTicket;
+    publishMetrics();
+    mLabelMutex.unlock();
+    mLabelCondition.notify_all();
+
+    auto lEndTime = std::chrono::high_resolution_clock::now();
+    mGraphcutDuration = std::chrono::duration_cast<std::chrono::microseconds>(lEndTime - lStartTime).count() / 1000.f;
+}
+
+/**********************/
+int colorSegment::getTerminal(const cv::Vec2w &pCosts)
+{
+    // Mêmes terminaux que ceux calculés par fragment.frag :
+    // les pixels fixés dans le FG vont au puits, ceux du BG à la source
+    if(pCosts[0] > 32767)
+        return -32767;
+    else if(pCosts[1] > 32767)
+        return 32768;
+    else
+        return (int)pCosts[0] - (int)pCosts[1];
+}
+
+/**********************/
+void colorSegment::buildNativeGraph(graphCut &pGraph, cv::Mat &pImg, cv::Mat &pCosts, graphType pType)
+{
+    // Un noeud par pixel de la zone segmentée
+    int lWidth = mXMax_t - mXMin_t;
+    int lHeight = mYMax_t - mYMin_t;
+
+    mGraphcutRatio = (float)lWidth/(float)lHeight;
+    mPreSolveDuration = 0.f;
+
+    cv::Mat lSmoothCosts = smoothCostsColor(pImg, cv::Rect(mXMin_t, mYMin_t, lWidth, lHeight));
+
+    if(pType == GRAPH_NATIVE)
+    {
+        mBandLabels = cv::Mat();
+        pGraph.setGrid(lWidth, lHeight);
+        mGraphcutSize = pGraph.getNodeCount();
+
+        for(int y=0; y<lHeight; y++)
+        {
+            const cv::Vec2w* lCostsRow = pCosts.ptr<cv::Vec2w>(mYMin_t+y) + mXMin_t;
+            const cv::Vec2w* lSmoothRow = lSmoothCosts.ptr<cv::Vec2w>(mYMin_t+y) + mXMin_t;
+
+            for(int x=0; x<lWidth; x++)
+                pGraph.setNode(x, y, getTerminal(lCostsRow[x]), lSmoothRow[x][0], lSmoothRow[x][1]);
+        }
+
+        return;
+    }
+
+    // Pour les autres types de graphe, seuls les pixels inconnus peuvent
+    // devenir des noeuds. Les autres pixels gardent le label de leur masque
+    cv::Mat lBand = mArena.getMat(SLOT_BAND, lHeight, lWidth, CV_8UC1);
+    mBandLabels = mArena.getMat(SLOT_BAND_LABELS, lHeight, lWidth, CV_8UC1);
+
+    for(int y=0; y<lHeight; y++)
+    {
+        const cv::Vec2w* lCostsRow = pCosts.ptr<cv::Vec2w>(mYMin_t+y) + mXMin_t;
+        uchar* lBandRow = lBand.ptr<uchar>(y);
+        uchar* lLabelsRow = mBandLabels.ptr<uchar>(y);
+
+        for(int x=0; x<lWidth; x++)
+        {
+            bool lIsFG = lCostsRow[x][0] > 32767;
+            bool lIsBG = !lIsFG && lCostsRow[x][1] > 32767;
+            lBandRow[x] = (lIsFG || lIsBG) ? 0 : 255;
+            lLabelsRow[x] = lIsFG ? 0 : 1;
+        }
+    }
+
+    // Les pixels inconnus sont regroupés en superpixels
+    if(pType == GRAPH_SUPERPIXEL)
+    {
+        buildSuperpixelGraph(pGraph, pImg, pCosts, lSmoothCosts, lBand);
+        mGraphcutSize = pGraph.getNodeCount();
+        return;
+    }
+
+    // En mode pyramidal, la bande est réduite au voisinage de la frontière
+    // trouvée à basse résolution
+    if(pType == GRAPH_PYRAMID)
+        solveCoarse(pCosts, lSmoothCosts, lBand);
+
+    buildBandGraph(pGraph, pCosts, lSmoothCosts, lBand);
+    mGraphcutSize = pGraph.getNodeCount();
+}
+
+/**********************/
+void colorSegment::buildBandGraph(graphCut &pGraph, cv::Mat &pCosts, cv::Mat &pSmoothCosts, cv::Mat &pBand)
+{
+    int lWidth = pBand.cols;
+    int lHeight = pBand.rows;
+
+    // Ajout d'un anneau de pixels fixés autour de la bande, pour conserver
+    // les coûts de lissage vers l'extérieur de celle-ci
+    for(int y=0; y<lHeight; y++)
+    {
+        uchar* lBandRow = pBand.ptr<uchar>(y);
+        const uchar* lUpRow = (y > 0) ? pBand.ptr<uchar>(y-1) : NULL;
+        const uchar* lDownRow = (y < lHeight-1) ? pBand.ptr<uchar>(y+1) : NULL;
+
+        for(int x=0; x<lWidth; x++)
+        {
+            if(lBandRow[x] != 0)
+                continue;
+
+            if((x > 0 && lBandRow[x-1] == 255) || (x < lWidth-1 && lBandRow[x+1] == 255)
+                    || (lUpRow && lUpRow[x] == 255) || (lDownRow && lDownRow[x] == 255))
+                lBandRow[x] = 1;
+        }
+    }
+
+    pGraph.setGrid(lWidth, lHeight, pBand.data, pBand.step);
+
+    for(int y=0; y<lHeight; y++)
+    {
+        const cv::Vec2w* lCostsRow = pCosts.ptr<cv::Vec2w>(mYMin_t+y) + mXMin_t;
+        const cv::Vec2w* lSmoothRow = pSmoothCosts.ptr<cv::Vec2w>(mYMin_t+y) + mXMin_t;
+        const uchar* lBandRow = pBand.ptr<uchar>(y);
+        const uchar* lLabelsRow = mBandLabels.ptr<uchar>(y);
+
+        for(int x=0; x<lWidth; x++)
+        {
+            if(lBandRow[x] == 0)
+                continue;
+
+            // Les pixels de l'anneau sont fixés à leur label
+            int lTerminal;
+            if(lBandRow[x] == 255)
+                lTerminal = getTerminal(lCostsRow[x]);
+            else
+                lTerminal = lLabelsRow[x] ? 32768 : -32767;
+
+            pGraph.setNode(x, y, lTerminal, lSmoothRow[x][0], lSmoothRow[x][1]);
+        }
+    }
+}
+
+/**********************/
+void colorSegment::solveCoarse(cv::Mat &pCosts, cv::Mat &pSmoothCosts, cv::Mat &pBand)
+{
+    auto lStartTime = std::chrono::high_resolution_clock::now();
+
+    int lScale = mPyramidScale;
+    int lWidth = pBand.cols;
+    int lHeight = pBand.rows;
+    int lCoarseWidth = (lWidth + lScale - 1)/lScale;
+    int lCoarseHeight = (lHeight + lScale - 1)/lScale;
+
+    // Chaque bloc de lScale x lScale pixels devient un noeud : ses terminaux
+    // sont la somme de ceux des pixels, ses coûts de lissage la somme de
+    // ceux des arêtes traversant la frontière avec le bloc voisin
+    cv::Mat lCoarse = mArena.getMat(SLOT_COARSE, lCoarseHeight, lCoarseWidth, CV_32SC3);
+    lCoarse.setTo(cv::Scalar::all(0));
+
+    for(int y=0; y<lHeight; y++)
+    {
+        const cv::Vec2w* lCostsRow = pCosts.ptr<cv::Vec2w>(mYMin_t+y) + mXMin_t;
+        const cv::Vec2w* lSmoothRow = pSmoothCosts.ptr<cv::Vec2w>(mYMin_t+y) + mXMin_t;
+        cv::Vec3i* lCoarseRow = lCoarse.ptr<cv::Vec3i>(y/lScale);
+
+        for(int x=0; x<lWidth; x++)
+        {
+            cv::Vec3i &lBlock = lCoarseRow[x/lScale];
+            lBlock[0] += getTerminal(lCostsRow[x]);
+            if(x%lScale == lScale-1 && x < lWidth-1)
+                lBlock[1] += lSmoothRow[x][0];
+            if(y%lScale == lScale-1 && y < lHeight-1)
+                lBlock[2] += lSmoothRow[x][1];
+        }
+    }
+
+    mCoarseGraph.setGrid(lCoarseWidth, lCoarseHeight);
+    for(int y=0; y<lCoarseHeight; y++)
+    {
+        const cv::Vec3i* lCoarseRow = lCoarse.ptr<cv::Vec3i>(y);
+        for(int x=0; x<lCoarseWidth; x++)
+            mCoarseGraph.setNode(x, y, lCoarseRow[x][0], lCoarseRow[x][1], lCoarseRow[x][2]);
+    }
+
+    mCoarseGraph.maxflow();
+
+    cv::Mat lCoarseLabels = mArena.getMat(SLOT_COARSE_LABELS, lCoarseHeight, lCoarseWidth, CV_8UC1);
+    mCoarseGraph.getLabels(lCoarseLabels.data, lCoarseLabels.step);
+
+    // Les pixels inconnus prennent le label de leur bloc, et ne restent
+    // dans la bande que si un bloc différent se trouve à moins de lScale pixels
+    for(int y=0; y<lHeight; y++)
+    {
+        uchar* lBandRow = pBand.ptr<uchar>(y);
+        uchar* lLabelsRow = mBandLabels.ptr<uchar>(y);
+
+        int lYMin = std::max(0, y-lScale)/lScale;
+        int lYMax = std::min(lHeight-1, y+lScale)/lScale;
+
+        for(int x=0; x<lWidth; x++)
+        {
+            if(lBandRow[x] == 0)
+                continue;
+
+            uchar lLabel = lCoarseLabels.at<uchar>(y/lScale, x/lScale);
+            lLabelsRow[x] = lLabel;
+
+            int lXMin = std::max(0, x-lScale)/lScale;
+            int lXMax = std::min(lWidth-1, x+lScale)/lScale;
+
+            bool lIsBoundary = false;
+            for(int v=lYMin; v<=lYMax && !lIsBoundary; v++)
+                for(int u=lXMin; u<=lXMax; u++)
+                    if(lCoarseLabels.at<uchar>(v, u) != lLabel)
+                    {
+                        lIsBoundary = true;
+                        break;
+                    }
+
+            if(!lIsBoundary)
+                lBandRow[x] = 0;
+        }
+    }
+
+    auto lEndTime = std::chrono::high_resolution_clock::now();
+    mPreSolveDuration = std::chrono::duration_cast<std::chrono::microseconds>(lEndTime - lStartTime).count() / 1000.f;
+}
+
+/**********************/
+void colorSegment::computeSuperpixels(cv::Mat &pImg, cv::Mat &pBand, cv::Mat &pMap)
+{
+    int lWidth = pBand.cols;
+    int lHeight = pBand.rows;
+    int lStep = mSuperpixelSize;
+
+    // Conversion en Lab de la seule zone segmentée
+    cv::Mat lImgRoi = pImg(cv::Rect(mXMin_t, mYMin_t, lWidth, lHeight));
+    cv::Mat lLab = mArena.getMat(SLOT_LAB, lHeight, lWidth, CV_8UC3);
+    cv::cvtColor(lImgRoi, lLab, CV_BGR2Lab);
+
+    cv::Mat lDist = mArena.getMat(SLOT_SUPERPIXEL_DIST, lHeight, lWidth, CV_32FC1);
+
+    // Germes répartis sur une grille régulière de pas lStep
+    int lCols = std::max(1, (lWidth + lStep/2)/lStep);
+    int lRows = std::max(1, (lHeight + lStep/2)/lStep);
+    mSuperpixels.resize(lCols*lRows);
+
+    for(int j=0; j<lRows; j++)
+    {
+        for(int i=0; i<lCols; i++)
+        {
+            superpixel &lSp = mSuperpixels[j*lCols + i];
+            lSp.x = (i+0.5f)*lWidth/lCols;
+            lSp.y = (j+0.5f)*lHeight/lRows;
+            cv::Vec3b lColor = lLab.at<cv::Vec3b>((int)lSp.y, (int)lSp.x);
+            for(int c=0; c<3; c++)
+                lSp.color[c] = lColor[c];
+        }
+    }
 
-    // Le décallage entre le début des données totales, et le début de la zone étudiée
-    int lDeltaBuffer = mXMin_t*2 + mYMin_t*2*mFBOSize[0];
-    //int lDeltaBuffer = 0;
+    // Itérations de type k-means, chaque germe ne cherchant ses pixels
+    // que dans une fenêtre de 2*lStep de côté
+    float lSpatialWeight = (__SLIC_COMPACTNESS__/lStep)*(__SLIC_COMPACTNESS__/lStep);
 
-    if(mCudaDatabuffer == NULL)
+    for(int lIteration=0; lIteration<__SLIC_ITERATIONS__; lIteration++)
     {
-        mCudaDatabuffer = nppiMalloc_16u_C1(lSize.width, lSize.height, &mCudaDatabufferStep);
-        if(mCudaDatabuffer != NULL)
+        lDist.setTo(std::numeric_limits<float>::max());
+        pMap.setTo(-1);
+
+        for(size_t k=0; k<mSuperpixels.size(); k++)
         {
-            std::cerr << "CUDA / NPP initialized." << std::endl;
+            const superpixel &lSp = mSuperpixels[k];
+            int lXMin = std::max(0, (int)lSp.x - lStep);
+            int lXMax = std::min(lWidth, (int)lSp.x + lStep + 1);
+            int lYMin = std::max(0, (int)lSp.y - lStep);
+            int lYMax = std::min(lHeight, (int)lSp.y + lStep + 1);
+
+            for(int y=lYMin; y<lYMax; y++)
+            {
+                const uchar* lBandRow = pBand.ptr<uchar>(y);
+                const cv::Vec3b* lLabRow = lLab.ptr<cv::Vec3b>(y);
+                float* lDistRow = lDist.ptr<float>(y);
+                int* lMapRow = pMap.ptr<int>(y);
+
+                for(int x=lXMin; x<lXMax; x++)
+                {
+                    // Les pixels fixés n'appartiennent à aucun superpixel
+                    if(lBandRow[x] == 0)
+                        continue;
+
+                    float lD = 0.f;
+                    for(int c=0; c<3; c++)
+                        lD += (lLabRow[x][c] - lSp.color[c])*(lLabRow[x][c] - lSp.color[c]);
+                    lD += ((x - lSp.x)*(x - lSp.x) + (y - lSp.y)*(y - lSp.y))*lSpatialWeight;
+
+                    if(lD < lDistRow[x])
+                    {
+                        lDistRow[x] = lD;
+                        lMapRow[x] = k;
+                    }
+                }
+            }
         }
-        else
+
+        if(lIteration == __SLIC_ITERATIONS__-1)
+            break;
+
+        // Mise à jour des germes
+        for(size_t k=0; k<mSuperpixels.size(); k++)
         {
-            std::cerr << "Problem detected with CUDA. Exiting." << std::endl;
-            exit(1);
+            superpixel &lSp = mSuperpixels[k];
+            lSp.sum[0] = lSp.sum[1] = lSp.sum[2] = lSp.sum[3] = lSp.sum[4] = 0.f;
+            lSp.size = 0;
         }
 
-        // Il s'agit juste de la phase d'initialisation, on ne veut pas segmenter pour l'instant
-        return;
+        for(int y=0; y<lHeight; y++)
+        {
+            const cv::Vec3b* lLabRow = lLab.ptr<cv::Vec3b>(y);
+            const int* lMapRow = pMap.ptr<int>(y);
+            for(int x=0; x<lWidth; x++)
+            {
+                if(lMapRow[x] < 0)
+                    continue;
+
+                superpixel &lSp = mSuperpixels[lMapRow[x]];
+                for(int c=0; c<3; c++)
+                    lSp.sum[c] += lLabRow[x][c];
+                lSp.sum[3] += x;
+                lSp.sum[4] += y;
+                lSp.size++;
+            }
+        }
+
+        for(size_t k=0; k<mSuperpixels.size(); k++)
+        {
+            superpixel &lSp = mSuperpixels[k];
+            if(lSp.size == 0)
+                continue;
+
+            for(int c=0; c<3; c++)
+                lSp.color[c] = lSp.sum[c]/lSp.size;
+            lSp.x = lSp.sum[3]/lSp.size;
+            lSp.y = lSp.sum[4]/lSp.size;
+        }
     }
-    else
+
+    // Les pixels inconnus qu'aucun germe n'a atteint sont rattachés
+    // à celui de leur case de départ
+    for(int y=0; y<lHeight; y++)
     {
-        nppiFree(mCudaDatabuffer);
-        mCudaDatabuffer = nppiMalloc_16u_C1(lSize.width, lSize.height, &mCudaDatabufferStep);
+        const uchar* lBandRow = pBand.ptr<uchar>(y);
+        int* lMapRow = pMap.ptr<int>(y);
+        for(int x=0; x<lWidth; x++)
+        {
+            if(lBandRow[x] != 0 && lMapRow[x] < 0)
+                lMapRow[x] = std::min(y*lRows/lHeight, lRows-1)*lCols + std::min(x*lCols/lWidth, lCols-1);
+        }
     }
+}
 
-    NppStatus lStatus;
-    NppiSize lRoiSize;
-
-#ifdef __DEBUG_GC__
-    std::cout << "delta=" << lDeltaBuffer << " - width=" << lSize.width << " - height=" << lSize.height << std::endl;
-#endif
-
-    // On copie les résultats du rendu GL
-    // Pour les différentiels de coût des terminaux, on les converti simplement,
-    // en soustrayant 32768 (2^15) puisque ceux-ci peuvent être négatifs et cela a
-    // été pris en compte dans le rendu GL
-    int lTerminalsStep;
-    Npp32s* lTerminals = nppiMalloc_32s_C1(lSize.width, lSize.height, &lTerminalsStep);
-    cudaMemcpy2D(mCudaDatabuffer, mCudaDatabufferStep, mCPUData[0].data+lDeltaBuffer*sizeof(ushort), mFBOSize[0]*sizeof(ushort),
-                               lSize.width*sizeof(ushort), lSize.height, cudaMemcpyHostToDevice);
-    lStatus = nppiConvert_16u32s_C1R(mCudaDatabuffer, mCudaDatabufferStep, lTerminals, lTerminalsStep, lSize);
-    lStatus = nppiSubC_32s_C1IRSfs((Npp32s)32767, lTerminals, lTerminalsStep, lSize, 1);
-
-    // Debug
-#ifdef __DEBUG_GC__
-    cv::Mat lMat = cv::Mat::zeros(lSize.height, lSize.width, CV_16UC1);
-    cudaMemcpy2D(lMat.data, lSize.width*sizeof(ushort), mCudaDatabuffer, mCudaDatabufferStep, lSize.width*sizeof(ushort), lSize.height, cudaMemcpyDeviceToHost);
-    cv::imwrite("terminals.png", lMat);
-#endif
+/**********************/
+void colorSegment::buildSuperpixelGraph(graphCut &pGraph, cv::Mat &pImg, cv::Mat &pCosts, cv::Mat &pSmoothCosts, cv::Mat &pBand)
+{
+    auto lStartTime = std::chrono::high_resolution_clock::now();
 
-    // On converti simplement les coûts vers le bas
-    int lDownStep;
-    Npp32s* lDown = nppiMalloc_32s_C1(lSize.width, lSize.height, &lDownStep);
-    cudaMemcpy2D(mCudaDatabuffer, mCudaDatabufferStep, mCPUData[2].data+lDeltaBuffer*sizeof(ushort), mFBOSize[0]*sizeof(ushort),
-                               lSize.width*sizeof(ushort), lSize.height, cudaMemcpyHostToDevice);
-    // On met la dernière à zéro malgré tout, par sécurité
-    lRoiSize.width = lSize.width;
-    lRoiSize.height = 1;
-    lStatus = nppiSet_16u_C1R(0, mCudaDatabuffer, mCudaDatabufferStep, lRoiSize);
-    lStatus = nppiSet_16u_C1R(0, mCudaDatabuffer+mCudaDatabufferStep/2*(lSize.height-1), mCudaDatabufferStep, lRoiSize);
-    lStatus = nppiConvert_16u32s_C1R(mCudaDatabuffer, mCudaDatabufferStep, lDown, lDownStep, lSize);
+    int lWidth = pBand.cols;
+    int lHeight = pBand.rows;
 
-    // Debug
-#ifdef __DEBUG_GC__
-    lMat = cv::Mat::zeros(lSize.height, lSize.width, CV_16UC1);
-    cudaMemcpy2D(lMat.data,  lSize.width*sizeof(ushort), mCudaDatabuffer, mCudaDatabufferStep, lSize.width*sizeof(ushort), lSize.height, cudaMemcpyDeviceToHost);
-    cv::imwrite("down.png", lMat);
-#endif
+    mSuperpixelMap = mArena.getMat(SLOT_SUPERPIXELS, lHeight, lWidth, CV_32SC1);
+    computeSuperpixels(pImg, pBand, mSuperpixelMap);
 
-    // Pour les coûts vers le haut, il faut décaler les coûts précédents vers le bas
-    int lBufferStep, lTmp1Step;
-    Npp16u* lBuffer = nppiMalloc_16u_C1(lSize.width, lSize.height, &lBufferStep);
-    Npp16u* lTmp1 = nppiMalloc_16u_C1(lSize.width, lSize.height, &lTmp1Step);
+    int lCount = mSuperpixels.size();
+    mSuperpixelTerminals.assign(lCount, 0);
+    mSuperpixelPairs.clear();
 
-    NppiRect lRect;
-    lRect.x = 0;
-    lRect.y = 0;
-    lRect.width = lSize.width;
-    lRect.height = lSize.height;
+    // Terminaux : somme de ceux des pixels du superpixel. Lissage : somme des
+    // coûts des arêtes entre pixels de deux superpixels différents, ce qui
+    // revient à pondérer par la longueur de la frontière commune
+    for(int y=0; y<lHeight; y++)
+    {
+        const cv::Vec2w* lCostsRow = pCosts.ptr<cv::Vec2w>(mYMin_t+y) + mXMin_t;
+        const cv::Vec2w* lSmoothRow = pSmoothCosts.ptr<cv::Vec2w>(mYMin_t+y) + mXMin_t;
+        const int* lMapRow = mSuperpixelMap.ptr<int>(y);
+        const int* lDownMapRow = (y < lHeight-1) ? mSuperpixelMap.ptr<int>(y+1) : NULL;
+        const uchar* lLabelsRow = mBandLabels.ptr<uchar>(y);
+        const uchar* lDownLabelsRow = (y < lHeight-1) ? mBandLabels.ptr<uchar>(y+1) : NULL;
+
+        for(int x=0; x<lWidth; x++)
+        {
+            if(lMapRow[x] >= 0)
+                mSuperpixelTerminals[lMapRow[x]] += getTerminal(lCostsRow[x]);
 
-    lStatus = nppiRotate_16u_C1R(mCudaDatabuffer, lSize, mCudaDatabufferStep, lRect, lBuffer, lBufferStep, lRect, 0, 0, -1, NPPI_INTER_NN);
-    // On s'assure que la première ligne est à zéro
-    lStatus = nppiMirror_16u_C1R(lBuffer, lBufferStep, lTmp1, lTmp1Step, lSize, NPP_HORIZONTAL_AXIS);
-    lRoiSize.width = lSize.width;
-    lRoiSize.height = 1;
-    lStatus = nppiSet_16u_C1R(0, lTmp1, lTmp1Step, lRoiSize);
-    lStatus = nppiSet_16u_C1R(0, lTmp1+lTmp1Step/2*(lSize.height-1), lTmp1Step, lRoiSize);
-    lStatus = nppiMirror_16u_C1R(lTmp1, lTmp1Step, lBuffer, lBufferStep, lSize, NPP_HORIZONTAL_AXIS);
+            if(x < lWidth-1)
+                linkSuperpixels(lMapRow[x], lMapRow[x+1], lLabelsRow[x], lLabelsRow[x+1], lSmoothRow[x][0], lCount);
+            if(lDownMapRow)
+                linkSuperpixels(lMapRow[x], lDownMapRow[x], lLabelsRow[x], lDownLabelsRow[x], lSmoothRow[x][1], lCount);
+        }
+    }
 
-    int lUpStep;
-    Npp32s* lUp = nppiMalloc_32s_C1(lSize.width, lSize.height, &lUpStep);
-    lStatus = nppiConvert_16u32s_C1R(lBuffer, lBufferStep, lUp, lUpStep, lSize);
+    // Regroupement des arêtes reliant les mêmes superpixels
+    std::sort(mSuperpixelPairs.begin(), mSuperpixelPairs.end());
 
-    // Debug
-#ifdef __DEBUG_GC__
-    lMat = cv::Mat::zeros(lSize.height, lSize.width, CV_16UC1);
-    cudaMemcpy2D(lMat.data, lSize.width*sizeof(ushort), lBuffer, lBufferStep, lSize.width*sizeof(ushort), lSize.height, cudaMemcpyDeviceToHost);
-    cv::imwrite("up.png", lMat);
-#endif
+    mSuperpixelEdges.clear();
+    mSuperpixelWeights.clear();
+    for(size_t i=0; i<mSuperpixelPairs.size(); i++)
+    {
+        long long lKey = mSuperpixelPairs[i].first;
+        if(i == 0 || lKey != mSuperpixelPairs[i-1].first)
+        {
+            mSuperpixelEdges.push_back(std::make_pair((int)(lKey/lCount), (int)(lKey%lCount)));
+            mSuperpixelWeights.push_back(0);
+        }
+        mSuperpixelWeights.back() += mSuperpixelPairs[i].second;
+    }
 
-    nppiFree(lBuffer);
-    nppiFree(lTmp1);
+    pGraph.setGraph(lCount, mSuperpixelEdges);
+    for(int i=0; i<lCount; i++)
+        pGraph.setNodeTerminal(i, mSuperpixelTerminals[i]);
+    for(size_t e=0; e<mSuperpixelEdges.size(); e++)
+        pGraph.setEdgeCapacity(e, mSuperpixelWeights[e]);
 
-    // Pour les coûts vers la droite et la gauche, ils doivent être transposés
-    // Ne nous privons donc pas !
-    int lTmp2Step;
-    int lMaxSize = std::max(lSize.width, lSize.height);
+    auto lEndTime = std::chrono::high_resolution_clock::now();
+    mPreSolveDuration = std::chrono::duration_cast<std::chrono::microseconds>(lEndTime - lStartTime).count() / 1000.f;
+}
 
-    NppiSize lSquareSize;
-    lSquareSize.width = lMaxSize;
-    lSquareSize.height = lMaxSize;
-    NppiRect lSquareRect;
-    lSquareRect.x = 0;
-    lSquareRect.y = 0;
-    lSquareRect.width = lMaxSize;
-    lSquareRect.height = lMaxSize;
+/**********************/
+void colorSegment::linkSuperpixels(int pFirst, int pSecond, uchar pFirstLabel, uchar pSecondLabel, int pWeight, int pCount)
+{
+    if(pFirst >= 0 && pSecond >= 0)
+    {
+        // Arête entre deux superpixels, ignorée à l'intérieur d'un même superpixel
+        if(pFirst != pSecond)
+            mSuperpixelPairs.push_back(std::make_pair((long long)std::min(pFirst, pSecond)*pCount + std::max(pFirst, pSecond), pWeight));
+    }
+    // Arête vers un pixel fixé : elle est reportée sur le terminal du superpixel
+    // (label 1 = source, donc coût payé si le superpixel va au puits)
+    else if(pFirst >= 0)
+        mSuperpixelTerminals[pFirst] += pSecondLabel ? pWeight : -pWeight;
+    else if(pSecond >= 0)
+        mSuperpixelTerminals[pSecond] += pFirstLabel ? pWeight : -pWeight;
+}
 
-    lBuffer = nppiMalloc_16u_C1(lMaxSize, lMaxSize, &lBufferStep);
-    lTmp1 = nppiMalloc_16u_C1(lMaxSize, lMaxSize, &lTmp1Step);
-    Npp16u* lTmp2 = nppiMalloc_16u_C1(lMaxSize, lMaxSize, &lTmp2Step);
+/**********************/
+void colorSegment::computeNative(graphType pType)
+{
+    auto lStartTime = std::chrono::high_resolution_clock::now();
 
-    cudaMemcpy2D(mCudaDatabuffer, mCudaDatabufferStep, mCPUData[1].data+lDeltaBuffer*sizeof(ushort), mFBOSize[0]*sizeof(ushort),
-                               lSize.width*sizeof(ushort), lSize.height, cudaMemcpyHostToDevice);
-    lStatus = nppiCopy_16u_C1R(mCudaDatabuffer, mCudaDatabufferStep, lBuffer, lBufferStep, lSize);
-    lStatus = nppiMirror_16u_C1R(lBuffer, lBufferStep, lTmp1, lTmp1Step, lSize, NPP_VERTICAL_AXIS);
-    // Le -1 de la ligne suivante est nécessaire pour conserver un graphe cohérent
-    lStatus = nppiRotate_16u_C1R(lTmp1, lSquareSize, lTmp1Step, lSquareRect, lTmp2, lTmp2Step, lSquareRect, 90, 0, lSize.width-1, NPPI_INTER_NN);
-    // On s'assure que les pixels à droite sont nuls
-    lRoiSize.width = lSize.height;
-    lRoiSize.height = 1;
-    lStatus = nppiSet_16u_C1R(0, lTmp2, lTmp2Step, lRoiSize);
-    lStatus = nppiSet_16u_C1R(0, lTmp2+lTmp2Step/2*(lSize.width-1), lTmp2Step, lRoiSize);
-    // On obtient directement les coûts vers la droite
-    NppiSize lTSize;
-    lTSize.width = lSize.height;
-    lTSize.height = lSize.width;
+    // Le temps déjà passé à préparer le graphe est décompté du budget
+    if(mTimeBudget > 0.f)
+        mGraphcut.setTimeBudget(std::max(0.01f, mTimeBudget - mPreSolveDuration));
+    else
+        mGraphcut.setTimeBudget(0.f);
+
+    mGraphcut.maxflow();
+    mIsConverged = mGraphcut.isConverged();
+    mResidual = mGraphcut.getResidual();
+    auto lCopyTime = std::chrono::high_resolution_clock::now();
+    mMetrics.maxflow = std::chrono::duration_cast<std::chrono::microseconds>(lCopyTime - lStartTime).count() / 1000.f;
+    mMetrics.augmentations = mGraphcut.getAugmentationCount();
+    mMetrics.orphans = mGraphcut.getOrphanCount();
+
+    // Les superpixels transmettent leur label à leurs pixels
+    if(pType == GRAPH_SUPERPIXEL)
+    {
+        for(int y=0; y<mSuperpixelMap.rows; y++)
+        {
+            const int* lMapRow = mSuperpixelMap.ptr<int>(y);
+            uchar* lLabelsRow = mBandLabels.ptr<uchar>(y);
+            for(int x=0; x<mSuperpixelMap.cols; x++)
+                if(lMapRow[x] >= 0)
+                    lLabelsRow[x] = mGraphcut.getLabel(lMapRow[x]);
+        }
+    }
 
-    int lRightStep;
-    Npp32s* lRight = nppiMalloc_32s_C1(lSize.height, lSize.width, &lRightStep);
-    lStatus = nppiConvert_16u32s_C1R(lTmp2, lTmp2Step, lRight, lRightStep, lTSize);
+    // Copie du résultat dans mNativeLabels
+    mLabelCounter++;
+    mLabelMutex.lock();
+    mIsNativeLabels = true;
+    mIsRegionLabels = false;
+    resetLabels(mNativeLabels, mNativeLabelsRoi, cv::Rect(mXMin_t, mYMin_t, mXMax_t-mXMin_t, mYMax_t-mYMin_t));
+    // Hors de la bande étroite, les labels sont ceux des masques
+    if(!mBandLabels.empty())
+    {
+        cv::Mat lRoiLabels = mNativeLabels(cv::Rect(mXMin_t, mYMin_t, mBandLabels.cols, mBandLabels.rows));
+        mBandLabels.copyTo(lRoiLabels);
+    }
+    mGraphcut.getLabels(mNativeLabels.data + mYMin_t*mNativeLabels.step + mXMin_t, mNativeLabels.step);
+    mMetrics.labelCopy = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - lCopyTime).count() / 1000.f;
+    mSolvedTicket = mCurrentTicket;
+    publishMetrics();
+    mLabelMutex.unlock();
+    mLabelCondition.notify_all();
 
-    // Debug
-#ifdef __DEBUG_GC__
-    lMat = cv::Mat::zeros(lSize.width, lSize.height, CV_16UC1);
-    cudaMemcpy2D(lMat.data, lSize.height*sizeof(ushort), lTmp2, lTmp2Step, lSize.height*sizeof(ushort), lSize.width, cudaMemcpyDeviceToHost);
-    cv::imwrite("right.png", lMat);
-#endif
+    // En mode pyramidal ou par superpixels, une partie du travail a déjà été faite
+    auto lEndTime = std::chrono::high_resolution_clock::now();
+    mGraphcutDuration = mPreSolveDuration + std::chrono::duration_cast<std::chrono::microseconds>(lEndTime - lStartTime).count() / 1000.f;
+}
 
-    // On décale vers la droite pour avoir les coûts vers la gauche
-    lStatus = nppiRotate_16u_C1R(lTmp2, lSquareSize, lTmp2Step, lSquareRect, lTmp1, lTmp1Step, lSquareRect, 0, 0, -1, NPPI_INTER_NN);
-    // On s'assure que les pixels à gauche sont nuls
-    lRoiSize.width = lMaxSize;
-    lRoiSize.height = 1;
-    lStatus = nppiSet_16u_C1R(0, lTmp1, lTmp1Step, lRoiSize);
-    lStatus = nppiSet_16u_C1R(0, lTmp1+(lTmp1Step/2)*(lSize.width-1), lTmp1Step, lRoiSize);
-    // Et on converti le résultat
-    int lLeftStep;
-    Npp32s* lLeft = nppiMalloc_32s_C1(lSize.height, lSize.width, &lLeftStep);
-    lStatus = nppiConvert_16u32s_C1R(lTmp1, lTmp1Step, lLeft, lLeftStep, lTSize);
+/**********************/
+void colorSegment::solveRegions(inputSlot &pSlot)
+{
+    auto lStartTime = std::chrono::high_resolution_clock::now();
+
+    // Les zones sont empilées verticalement, dans une grille de la largeur de
+    // la plus large. Les arcs qui sortent d'une zone sont nuls, et les noeuds
+    // de remplissage n'ont aucune capacité : les sous-graphes restent disjoints
+    int lWidth = 0;
+    int lHeight = 0;
+    for(unsigned int i=0; i<pSlot.regionCount; i++)
+    {
+        lWidth = std::max(lWidth, pSlot.regionRois[i].width);
+        lHeight += pSlot.regionRois[i].height;
+    }
 
-    // Debug
-#ifdef __DEBUG_GC__
-    lMat = cv::Mat::zeros(lSize.width, lSize.height, CV_16UC1);
-    cudaMemcpy2D(lMat.data, lSize.height*sizeof(ushort), lTmp1, lTmp1Step, lSize.height*sizeof(ushort), lSize.width, cudaMemcpyDeviceToHost);
-    cv::imwrite("left.png", lMat);
-#endif
+    mGraphcutRatio = (float)lWidth/(float)lHeight;
+    mPreSolveDuration = 0.f;
 
-    // On en profite pour allouer les données du graphcut
-    int lGCBufferSize;
-    nppiGraphcutGetSize(lSize, &lGCBufferSize);
-    cudaMalloc((void**)&mCudaGCBuffer, lGCBufferSize);
-    nppiGraphcutInitAlloc(lSize, &mCudaGraphcutState, mCudaGCBuffer);
+    // La disposition change d'une image à l'autre : pas de réutilisation du flot
+    mGraphcut.reset();
+    mPreviousRoi = cv::Rect();
+    mGraphcut.setGrid(lWidth, lHeight);
+    mGraphcutSize = mGraphcut.getNodeCount();
 
-    mCudaLabels = nppiMalloc_8u_C1(lSize.width, lSize.height, &mCudaLabelsStep);
+    int lOffset = 0;
+    for(unsigned int i=0; i<pSlot.regionCount; i++)
+    {
+        cv::Rect &lRoi = pSlot.regionRois[i];
+        cv::Mat lSmoothCosts = smoothCostsColor(pSlot.img, lRoi);
 
-    // Graphcut !
-#ifdef __DEBUG_GC__
-    std::cerr << "Start graphcut ...";
-#endif
-    lStatus = nppiGraphcut_32s8u(lTerminals, lLeft, lRight, lUp, lDown, lDownStep, lLeftStep,
-                                           lSize, mCudaLabels, mCudaLabelsStep, mCudaGraphcutState);
+        for(int y=0; y<lRoi.height; y++)
+        {
+            const cv::Vec2w* lCostsRow = pSlot.regionCosts[i].ptr<cv::Vec2w>(lRoi.y+y) + lRoi.x;
+            const cv::Vec2w* lSmoothRow = lSmoothCosts.ptr<cv::Vec2w>(lRoi.y+y) + lRoi.x;
+            bool lIsLastRow = (y == lRoi.height-1);
 
-#ifdef __DEBUG_GC__
-    if(lStatus < 0)
-        std::cerr << "...a error has occured...";
-    else if(lStatus > 0)
-        std::cerr << "...a warning has occured...";
+            for(int x=0; x<lRoi.width; x++)
+            {
+                int lRight = (x < lRoi.width-1) ? lSmoothRow[x][0] : 0;
+                int lDown = lIsLastRow ? 0 : lSmoothRow[x][1];
+                mGraphcut.setNode(x, lOffset+y, getTerminal(lCostsRow[x]), lRight, lDown);
+            }
+            for(int x=lRoi.width; x<lWidth; x++)
+                mGraphcut.setNode(x, lOffset+y, 0, 0, 0);
+        }
 
-    std::cerr << "... ended." << std::endl;
-#endif
+        lOffset += lRoi.height;
+    }
 
-    // Copie du résultat dans mLabels
+    auto lSolveTime = std::chrono::high_resolution_clock::now();
+    mMetrics.graphSetup = std::chrono::duration_cast<std::chrono::microseconds>(lSolveTime - lStartTime).count() / 1000.f;
+    mGraphcut.setTimeBudget(mTimeBudget);
+    mGraphcut.maxflow();
+    mIsConverged = mGraphcut.isConverged();
+    mResidual = mGraphcut.getResidual();
+    auto lCopyTime = std::chrono::high_resolution_clock::now();
+    mMetrics.maxflow = std::chrono::duration_cast<std::chrono::microseconds>(lCopyTime - lSolveTime).count() / 1000.f;
+    mMetrics.augmentations = mGraphcut.getAugmentationCount();
+    mMetrics.orphans = mGraphcut.getOrphanCount();
+
+    cv::Mat lPacked = mArena.getMat(SLOT_REGION_LABELS, lHeight, lWidth, CV_8UC1);
+    mGraphcut.getLabels(lPacked.data, lPacked.step);
+
+    // Copie du résultat dans mRegionLabels : les zones précédentes sont remises
+    // à 0, puis chaque pixel du FG prend le numéro de sa zone (la dernière
+    // l'emporte si plusieurs zones se recouvrent)
     mLabelCounter++;
     mLabelMutex.lock();
-    mLabels.setTo(1); // On met toutes les valeurs à 1, puis on copie juste la partie segmentée
-    cudaMemcpy2D(mLabels.data+lDeltaBuffer, mFBOSize[0], mCudaLabels, mCudaLabelsStep, lSize.width, lSize.height, cudaMemcpyDeviceToHost);
-    //cv::imwrite("segment.png", mLabels);
-    mLabelMutex.unlock();
+    mIsRegionLabels = true;
+    for(size_t i=0; i<mRegionLabelsRois.size(); i++)
+    {
+        cv::Mat lPrevious = mRegionLabels(mRegionLabelsRois[i]);
+        lPrevious.setTo(0);
+        mMetrics.labelBytes += mRegionLabelsRois[i].area();
+    }
+    mRegionLabelsRois.assign(pSlot.regionRois.begin(), pSlot.regionRois.begin() + pSlot.regionCount);
 
-    nppiFree(mCudaGCBuffer);
-    nppiFree(mCudaLabels);
-    nppiFree(mCudaGraphcutState);
+    lOffset = 0;
+    for(unsigned int i=0; i<pSlot.regionCount; i++)
+    {
+        cv::Rect &lRoi = pSlot.regionRois[i];
+        for(int y=0; y<lRoi.height; y++)
+        {
+            const uchar* lPackedRow = lPacked.ptr<uchar>(lOffset+y);
+            uchar* lLabelsRow = mRegionLabels.ptr<uchar>(lRoi.y+y) + lRoi.x;
+            for(int x=0; x<lRoi.width; x++)
+                if(lPackedRow[x] == 0)
+                    lLabelsRow[x] = i+1;
+        }
+        mMetrics.labelBytes += lRoi.area();
+        lOffset += lRoi.height;
+    }
+    mMetrics.labelCopy = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - lCopyTime).count() / 1000.f;
+    mSolvedTicket = mCurrentTicket;
+    publishMetrics();
+    mLabelMutex.unlock();
+    mLabelCondition.notify_all();
 
-    nppiFree(lTerminals);
-    nppiFree(lUp);
-    nppiFree(lDown);
-    nppiFree(lLeft);
-    nppiFree(lRight);
-    nppiFree(lBuffer);
-    nppiFree(lTmp1);
-    nppiFree(lTmp2);
+    // La durée comprend ici la construction du graphe
+    auto lEndTime = std::chrono::high_resolution_clock::now();
+    mGraphcutDuration = std::chrono::duration_cast<std::chrono::microseconds>(lEndTime - lStartTime).count() / 1000.f;
 }
 
 /**********************/
@@ -1004,35 +2572,69 @@ void colorSegment::prepareTexture()
 /**********************/
 void colorSegment::preparePBO()
 {
-    glGenBuffers(3, mPBO);
-
-    for(int i=0; i<3; i++)
+    // Un PBO par texture du FBO et par emplacement, de la taille du FBO
+    for(int r=0; r<__READBACK_COUNT__; r++)
     {
-        glBindBuffer(GL_PIXEL_PACK_BUFFER, mPBO[i]);
-        glBufferData(GL_PIXEL_PACK_BUFFER, mImgSize[0]*mImgSize[1]*2, NULL, GL_DYNAMIC_COPY);
-        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        glGenBuffers(3, mReadbacks[r].pbo);
+
+        for(int i=0; i<3; i++)
+        {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, mReadbacks[r].pbo[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, mFBOSize[0]*mFBOSize[1]*sizeof(ushort), NULL, GL_STREAM_READ);
+        }
     }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
 }
 
 /**********************/
 void colorSegment::updateTextures(cv::Mat pImg, cv::Mat pCosts)
 {
+    // Seule la zone segmentée est calculée et envoyée, avec pour les coûts
+    // de données les deux pixels voisins lus par le shader à droite et en bas
+    cv::Rect lRoi(mXMin_t, mYMin_t, mXMax_t-mXMin_t, mYMax_t-mYMin_t);
+    cv::Rect lDataRoi(lRoi.x, lRoi.y, lRoi.width+2, lRoi.height+2);
+    lDataRoi &= cv::Rect(0, 0, mImgSize[0], mImgSize[1]);
+
     // Calcul des coûts de lissage
-    cv::Mat lSmoothCosts = smoothCostsColor(pImg);
+    cv::Mat lSmoothCosts = smoothCostsColor(pImg, lRoi);
 
-    // Upload des textures
+    // Upload des textures, les lignes des matrices étant celles de l'image entière
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, mImgSize[0]);
     // Texture de coût lié aux données
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, mCostTextures[0]);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, mImgSize[0], mImgSize[1], GL_RG, GL_UNSIGNED_SHORT, pCosts.data);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, lDataRoi.x, lDataRoi.y, lDataRoi.width, lDataRoi.height, GL_RG, GL_UNSIGNED_SHORT,
+                    pCosts.ptr<cv::Vec2w>(lDataRoi.y) + lDataRoi.x);
     // Texture de coût de lissage
     glActiveTexture(GL_TEXTURE1);
     glBindTexture(GL_TEXTURE_2D, mCostTextures[1]);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, mImgSize[0], mImgSize[1], GL_RG, GL_UNSIGNED_SHORT, lSmoothCosts.data);
-    // Texture de l'image RGB de la caméra
-    glActiveTexture(GL_TEXTURE2);
-    glBindTexture(GL_TEXTURE_2D, mCameraTexture);
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, mImgSize[0], mImgSize[1], GL_RGB, GL_UNSIGNED_BYTE, pImg.data);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, lRoi.x, lRoi.y, lRoi.width, lRoi.height, GL_RG, GL_UNSIGNED_SHORT,
+                    lSmoothCosts.ptr<cv::Vec2w>(lRoi.y) + lRoi.x);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    mMetrics.uploadBytes += (lDataRoi.area() + lRoi.area())*sizeof(cv::Vec2w);
+
+    // Texture de l'image RGB de la caméra, qui ne sert qu'à l'affichage
+    if(!mIsHeadless)
+    {
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_2D, mCameraTexture);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, mImgSize[0], mImgSize[1], GL_RGB, GL_UNSIGNED_BYTE, pImg.data);
+        mMetrics.uploadBytes += mImgSize[0]*mImgSize[1]*3;
+    }
+}
+
+/**********************/
+void colorSegment::resetLabels(cv::Mat &pLabels, cv::Rect &pPreviousRoi, cv::Rect pRoi)
+{
+    // Hors de la zone segmentée, les labels valent 1 : seule la zone
+    // précédente est à remettre à cette valeur
+    if(pPreviousRoi.area() > 0)
+    {
+        cv::Mat lPrevious = pLabels(pPreviousRoi);
+        lPrevious.setTo(1);
+    }
+    mMetrics.labelBytes += pPreviousRoi.area() + pRoi.area();
+    pPreviousRoi = pRoi;
 }
 
 /**********************/
@@ -1053,3 +2655,64 @@ void colorSegment::getInfos(int &size, float &ratio)
     size = mGraphcutSize;
     ratio = mGraphcutRatio;
 }
+
+/**********************/
+void colorSegment::getInfos(int &size, float &ratio, float &duration)
+{
+    getInfos(size, ratio);
+    duration = mGraphcutDuration;
+}
+
+/**********************/
+void colorSegment::getInfos(int &size, float &ratio, float &duration, bool &converged, int &residual)
+{
+    getInfos(size, ratio, duration);
+    converged = mIsConverged;
+    residual = mResidual;
+}
+
+/**********************/
+unsigned int colorSegment::getFrameAllocations()
+{
+    return mFrameAllocations;
+}
+
+/**********************/
+void colorSegment::getWorkerInfos(float &wakeLatency, float &load)
+{
+    wakeLatency = mWakeLatency;
+    load = mWorkerLoad;
+}
+
+/**********************/
+void colorSegment::getDrawInfos(float &render, float &wait, float &copy)
+{
+    render = mRenderDuration;
+    wait = mReadbackWaitDuration;
+    copy = mReadbackCopyDuration;
+}
+
+/**********************/
+void colorSegment::getTrafficInfos(unsigned int &upload, unsigned int &readback, unsigned int &labels)
+{
+    unsigned int lInput;
+    getTrafficInfos(upload, readback, labels, lInput);
+}
+
+/**********************/
+void colorSegment::getTrafficInfos(unsigned int &upload, unsigned int &readback, unsigned int &labels, unsigned int &input)
+{
+    // Compteurs publiés avec les labels de la même image
+    boost::lock_guard<boost::mutex> lLock(mLabelMutex);
+    upload = mSolvedMetrics.uploadBytes;
+    readback = mSolvedMetrics.readbackBytes;
+    labels = mSolvedMetrics.labelBytes;
+    input = mSolvedMetrics.inputBytes;
+}
+
+/**********************/
+colorSegment::frameMetrics colorSegment::getMetrics()
+{
+    boost::lock_guard<boost::mutex> lLock(mLabelMutex);
+    return mSolvedMetrics;
+}
@@ -1,6 +1,7 @@
 /* Classe permettant de créer, à partir d'une matrice définissant les probas
  * liés aux données, un graphe de type MRF puis de le résoudre par une méthode
- * de graph-cut (par l'intermédiaire de la lib NPP).
+ * de graph-cut (par l'intermédiaire de la lib NPP, ou d'un solveur CPU si
+ * aucun GPU CUDA n'est disponible).
  * Et tout ça, ça fait de la segmentation d'image !
  */
 
@@ -11,8 +12,13 @@
 #define GLFW_NO_GLU
 #define GL3_PROTOTYPES
 
+// Nombre de rapatriements asynchrones des textures du FBO en vol
+#define __READBACK_COUNT__ 2
+
 #include <iostream>
 #include <chrono>
+#include <time.h>
+#include <vector>
 
 #include "opencv2/opencv.hpp"
 #include "GL/glfw.h"
@@ -20,6 +26,12 @@
 #include "npp.h"
 #include "boost/thread.hpp"
 #include "tbb/atomic.h"
+#ifdef HAVE_EGL
+#include "EGL/egl.h"
+#endif
+
+#include "bufferarena.h"
+#include "graphcut.h"
 
 #define __CUDA_RUNTIME_H__
 #include "cuda.h"
@@ -28,6 +40,61 @@
 class colorSegment
 {
 public:
+    // Solveurs de graph-cut disponibles
+    enum solverType
+    {
+        SOLVER_NPP = 0,
+        SOLVER_CPU
+    };
+
+    // Construction du graphe : par rendu GL dans un FBO de résolution double
+    // (un noeud supplémentaire par arête), ou directement sur CPU à la résolution
+    // de l'image (toujours résolu par le solveur CPU). Le graphe en bande étroite
+    // se limite aux pixels inconnus et à leurs voisins fixés. Le graphe pyramidal
+    // est d'abord résolu à basse résolution, puis à pleine résolution autour de
+    // la frontière obtenue. Le graphe par superpixels regroupe les pixels
+    // inconnus en régions, qui deviennent les noeuds
+    enum graphType
+    {
+        GRAPH_FBO = 0,
+        GRAPH_NATIVE,
+        GRAPH_NARROWBAND,
+        GRAPH_PYRAMID,
+        GRAPH_SUPERPIXEL
+    };
+
+    // Zone segmentée avec ses propres coûts de données et masques, pour la
+    // résolution groupée de plusieurs objets (limites comme pour setCosts)
+    struct costRegion
+    {
+        cv::Mat bgCosts, fgCosts;
+        cv::Mat bg, fg;
+        unsigned int xMin, xMax, yMin, yMax;
+    };
+
+    // Mesures d'une image résolue, publiées avec ses labels (durées en ms).
+    // Les étapes étrangères au mode utilisé restent à 0
+    struct frameMetrics
+    {
+        unsigned int ticket;
+        float queueWait; // entre setCosts et la prise en main des données
+        float costBuild; // combinaison des coûts et copie de l'image, dans setCosts
+        float upload; // envoi des textures GL
+        float render; // soumission du rendu GL
+        float readback; // attente et copie des PBO
+        float graphSetup; // construction du graphe, ou préparation des capacités
+        float maxflow;
+        float labelCopy;
+        unsigned int augmentations; // chemins augmentants (solveur CPU)
+        unsigned int orphans; // orphelins traités (solveur CPU)
+        unsigned int allocations;
+        size_t allocatedBytes;
+        unsigned int inputBytes; // octets écrits par setCosts
+        unsigned int uploadBytes; // envois vers GL ou CUDA
+        unsigned int readbackBytes; // rapatriements vers l'hôte
+        unsigned int labelBytes; // écritures dans les labels
+    };
+
     colorSegment();
     ~colorSegment();
 
@@ -36,22 +103,90 @@ public:
     bool init();
     bool init(unsigned int pWidth, unsigned int pHeight); // avec les dimensions des textures en paramètres
 
-    // Arrêt de la segmentation
+    // Arrêt de la segmentation : réveil et attente de la fin du thread de calcul
     void stop();
 
+    // Attente active des nouvelles données par le thread de calcul, au lieu
+    // d'attendre le signal de setCosts (ancien comportement, pour comparaison)
+    void setPolling(bool pPolling);
+
+    // Choix du solveur de graph-cut. Le solveur NPP n'est accepté
+    // que si CUDA a été détecté
+    bool setSolver(solverType pSolver);
+
+    // Rendu GL sans fenêtre (contexte EGL), sans passe d'affichage ni
+    // synchronisation verticale. Doit être appelé avant init(), et n'est
+    // accepté que si EGL a été détecté à la compilation
+    bool setHeadless(bool pHeadless);
+
+    // Choix du mode de construction du graphe
+    void setGraphType(graphType pType);
+
+    // Nombre de threads utilisés par le solveur CPU
+    void setThreadCount(unsigned int pCount);
+
+    // Réutilisation du flot de l'image précédente par le solveur CPU,
+    // tant que la zone segmentée ne change pas
+    void setDynamic(bool pDynamic);
+
+    // Facteur de réduction de la résolution en mode pyramidal (2 ou 4)
+    void setPyramidScale(unsigned int pScale);
+
+    // Taille (côté, en pixels) des superpixels
+    void setSuperpixelSize(unsigned int pSize);
+
+    // Budget de temps du solveur CPU pour chaque image, en ms (0 pour aucune
+    // limite). Une fois dépassé, la meilleure segmentation actuelle est renvoyée
+    void setTimeBudget(float pBudget);
+
     // Spécification du coût maximum de lissage
     void setMaxSmoothCost(unsigned int pCost);
 
     // Attribution de nouveaux coûts de données, de la nouvelle image,
     // avec un masque pour les éventuelle données fixées
-    bool setCosts(cv::Mat &pImg, cv::Mat &pBGCosts, cv::Mat &pFGCosts, cv::Mat pBG = cv::Mat(), cv::Mat pFG = cv::Mat(),
-                  unsigned int pXMin=0, unsigned int pXMax=640, unsigned int pYMin=0, unsigned int pYMax=480);
-
-    // Récupération de la segmentation
+    // Renvoie le ticket de cette image (0 si les données sont invalides)
+    // Ne doit être appelé que depuis un seul thread
+    unsigned int setCosts(cv::Mat &pImg, cv::Mat &pBGCosts, cv::Mat &pFGCosts, cv::Mat pBG = cv::Mat(), cv::Mat pFG = cv::Mat(),
+                          unsigned int pXMin=0, unsigned int pXMax=640, unsigned int pYMin=0, unsigned int pYMax=480);
+    // Plusieurs zones de la même image, résolues ensemble dans un seul graphe
+    // (toujours sur CPU, à la résolution de l'image). La segmentation renvoyée
+    // porte alors le numéro (à partir de 1) de la zone de chaque pixel du FG,
+    // et 0 ailleurs
+    unsigned int setCosts(cv::Mat &pImg, std::vector<costRegion> &pRegions);
+
+    // Récupération de la segmentation, si elle a changé depuis le dernier appel
     bool getSegment(cv::Mat &pSegment);
+    // Récupération de la segmentation de l'image de ticket pTicket, en attendant
+    // au plus pTimeout ms. Si le calcul a sauté cette image, c'est la segmentation
+    // d'une image plus récente qui est renvoyée, son ticket étant dans pSolvedTicket
+    bool getSegment(cv::Mat &pSegment, unsigned int pTicket, unsigned int pTimeout, unsigned int *pSolvedTicket = NULL);
+    // Mêmes appels, mais seule la zone segmentée est copiée (à la résolution
+    // de l'image), sa position dans l'image étant renvoyée dans pRoi
+    bool getSegment(cv::Mat &pSegment, cv::Rect &pRoi);
+    bool getSegment(cv::Mat &pSegment, cv::Rect &pRoi, unsigned int pTicket, unsigned int pTimeout, unsigned int *pSolvedTicket = NULL);
 
     // Renvoie des infos sur la zone segmentée
     void getInfos(int &size, float &ratio);
+    // ... ainsi que le temps de résolution du graph-cut (en ms)
+    void getInfos(int &size, float &ratio, float &duration);
+    // ... et si la résolution est allée à son terme, ou sinon le nombre
+    // de noeuds encore actifs lors de son arrêt
+    void getInfos(int &size, float &ratio, float &duration, bool &converged, int &residual);
+    // Nombre d'allocations de buffers faites lors de la dernière image
+    unsigned int getFrameAllocations();
+    // Délai entre setCosts et le réveil du thread de calcul (en ms), et part
+    // d'un coeur utilisée par ce thread depuis l'image précédente
+    void getWorkerInfos(float &wakeLatency, float &load);
+    // Durées (en ms) de la soumission du dernier rendu GL des coûts, de l'attente
+    // de son rapatriement, et de la copie de la zone segmentée depuis les PBO
+    void getDrawInfos(float &render, float &wait, float &copy);
+    // Octets transférés pour la dernière image résolue : envois vers GL ou
+    // CUDA, rapatriements vers l'hôte, et écritures dans les labels
+    void getTrafficInfos(unsigned int &upload, unsigned int &readback, unsigned int &labels);
+    // ... et octets écrits par setCosts dans l'emplacement de l'image
+    void getTrafficInfos(unsigned int &upload, unsigned int &readback, unsigned int &labels, unsigned int &input);
+    // Mesures de la dernière image résolue
+    frameMetrics getMetrics();
 
 private:
     /***********/
@@ -60,35 +195,132 @@ private:
     // Variables intéressants à récupérer pour stats
     int mGraphcutSize;
     float mGraphcutRatio;
-
-    bool mIsRunning;
+    float mGraphcutDuration;
+    float mPreSolveDuration;
+    bool mIsConverged;
+    int mResidual;
+    unsigned int mFrameAllocations;
+
+    float mWakeLatency;
+    float mWorkerLoad;
+    float mRenderDuration;
+    float mReadbackWaitDuration;
+    float mReadbackCopyDuration;
+    // Mesures de l'image en cours (thread de calcul), et de la dernière
+    // image résolue (protégées par mLabelMutex)
+    frameMetrics mMetrics;
+    frameMetrics mSolvedMetrics;
+    unsigned int mGraphAllocations; // compteur du solveur CPU en début d'image
+
+    tbb::atomic<bool> mIsRunning; // lu sans verrou par le thread de calcul
+    bool mIsGLReady;
+    bool mIsHeadless;
+    bool mIsPolling;
+
+    // Solveur utilisé
+    bool mIsNPP;
+    solverType mSolver;
+    graphType mGraphType;
+    unsigned int mPyramidScale;
+    unsigned int mSuperpixelSize;
+    float mTimeBudget;
 
     // Calcul des coûts de lissage
     float mSigmaCam;
     int mMaxSmoothCost;
     int mCannyCost;
+    unsigned int mThreadCount;
+    // Tables : coordonnées cartésiennes (a, b) de chaque couple teinte /
+    // saturation, et coût selon le carré de la distance entre couleurs
+    std::vector<float> mHueTable;
+    std::vector<float> mExpTable;
+    float mExpTableSigma;
+    int mExpTableCost;
 
     // Caractériques des images
     int mImgSize[2];
 
-    // Limites pour la segmentation
+    // Limites pour la segmentation, côté producteur
     unsigned int mXMin, mXMax, mYMin, mYMax;
-    // Les mêmes limites, mais thread safe
+    // Les limites des données en cours de calcul
     unsigned int mXMin_t, mXMax_t, mYMin_t, mYMax_t;
 
-    // Stockage de l'image à segmenter
-    cv::Mat mImg;
-    // Stockage des coûts de données, fournis
-    cv::Mat mDataCosts;
+    // Emplacements d'entrée (image à segmenter, retournée, et coûts de données),
+    // alloués une fois pour toutes. A tout instant, l'un appartient à setCosts,
+    // un autre au thread de calcul, et le dernier est celui publié. Les
+    // échanges se font par opérations atomiques sur mReadySlot, sans copie
+    struct inputSlot
+    {
+        cv::Mat img;
+        cv::Mat costs;
+        unsigned int xMin, xMax, yMin, yMax;
+        unsigned int ticket;
+        std::chrono::high_resolution_clock::time_point time;
+        float buildDuration; // durée de setCosts, en ms
+        unsigned int inputBytes; // octets écrits par setCosts
+        // Résolution groupée : coûts et zone de chaque objet (aucun si
+        // regionCount est nul). Les coûts ne sont alloués qu'au premier usage
+        std::vector<cv::Mat> regionCosts;
+        std::vector<cv::Rect> regionRois;
+        unsigned int regionCount;
+    };
+    inputSlot mInputSlots[3];
+    unsigned int mWriteSlot; // utilisé uniquement par setCosts
+    unsigned int mReadSlot; // utilisé uniquement par le thread de calcul
+    tbb::atomic<unsigned> mReadySlot; // indice, et marqueur de nouveauté
     // Stockage des labels calculés
     cv::Mat mLabels;
+    // ... ou, pour le graphe natif, à la résolution de l'image
+    cv::Mat mNativeLabels;
+    // Zones écrites lors de la dernière résolution, seules à remettre à 1
+    cv::Rect mLabelsRoi;
+    cv::Rect mNativeLabelsRoi;
+    bool mIsNativeLabels;
+    // ... ou, pour une résolution groupée, numéro de l'objet de chaque pixel,
+    // et zones écrites lors de la dernière résolution
+    cv::Mat mRegionLabels;
+    std::vector<cv::Rect> mRegionLabelsRois;
+    bool mIsRegionLabels;
+    // Labels des pixels de la zone hors de la bande étroite (vide sinon)
+    cv::Mat mBandLabels;
+
+    // Superpixels : germes, superpixel de chaque pixel de la zone (-1 si fixé),
+    // et données de construction du graphe
+    struct superpixel
+    {
+        float color[3];
+        float x, y;
+        float sum[5];
+        int size;
+    };
+    std::vector<superpixel> mSuperpixels;
+    cv::Mat mSuperpixelMap;
+    std::vector<int> mSuperpixelTerminals;
+    std::vector<std::pair<long long, int> > mSuperpixelPairs;
+    std::vector<std::pair<int, int> > mSuperpixelEdges;
+    std::vector<int> mSuperpixelWeights;
 
     // Thread
     boost::shared_ptr<boost::thread> mMainLoop;
-    boost::mutex mImgMutex;
+    boost::mutex mImgMutex; // n'accompagne que mInputCondition
     boost::mutex mLabelMutex;
     tbb::atomic<unsigned> mInputCounter;
     tbb::atomic<unsigned> mLabelCounter;
+    boost::condition_variable mInputCondition; // signalée par setCosts
+    unsigned int mReadCounter; // valeur de mLabelCounter lors de la dernière lecture
+
+    // Tickets : celui des données en cours de calcul, et celui des derniers
+    // labels calculés (protégé par mLabelMutex)
+    unsigned int mCurrentTicket;
+    unsigned int mSolvedTicket;
+    boost::condition_variable mLabelCondition;
+
+    // Contexte EGL du mode sans fenêtre
+#ifdef HAVE_EGL
+    EGLDisplay mEGLDisplay;
+    EGLContext mEGLContext;
+    EGLSurface mEGLSurface;
+#endif
 
     // Données OpenGL
     GLuint mVertexArray;
@@ -118,22 +350,83 @@ private:
     Npp8u* mCudaGCBuffer;
     Npp8u* mCudaLabels;
     NppiGraphcutState* mCudaGraphcutState;
+    NppiSize mCudaGraphcutSize;
 
     int mCudaLabelsStep;
 
-    // Des PBO, pour l'interop entre CUDA et GL (vu que ça marche pas avec les textures ...
-    GLuint mPBO[3];
+    // Solveur CPU
+    graphCut mGraphcut;
+    // Zone et type du dernier graphe résolu, pour la réutilisation du flot
+    cv::Rect mPreviousRoi;
+    graphType mPreviousGraphType;
+    // ... et celui du graphe à basse résolution du mode pyramidal
+    graphCut mCoarseGraph;
+
+    // Buffers conservés d'une image à l'autre, quel que soit le solveur
+    enum arenaSlot
+    {
+        SLOT_DATA = 0,
+        SLOT_TERMINALS,
+        SLOT_LEFT,
+        SLOT_RIGHT,
+        SLOT_UP,
+        SLOT_DOWN,
+        SLOT_BUFFER,
+        SLOT_TMP1,
+        SLOT_TMP2,
+        SLOT_GC_BUFFER,
+        SLOT_LABELS,
+        SLOT_HSV,
+        SLOT_GRAY,
+        SLOT_SMOOTH,
+        SLOT_BAND,
+        SLOT_BAND_LABELS,
+        SLOT_COARSE,
+        SLOT_COARSE_LABELS,
+        SLOT_LAB,
+        SLOT_SUPERPIXELS,
+        SLOT_SUPERPIXEL_DIST,
+        SLOT_REGION_LABELS
+    };
+    bufferArena mArena;
+
+    // Rapatriements asynchrones des textures du FBO : pour chaque emplacement,
+    // un PBO par texture, la barrière signalant la fin de la copie, et les
+    // données de l'image rendue. Egalement utilisables pour l'interop entre
+    // CUDA et GL (vu que ça marche pas avec les textures ...)
+    struct readback
+    {
+        GLuint pbo[3];
+        GLsync fence;
+        unsigned int xMin, xMax, yMin, yMax;
+        unsigned int ticket;
+        frameMetrics metrics;
+    };
+    readback mReadbacks[__READBACK_COUNT__];
+    unsigned int mReadbackHead; // prochain emplacement utilisé
+    unsigned int mPendingReadbacks;
 
     struct cudaGraphicsResource* mCudaResources[3];
 
     /**********/
     // Méthodes
     /**********/
-    // Calcul des coûts de lissage
-    cv::Mat smoothCostsColor(cv::Mat &pImg);
+    // Calcul des coûts de lissage, sur la zone pRoi seulement
+    cv::Mat smoothCostsColor(cv::Mat &pImg, cv::Rect pRoi);
+    void updateSmoothTables();
+    // Calcul des lignes [pBegin, pEnd[ de la zone, pHSV et pGray étant
+    // limitées à la zone (et aux voisins de sa dernière ligne et colonne)
+    void smoothCostsRows(const cv::Mat &pHSV, const cv::Mat &pGray, cv::Mat &pCosts, cv::Rect pRoi, int pBegin, int pEnd);
+#ifdef __DEBUG_GC__
+    // Calcul direct, pour comparaison
+    void smoothCostsReference(cv::Mat &pImg, cv::Rect pRoi, cv::Mat &pCosts);
+#endif
 
     // Initialisation des données OpenGL
     bool initGL();
+    // ... et du contexte EGL en mode sans fenêtre
+    bool initEGL();
+    void releaseEGL();
 
     // Initialisation de CUDA
     bool initNPP();
@@ -144,9 +437,37 @@ private:
 
     // Rendu GL
     void drawGL();
+    // Fin des rapatriements en vol (sauf les pKeep plus récents), et résolution
+    // des images correspondantes
+    void finishReadbacks(unsigned int pKeep);
+    // Abandon du flot précédent si la zone ou le type de graphe a changé
+    void updateGraphReuse(graphType pType);
 
     // Calcul Npp;
     void computeCuda();
+    // Calcul sur CPU, à partir des mêmes données
+    void computeCpu();
+
+    // Construction du graphe à la résolution de l'image, éventuellement
+    // limité à une bande de pixels, puis résolution
+    void buildNativeGraph(graphCut &pGraph, cv::Mat &pImg, cv::Mat &pCosts, graphType pType);
+    // Graphe limité aux pixels non nuls de pBand (à l'échelle de la zone segmentée),
+    // les pixels voisins étant fixés aux labels de mBandLabels
+    void buildBandGraph(graphCut &pGraph, cv::Mat &pCosts, cv::Mat &pSmoothCosts, cv::Mat &pBand);
+    // Résolution à basse résolution, qui fixe mBandLabels et réduit pBand
+    // au voisinage de la frontière trouvée
+    void solveCoarse(cv::Mat &pCosts, cv::Mat &pSmoothCosts, cv::Mat &pBand);
+    // Regroupement des pixels non nuls de pBand en superpixels, puis graphe
+    // dont ils sont les noeuds
+    void computeSuperpixels(cv::Mat &pImg, cv::Mat &pBand, cv::Mat &pMap);
+    void buildSuperpixelGraph(graphCut &pGraph, cv::Mat &pImg, cv::Mat &pCosts, cv::Mat &pSmoothCosts, cv::Mat &pBand);
+    void linkSuperpixels(int pFirst, int pSecond, uchar pFirstLabel, uchar pSecondLabel, int pWeight, int pCount);
+    // Terminal d'un pixel, à partir de ses coûts de données
+    int getTerminal(const cv::Vec2w &pCosts);
+    void computeNative(graphType pType);
+    // Résolution groupée : les zones sont empilées dans une même grille,
+    // sans arc entre elles, puis résolues en un seul appel
+    void solveRegions(inputSlot &pSlot);
 
     // Préparation des shaders
     char* readFile(const char* pFile);
@@ -163,6 +484,25 @@ private:
     // Mise à jour des textures
     void updateTextures(cv::Mat pImg, cv::Mat pCosts);
 
+    // Remise à 1 des labels de la zone précédente, avant écriture de pRoi
+    void resetLabels(cv::Mat &pLabels, cv::Rect &pPreviousRoi, cv::Rect pRoi);
+
+    // Récupération des labels, de toute l'image ou de la zone segmentée seule
+    // (si pRoi n'est pas nul)
+    bool readSegment(cv::Mat &pSegment, cv::Rect *pRoi);
+    bool waitSegment(cv::Mat &pSegment, cv::Rect *pRoi, unsigned int pTicket, unsigned int pTimeout, unsigned int *pSolvedTicket);
+    // Publication des mesures de l'image résolue, mLabelMutex devant être verrouillé
+    void publishMetrics();
+
+    // Copie des labels dans pSegment, mLabelMutex devant être verrouillé
+    void copySegment(cv::Mat &pSegment, cv::Rect *pRoi);
+
+    // Combinaison des coûts de données et des masques sur la zone pRoi
+    // (en coordonnées retournées), écrite dans pCosts
+    void writeCosts(cv::Mat &pCosts, cv::Mat &pBGCosts, cv::Mat &pFGCosts, cv::Mat &pBG, cv::Mat &pFG, cv::Rect pRoi);
+    // Copie retournée de l'image, puis publication de l'emplacement du producteur
+    unsigned int publishSlot(cv::Mat &pImg, std::chrono::high_resolution_clock::time_point pStartTime);
+
     // Vérification des dimensions et du type d'une matrice opencv
     bool checkMatrix(cv::Mat &pMat, int pType);
 };
@@ -1,20 +1,113 @@
-#include <thread>
-#include <atomic>
+#include <chrono>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "gmm.h"
 #include "math.h"
-
-#define __THREAD_COUNT__ 4
+#include "threadpool.h"
+
+// Nombre minimal d'échantillons d'une tranche
+#define __GMM_GRAIN__ 1024
+// Nombre de valeurs de teinte en HSV 8 bits
+#define __GMM_HUE_BINS__ 180
+// Nombre minimal de lignes d'une tranche, pour les coûts
+#define __GMM_ROW_GRAIN__ 16
+// Sommes de l'EM par cluster : poids, puis écarts et carrés des écarts
+// à l'ancien mu (H et S)
+#define __GMM_SUMS__ 5
+// Nombre d'échantillons dont les sommes sont accumulées en simple précision
+// par les noyaux SSE, avant d'être reportées en double
+#define __GMM_SIMD_BLOCK__ 256
+// Passes de l'EM chronométrées pour comparer les noyaux (__DEBUG_GMM__)
+#define __GMM_BENCH_PASSES__ 10
 
 using namespace std;
 
+#ifdef __SSE2__
+// exp() sur 4 flottants (polynômes de Cephes) : x = n ln2 + r, exp(x) = 2^n exp(r).
+// Nulle en deçà du plus petit flottant normalisé, comme le résultat de expf()
+// arrondi à 0
+static inline __m128 expSSE(__m128 pX)
+{
+    const __m128 lMin = _mm_set1_ps(-87.3365447f);
+    __m128 lIsDefined = _mm_cmpgt_ps(pX, lMin);
+    __m128 lX = _mm_min_ps(_mm_max_ps(pX, lMin), _mm_set1_ps(88.3762626f));
+
+    // n = floor(x/ln2 + 0.5)
+    __m128 lN = _mm_add_ps(_mm_mul_ps(lX, _mm_set1_ps(1.44269504088896341f)), _mm_set1_ps(0.5f));
+    __m128 lTrunc = _mm_cvtepi32_ps(_mm_cvttps_epi32(lN));
+    lN = _mm_sub_ps(lTrunc, _mm_and_ps(_mm_cmpgt_ps(lTrunc, lN), _mm_set1_ps(1.f)));
+
+    // ln2 en deux parties, pour garder la précision de r
+    lX = _mm_sub_ps(lX, _mm_mul_ps(lN, _mm_set1_ps(0.693359375f)));
+    lX = _mm_sub_ps(lX, _mm_mul_ps(lN, _mm_set1_ps(-2.12194440e-4f)));
+
+    __m128 lY = _mm_set1_ps(1.9875691500e-4f);
+    lY = _mm_add_ps(_mm_mul_ps(lY, lX), _mm_set1_ps(1.3981999507e-3f));
+    lY = _mm_add_ps(_mm_mul_ps(lY, lX), _mm_set1_ps(8.3334519073e-3f));
+    lY = _mm_add_ps(_mm_mul_ps(lY, lX), _mm_set1_ps(4.1665795894e-2f));
+    lY = _mm_add_ps(_mm_mul_ps(lY, lX), _mm_set1_ps(1.6666665459e-1f));
+    lY = _mm_add_ps(_mm_mul_ps(lY, lX), _mm_set1_ps(5.0000001201e-1f));
+    lY = _mm_add_ps(_mm_add_ps(_mm_mul_ps(lY, _mm_mul_ps(lX, lX)), lX), _mm_set1_ps(1.f));
+
+    // 2^n, construit directement dans l'exposant
+    __m128i lPow = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(lN), _mm_set1_epi32(0x7f)), 23);
+    return _mm_and_ps(_mm_mul_ps(lY, _mm_castsi128_ps(lPow)), lIsDefined);
+}
+
+// log10() sur 4 flottants normalisés et positifs (polynômes de Cephes) :
+// x = m 2^e, avec m dans [sqrt(2)/2, sqrt(2)[
+static inline __m128 log10SSE(__m128 pX)
+{
+    __m128i lBits = _mm_castps_si128(pX);
+    __m128 lE = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(lBits, 23), _mm_set1_epi32(0x7e)));
+    __m128 lM = _mm_or_ps(_mm_castsi128_ps(_mm_and_si128(lBits, _mm_set1_epi32(0x007fffff))), _mm_set1_ps(0.5f));
+
+    __m128 lIsSmall = _mm_cmplt_ps(lM, _mm_set1_ps(0.707106781186547524f));
+    lE = _mm_sub_ps(lE, _mm_and_ps(lIsSmall, _mm_set1_ps(1.f)));
+    lM = _mm_add_ps(_mm_sub_ps(lM, _mm_set1_ps(1.f)), _mm_and_ps(lIsSmall, lM));
+
+    __m128 lZ = _mm_mul_ps(lM, lM);
+    __m128 lY = _mm_set1_ps(7.0376836292e-2f);
+    lY = _mm_add_ps(_mm_mul_ps(lY, lM), _mm_set1_ps(-1.1514610310e-1f));
+    lY = _mm_add_ps(_mm_mul_ps(lY, lM), _mm_set1_ps(1.1676998740e-1f));
+    lY = _mm_add_ps(_mm_mul_ps(lY, lM), _mm_set1_ps(-1.2420140846e-1f));
+    lY = _mm_add_ps(_mm_mul_ps(lY, lM), _mm_set1_ps(1.4249322787e-1f));
+    lY = _mm_add_ps(_mm_mul_ps(lY, lM), _mm_set1_ps(-1.6668057665e-1f));
+    lY = _mm_add_ps(_mm_mul_ps(lY, lM), _mm_set1_ps(2.0000714765e-1f));
+    lY = _mm_add_ps(_mm_mul_ps(lY, lM), _mm_set1_ps(-2.4999993993e-1f));
+    lY = _mm_add_ps(_mm_mul_ps(lY, lM), _mm_set1_ps(3.3333331174e-1f));
+    lY = _mm_mul_ps(_mm_mul_ps(lY, lM), lZ);
+
+    lY = _mm_add_ps(lY, _mm_mul_ps(lE, _mm_set1_ps(-2.12194440e-4f)));
+    lY = _mm_sub_ps(lY, _mm_mul_ps(lZ, _mm_set1_ps(0.5f)));
+    __m128 lLog = _mm_add_ps(_mm_add_ps(lM, lY), _mm_mul_ps(lE, _mm_set1_ps(0.693359375f)));
+
+    return _mm_mul_ps(lLog, _mm_set1_ps(0.434294481903251828f));
+}
+
+// Somme des 4 flottants, en double
+static inline double sumSSE(__m128 pX)
+{
+    float lValues[4];
+    _mm_storeu_ps(lValues, pX);
+    return ((double)lValues[0] + lValues[1]) + ((double)lValues[2] + lValues[3]);
+}
+#endif
+
 /***********************/
 gmm::gmm()
     :mIsGmm(false),
       mClusterCount(3),
       mEMLikelihood(1e-1),
       mMaxEMLoop(10),
-      mMaxCost(10)
+      mMaxCost(10),
+      mIsHistogramFit(true),
+      mIsVectorized(true),
+      mThroughput(0.f),
+      mTableDuration(0.f),
+      mCostsDuration(0.f)
 {
 }
 
@@ -53,7 +146,26 @@ void gmm::setMaxCost(int pCost)
     if(pCost <= 0)
         return;
 
+    if(pCost == mMaxCost)
+        return;
+
     mMaxCost = pCost;
+
+    // La table dépend du coût maximum
+    if(mIsGmm)
+        buildCostTable();
+}
+
+/***********************/
+void gmm::setHistogramFit(bool pHistogram)
+{
+    mIsHistogramFit = pHistogram;
+}
+
+/***********************/
+void gmm::setVectorized(bool pVectorized)
+{
+    mIsVectorized = pVectorized;
 }
 
 /***********************/
@@ -84,30 +196,85 @@ void gmm::calcGmm(cv::Mat &pMask)
     if(pMask.rows != mColorImg.rows || pMask.cols != mColorImg.cols)
         return;
 
-    // L'image doit être convertie en matrice Nx1
-    cv::Mat lKMeanSource = cv::Mat::zeros(mColorImg.rows*mColorImg.cols, 2, CV_32F);
-
-    cv::MatIterator_<float> lKMeanIt = lKMeanSource.begin<float>();
-    cv::MatConstIterator_<cv::Vec3b> lImgIt = mColorImg.begin<cv::Vec3b>();
-    cv::MatConstIterator_<uchar> lMaskIt = pMask.begin<uchar>();
-    cv::MatConstIterator_<cv::Vec3b> lEnd = mColorImg.end<cv::Vec3b>();
+#ifdef __DEBUG_GMM__
+    auto lStartTime = chrono::high_resolution_clock::now();
+#endif
 
+    // Echantillons (teinte, saturation) et leur poids. Sur les pixels, chaque
+    // pixel masqué est un échantillon de poids 1. Sur l'histogramme, chaque
+    // couple teinte / saturation présent est un échantillon, de poids son nombre
+    // de pixels : au plus 180x256 échantillons, quelle que soit la taille du masque
+    cv::Mat lKMeanSource;
+    cv::Mat lSampleWeights;
     int lMaskPixels = 0;
-    for(; lImgIt < lEnd; lImgIt++, lMaskIt++)
+
+    if(mIsHistogramFit)
+    {
+        std::vector<int> lHistogram(__GMM_HUE_BINS__*256, 0);
+        for(int y=0; y<mColorImg.rows; y++)
+        {
+            const cv::Vec3b* lImgRow = mColorImg.ptr<cv::Vec3b>(y);
+            const uchar* lMaskRow = pMask.ptr<uchar>(y);
+            for(int x=0; x<mColorImg.cols; x++)
+            {
+                if(lMaskRow[x] > 0)
+                {
+                    lHistogram[min((int)lImgRow[x][0], __GMM_HUE_BINS__-1)*256 + lImgRow[x][1]]++;
+                    lMaskPixels++;
+                }
+            }
+        }
+
+        int lBins = 0;
+        for(size_t b=0; b<lHistogram.size(); b++)
+            if(lHistogram[b] > 0)
+                lBins++;
+
+        lKMeanSource = cv::Mat(lBins, 2, CV_32F);
+        lSampleWeights = cv::Mat(lBins, 1, CV_32F);
+        int lIndex = 0;
+        for(size_t b=0; b<lHistogram.size(); b++)
+        {
+            if(lHistogram[b] == 0)
+                continue;
+
+            lKMeanSource.at<float>(lIndex, 0) = (b/256)*2.f;
+            lKMeanSource.at<float>(lIndex, 1) = (b%256)/2.55f;
+            lSampleWeights.at<float>(lIndex) = (float)lHistogram[b];
+            lIndex++;
+        }
+    }
+    else
     {
-        // Si la zone n'est pas masquée
-        if(*lMaskIt > 0)
+        // L'image doit être convertie en matrice Nx1
+        lKMeanSource = cv::Mat::zeros(mColorImg.rows*mColorImg.cols, 2, CV_32F);
+
+        cv::MatIterator_<float> lKMeanIt = lKMeanSource.begin<float>();
+        cv::MatConstIterator_<cv::Vec3b> lImgIt = mColorImg.begin<cv::Vec3b>();
+        cv::MatConstIterator_<uchar> lMaskIt = pMask.begin<uchar>();
+        cv::MatConstIterator_<cv::Vec3b> lEnd = mColorImg.end<cv::Vec3b>();
+
+        for(; lImgIt < lEnd; lImgIt++, lMaskIt++)
         {
-            *lKMeanIt = (*lImgIt)[0]*2.f;
-            *(lKMeanIt+1) = (*lImgIt)[1]/2.55f;
+            // Si la zone n'est pas masquée
+            if(*lMaskIt > 0)
+            {
+                *lKMeanIt = (*lImgIt)[0]*2.f;
+                *(lKMeanIt+1) = (*lImgIt)[1]/2.55f;
 
-            //std::cerr << *lKMeanIt << " " << *(lKMeanIt+1) << std::endl;
+                //std::cerr << *lKMeanIt << " " << *(lKMeanIt+1) << std::endl;
 
-            lMaskPixels++;
-            lKMeanIt += 2;
+                lMaskPixels++;
+                lKMeanIt += 2;
+            }
         }
+        lKMeanSource.resize((size_t)lMaskPixels);
+        lSampleWeights = cv::Mat::ones(lMaskPixels, 1, CV_32F);
     }
-    lKMeanSource.resize((size_t)lMaskPixels);
+
+    int lSampleCount = lKMeanSource.rows;
+    if(lSampleCount == 0)
+        return;
 
     // Recherche des clusters, step 1 : kmeans
     cv::Mat lMu;
@@ -117,7 +284,11 @@ void gmm::calcGmm(cv::Mat &pMask)
     lCriteria.maxCount = 5;
     lCriteria.epsilon = 0.5f;
 
-    cv::kmeans(lKMeanSource, mClusterCount, lKMeanLabels, lCriteria, 2, cv::KMEANS_PP_CENTERS, lMu);
+    // Le kmeans d'OpenCV ne gère pas les poids
+    if(mIsHistogramFit)
+        weightedKMeans(lKMeanSource, lSampleWeights, lCriteria, 2, lKMeanLabels, lMu);
+    else
+        cv::kmeans(lKMeanSource, mClusterCount, lKMeanLabels, lCriteria, 2, cv::KMEANS_PP_CENTERS, lMu);
 
 //    cerr << "KMean : " << lMaskPixels << " samples." << endl;
 //    cerr << "Mu_H / Mu_S" << endl;
@@ -133,187 +304,123 @@ void gmm::calcGmm(cv::Mat &pMask)
     cv::Mat lSigma(mClusterCount, 2, CV_32F);
     cv::Mat lWeight(mClusterCount, 1, CV_32F);
 
-    // Ces pointeurs de threads sont réutilisés tout au long de cette méthode
-    std::thread* threads[__THREAD_COUNT__];
+    // Les boucles sont réparties sur le pool partagé par toutes les GMM
+    threadPool &lPool = threadPool::getInstance();
 
-    for (int t = 0; t < __THREAD_COUNT__; ++t)
+    lPool.parallelFor(0, mClusterCount, 1, [&] (int pFirst, int pLast)
     {
-        threads[t] = new std::thread([&, t] ()
+        for(int i=pFirst; i<pLast; i++) // Pour chaque centroid
         {
-            for(int i=t; i<mClusterCount; i+=__THREAD_COUNT__) // Pour chaque centroid
-            {
-                lSigma.at<float>(i, 0) = 0.f;
-                lSigma.at<float>(i, 1) = 0.f;
-                atomic<int> lNumber;
-                lNumber = 0;
+            lSigma.at<float>(i, 0) = 0.f;
+            lSigma.at<float>(i, 1) = 0.f;
+            float lNumber = 0.f;
 
-                for(int index=0; index<lMaskPixels; index++)
-                {
-                    if(lKMeanLabels.at<int>(index) == i)
-                    {
-                        lSigma.at<float>(i, 0) += (lKMeanSource.at<float>(index, 0)-lMu.at<float>(i, 0))*(lKMeanSource.at<float>(index, 0)-lMu.at<float>(i, 0));
-                        lSigma.at<float>(i, 1) += (lKMeanSource.at<float>(index, 1)-lMu.at<float>(i, 1))*(lKMeanSource.at<float>(index, 1)-lMu.at<float>(i, 1));
-                        lNumber++;
-                    }
-                }
-
-                if(lNumber > 0)
+            for(int index=0; index<lSampleCount; index++)
+            {
+                if(lKMeanLabels.at<int>(index) == i)
                 {
-                    lSigma.at<float>(i, 0) /= (float)lNumber;
-                    lSigma.at<float>(i, 1) /= (float)lNumber;
+                    float lSampleWeight = lSampleWeights.at<float>(index);
+                    lSigma.at<float>(i, 0) += lSampleWeight*(lKMeanSource.at<float>(index, 0)-lMu.at<float>(i, 0))*(lKMeanSource.at<float>(index, 0)-lMu.at<float>(i, 0));
+                    lSigma.at<float>(i, 1) += lSampleWeight*(lKMeanSource.at<float>(index, 1)-lMu.at<float>(i, 1))*(lKMeanSource.at<float>(index, 1)-lMu.at<float>(i, 1));
+                    lNumber += lSampleWeight;
                 }
+            }
 
-                lWeight.at<float>(i) = (float)lNumber/(float)(lMaskPixels);
+            if(lNumber > 0.f)
+            {
+                lSigma.at<float>(i, 0) /= lNumber;
+                lSigma.at<float>(i, 1) /= lNumber;
             }
-        } );
-    }
-    for (int t = 0; t < __THREAD_COUNT__; ++t)
+
+            lWeight.at<float>(i) = lNumber/(float)(lMaskPixels);
+        }
+    } );
+
+    // Echantillons en structure de tableaux pour les passes de l'EM
+    mSampleHues.resize(lSampleCount);
+    mSampleSats.resize(lSampleCount);
+    mSampleWeights.resize(lSampleCount);
+    for(int index=0; index<lSampleCount; index++)
     {
-        threads[t]->join();
-        delete threads[t];
+        mSampleHues[index] = lKMeanSource.at<float>(index, 0);
+        mSampleSats[index] = lKMeanSource.at<float>(index, 1);
+        mSampleWeights[index] = lSampleWeights.at<float>(index);
     }
 
-    // On calcule la vraisemblance initiale de cette GM
-    float lLikelihood;
-    lLikelihood = getLikelihood(lKMeanSource, lMu, lSigma, lWeight);
-
     // Boucle principale
+    // Chaque passe sur les échantillons calcule à la fois la vraisemblance
+    // des paramètres actuels (E-step) et les sommes nécessaires au M-step,
+    // sans stocker les responsabilités de chaque échantillon
     // On limite le nombre de tours ...
+    std::vector<clusterConstants> lClusters;
     unsigned int lCounter = 0;
-    bool lContinue = true;
-    while(lContinue && lCounter < mMaxEMLoop)
+    float lLikelihood = 0.f;
+    float lEMDuration = 0.f;
+    while(true)
     {
-        lCounter++;
+        getClusterConstants(lMu, lSigma, lWeight, lClusters);
 
-        // E-step
-        cv::Mat lGamma(lMaskPixels, mClusterCount, CV_32F);
+        auto lPassTime = chrono::high_resolution_clock::now();
+        emStatistics lStats = getStatistics(lClusters, mIsVectorized);
+        lEMDuration += chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - lPassTime).count() / 1e6f;
+        float lLikelihoodNew = (float)(lStats.likelihood / lMaskPixels);
 
-        for (int t = 0; t < __THREAD_COUNT__; ++t)
-        {
-            threads[t] = new thread([&, t] ()
-            {
-                for(int index=t; index<lMaskPixels; index+=__THREAD_COUNT__)
-                {
-                    float lSum = numeric_limits<float>::min();
-
-                    for(int i=0; i<mClusterCount; i++)
-                    {
-                        lSum += lWeight.at<float>(i)*getGaussian2DValueAt(lKMeanSource.at<float>(index, 0), lKMeanSource.at<float>(index, 1),
-                                                                            lMu.at<float>(i, 0), lMu.at<float>(i, 1),
-                                                                            lSigma.at<float>(i, 0), lSigma.at<float>(i, 1));
-                    }
-
-                    for(int i=0; i<mClusterCount; i++)
-                    {
-                        lGamma.at<float>(index, i) = 1.f/lSum * lWeight.at<float>(i)*getGaussian2DValueAt(lKMeanSource.at<float>(index, 0), lKMeanSource.at<float>(index, 1),
-                                                                            lMu.at<float>(i, 0), lMu.at<float>(i, 1),
-                                                                            lSigma.at<float>(i, 0), lSigma.at<float>(i, 1));
-                    }
-                }
-            } );
-        }
-        for (int t = 0; t < __THREAD_COUNT__; ++t)
-        {
-            threads[t]->join();
-            delete threads[t];
-        }
+        // Vérification de la convergence des paramètres actuels
+        if(lCounter > 0 && abs(lLikelihood - lLikelihoodNew) < mEMLikelihood)
+            break;
+        lLikelihood = lLikelihoodNew;
+
+        if(lCounter == mMaxEMLoop)
+            break;
+        lCounter++;
 
-        cv::Mat lN(mClusterCount, 1, CV_32F);
+        // M-step : les sommes sont centrées sur l'ancien mu, ce qui limite
+        // les pertes de précision dans le calcul de sigma
         for(int i=0; i<mClusterCount; i++)
         {
-            lN.at<float>(i) = 0.f;
-            for(int index=0; index<lMaskPixels; index++)
-            {
-                lN.at<float>(i) += lGamma.at<float>(index, i);
-            }
-        }
-
-        // M-step
-        cv::Mat lWeightNew(mClusterCount, 1, CV_32F);
-        cv::Mat lMuNew(mClusterCount, 2, CV_32F);
-        cv::Mat lSigmaNew(mClusterCount, 2, CV_32F);
+            const double* lSums = &lStats.sums[i*__GMM_SUMS__];
+            lWeight.at<float>(i) = (float)(lSums[0]/lMaskPixels);
 
-        for (int t = 0; t < __THREAD_COUNT__; ++t)
-        {
-            threads[t] = new thread([&, t] ()
+            if(lSums[0] == 0.0)
             {
-                for(int i=t; i<mClusterCount; i+=__THREAD_COUNT__)
-                {
-                    lWeightNew.at<float>(i) = lN.at<float>(i)/(float)lMaskPixels;
-                    lMuNew.at<float>(i, 0) = 0.f;
-                    lMuNew.at<float>(i, 1) = 0.f;
-
-                    for(int index=0; index<lMaskPixels; index++)
-                    {
-                        lMuNew.at<float>(i, 0) += lGamma.at<float>(index, i)*lKMeanSource.at<float>(index, 0);
-                        lMuNew.at<float>(i, 1) += lGamma.at<float>(index, i)*lKMeanSource.at<float>(index, 1);
-                    }
-                    if(lN.at<float>(i) == 0)
-                    {
-                        lMuNew.at<float>(i, 0) = 0.f;
-                        lMuNew.at<float>(i, 1) = 0.f;
-                    }
-                    else
-                    {
-                        lMuNew.at<float>(i, 0) /= lN.at<float>(i);
-                        lMuNew.at<float>(i, 1) /= lN.at<float>(i);
-                    }
-                }
-            } );
-        }
-        for (int t = 0; t < __THREAD_COUNT__; ++t)
-        {
-            threads[t]->join();
-            delete threads[t];
-        }
+                lMu.at<float>(i, 0) = 0.f;
+                lMu.at<float>(i, 1) = 0.f;
+                lSigma.at<float>(i, 0) = 0.f;
+                lSigma.at<float>(i, 1) = 0.f;
+                continue;
+            }
 
-        for (int t = 0; t < __THREAD_COUNT__; ++t)
-        {
-            threads[t] = new thread([&, t] ()
+            for(int d=0; d<2; d++)
             {
-                for(int i=0; i<mClusterCount; i++)
-                {
-                    lSigmaNew.at<float>(i, 0) = 0.f;
-                    lSigmaNew.at<float>(i, 1) = 0.f;
-
-                    for(int index=0; index<lMaskPixels; index++)
-                    {
-                        lSigmaNew.at<float>(i, 0) += lGamma.at<float>(index, i)*(lKMeanSource.at<float>(index, 0)-lMuNew.at<float>(i, 0))*(lKMeanSource.at<float>(index, 0)-lMuNew.at<float>(i, 0));
-                        lSigmaNew.at<float>(i, 1) += lGamma.at<float>(index, i)*(lKMeanSource.at<float>(index, 1)-lMuNew.at<float>(i, 1))*(lKMeanSource.at<float>(index, 1)-lMuNew.at<float>(i, 1));
-                    }
-                    if(lN.at<float>(i) == 0)
-                    {
-                        lSigmaNew.at<float>(i, 0) = 0.f;
-                        lSigmaNew.at<float>(i, 1) = 0.f;
-                    }
-                    else
-                    {
-                        lSigmaNew.at<float>(i, 0) /= lN.at<float>(i);
-                        lSigmaNew.at<float>(i, 1) /= lN.at<float>(i);
-                    }
-                }
-            } );
-        }
-        for (int t = 0; t < __THREAD_COUNT__; ++t)
-        {
-            threads[t]->join();
-            delete threads[t];
+                double lShift = lSums[1+d]/lSums[0];
+                lMu.at<float>(i, d) += (float)lShift;
+                lSigma.at<float>(i, d) = (float)max(0.0, lSums[3+d]/lSums[0] - lShift*lShift);
+            }
         }
+    }
 
-        // Vérification de la convergence
-        float lLikelihoodNew = getLikelihood(lKMeanSource, lMuNew, lSigmaNew, lWeightNew);
-
-        lMu = lMuNew;
-        lSigma = lSigmaNew;
-        lWeight = lWeightNew;
+    // La dernière passe, qui vérifie la convergence, est comptée
+    mThroughput = lEMDuration > 0.f ? (float)(lCounter+1)*lSampleCount/lEMDuration : 0.f;
 
-        if(abs(lLikelihood - lLikelihoodNew) < mEMLikelihood)
+#ifdef __DEBUG_GMM__
+    // Comparaison des noyaux scalaire et SSE, sur les paramètres finaux
+    {
+        getClusterConstants(lMu, lSigma, lWeight, lClusters);
+        double lLikelihoods[2];
+        float lRates[2];
+        for(int v=0; v<2; v++)
         {
-            lContinue = false;
+            auto lBenchTime = chrono::high_resolution_clock::now();
+            for(int p=0; p<__GMM_BENCH_PASSES__; p++)
+                lLikelihoods[v] = getStatistics(lClusters, v == 1).likelihood;
+            float lSeconds = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - lBenchTime).count() / 1e6f;
+            lRates[v] = lSeconds > 0.f ? __GMM_BENCH_PASSES__*lSampleCount/lSeconds : 0.f;
         }
 
-        lLikelihood = lLikelihoodNew;
+        cerr << "EM kernels: " << lSampleCount << " samples, scalar " << lRates[0] << " samples/s, vectorized "
+             << lRates[1] << " samples/s, likelihood difference " << (lLikelihoods[1] - lLikelihoods[0])/lMaskPixels << endl;
     }
+#endif
 
     // Stockage de la GMM
     if(mGmm.size() < (size_t)mClusterCount)
@@ -335,6 +442,33 @@ void gmm::calcGmm(cv::Mat &pMask)
     }
 
     mIsGmm = true;
+
+    auto lTableTime = chrono::high_resolution_clock::now();
+    buildCostTable();
+    mTableDuration = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - lTableTime).count() / 1000.f;
+
+#ifdef __DEBUG_GMM__
+    // Comparaison avec l'ajustement sur les pixels : vraisemblance moyenne
+    // des pixels du masque selon chacune des deux mixtures
+    if(mIsHistogramFit)
+    {
+        auto lHistogramTime = chrono::high_resolution_clock::now();
+        std::vector<gaussian2D> lHistogramGmm = mGmm;
+
+        mIsHistogramFit = false;
+        calcGmm(pMask);
+        mIsHistogramFit = true;
+        auto lPixelTime = chrono::high_resolution_clock::now();
+
+        cerr << "Histogram fit: likelihood " << getMixtureLikelihood(pMask, lHistogramGmm) << " in "
+             << chrono::duration_cast<chrono::microseconds>(lHistogramTime - lStartTime).count() / 1000.f << " ms, against "
+             << getMixtureLikelihood(pMask, mGmm) << " in "
+             << chrono::duration_cast<chrono::microseconds>(lPixelTime - lHistogramTime).count() / 1000.f << " ms for the pixel fit" << endl;
+
+        mGmm = lHistogramGmm;
+        buildCostTable();
+    }
+#endif
 }
 
 /***********************/
@@ -391,69 +525,414 @@ cv::Mat gmm::getProbs(cv::Mat &pMask)
 cv::Mat gmm::getCosts(cv::Mat &pMask)
 {
     cv::Mat lCosts;
-    cv::Mat lProbs = getProbs(pMask);
 
-    if(lProbs.rows == 0 || lProbs.cols == 0)
+    if(pMask.rows != mColorImg.rows || pMask.cols != mColorImg.cols)
         return lCosts;
 
-    lCosts = cv::Mat::zeros(lProbs.rows, lProbs.cols, CV_16UC1);
+    if(pMask.type() != CV_8UC1)
+        return lCosts;
 
-    cv::MatConstIterator_<float> lProbsIt = lProbs.begin<float>();
-    cv::MatIterator_<short int> lCostsIt = lCosts.begin<short int>();
+    if(!mIsGmm)
+        return lCosts;
+
+    auto lStartTime = chrono::high_resolution_clock::now();
 
-    for(; lProbsIt<lProbs.end<float>(); lProbsIt++, lCostsIt++)
+    // Le coût de chaque pixel est lu dans la table, selon sa teinte et sa saturation
+    lCosts = cv::Mat::zeros(mColorImg.rows, mColorImg.cols, CV_16UC1);
+    threadPool::getInstance().parallelFor(0, mColorImg.rows, __GMM_ROW_GRAIN__, [&] (int pFirst, int pLast)
     {
-        if(*lProbsIt == 0.f)
-            continue;
+        for(int y=pFirst; y<pLast; y++)
+        {
+            const cv::Vec3b* lImgRow = mColorImg.ptr<cv::Vec3b>(y);
+            const uchar* lMaskRow = pMask.ptr<uchar>(y);
+            ushort* lCostsRow = lCosts.ptr<ushort>(y);
+
+            for(int x=0; x<mColorImg.cols; x++)
+            {
+                if(lMaskRow[x] == 0)
+                    continue;
+
+                lCostsRow[x] = mCostTable[min((int)lImgRow[x][0], __GMM_HUE_BINS__-1)*256 + lImgRow[x][1]];
+            }
+        }
+    } );
+
+    mCostsDuration = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - lStartTime).count() / 1000.f;
 
-        *lCostsIt = (short int)abs(mMaxCost*(-log10f(*lProbsIt)));
+#ifdef __DEBUG_GMM__
+    // Comparaison avec le calcul direct, pixel par pixel
+    auto lDirectTime = chrono::high_resolution_clock::now();
+    cv::Mat lProbs = getProbs(pMask);
+    int lDifferences = 0;
+    for(int y=0; y<lProbs.rows; y++)
+    {
+        for(int x=0; x<lProbs.cols; x++)
+        {
+            float lProba = lProbs.at<float>(y, x);
+            ushort lCost = (lProba == 0.f) ? 0 : (short int)abs(mMaxCost*(-log10f(lProba)));
+            if(lCost != lCosts.at<ushort>(y, x))
+                lDifferences++;
+        }
     }
+    float lDirectDuration = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - lDirectTime).count() / 1000.f;
+
+    cerr << "Cost table: " << lDifferences << " different costs, " << mCostsDuration << " ms against "
+         << lDirectDuration << " ms for the direct computation (table built in " << mTableDuration << " ms)" << endl;
+#endif
 
     return lCosts;
 }
 
 /***********************/
-float gmm::getLikelihood(cv::Mat &pData, cv::Mat &pMu, cv::Mat &pSigma, cv::Mat &pWeight)
+void gmm::getDurations(float &pTable, float &pCosts)
 {
-    atomic<float> lLikelihood;
-    lLikelihood = 0.f;
+    pTable = mTableDuration;
+    pCosts = mCostsDuration;
+}
 
-    std::thread* threads[__THREAD_COUNT__];
-    for (int t = 0; t < __THREAD_COUNT__; ++t)
+/***********************/
+float gmm::getThroughput()
+{
+    return mThroughput;
+}
+
+/***********************/
+void gmm::buildCostTable()
+{
+    // Mêmes valeurs que getProbs() puis le log, pour chaque couple teinte / saturation
+    mCostTable.resize(__GMM_HUE_BINS__*256);
+
+    threadPool::getInstance().parallelFor(0, __GMM_HUE_BINS__, __GMM_ROW_GRAIN__, [&] (int pFirst, int pLast)
     {
-        threads[t] = new thread([&, t] ()
+        for(int h=pFirst; h<pLast; h++)
         {
-            for(int index=t; index<pData.size[0]; index+=__THREAD_COUNT__)
+            for(int s=0; s<256; s++)
             {
-                float lLocalHood = 0.f;
-
+                float lProba = 0.f;
                 for(int i=0; i<mClusterCount; i++)
                 {
-                    lLocalHood += pWeight.at<float>(i)*getGaussian2DValueAt(pData.at<float>(index, 0), pData.at<float>(index, 1),
-                                                                            pMu.at<float>(i, 0), pMu.at<float>(i, 1),
-                                                                            pSigma.at<float>(i, 0), pSigma.at<float>(i, 1));
+                    lProba += mGmm[i].weight*getGaussian2DValueAt(h*2.f, s/2.55f, mGmm[i].mu[0], mGmm[i].mu[1], mGmm[i].sigma[0], mGmm[i].sigma[1]);
                 }
 
-                if(lLocalHood == 0.f)
+                lProba = max(lProba, numeric_limits<float>::min());
+
+                mCostTable[h*256 + s] = (short int)abs(mMaxCost*(-log10f(lProba)));
+            }
+        }
+    } );
+}
+
+/***********************/
+gmm::emStatistics gmm::getStatistics(const std::vector<clusterConstants> &pClusters, bool pVectorized)
+{
+    // Sommes par tranches, additionnées dans un ordre fixe
+    return threadPool::getInstance().reduce<emStatistics>(0, (int)mSampleHues.size(), emStatistics(), [&] (int pFirst, int pLast)
+    {
+        emStatistics lStats;
+        lStats.sums.assign(mClusterCount*__GMM_SUMS__, 0.0);
+
+        int index = pFirst;
+#ifdef __SSE2__
+        if(pVectorized)
+            index = accumulateSSE(pClusters, pFirst, pLast, lStats);
+#endif
+        // Fin de tranche, ou tranche entière sans SSE
+        accumulateScalar(pClusters, index, pLast, lStats);
+
+        return lStats;
+    } );
+}
+
+/***********************/
+void gmm::accumulateScalar(const std::vector<clusterConstants> &pClusters, int pFirst, int pLast, emStatistics &pStats)
+{
+    const float lMin = numeric_limits<float>::min();
+    std::vector<float> lValues(mClusterCount);
+
+    for(int index=pFirst; index<pLast; index++)
+    {
+        float lX = mSampleHues[index];
+        float lY = mSampleSats[index];
+        float lSampleWeight = mSampleWeights[index];
+
+        float lSum = 0.f;
+        for(int i=0; i<mClusterCount; i++)
+        {
+            const clusterConstants &lCluster = pClusters[i];
+            float lDX = lX - lCluster.mu[0];
+            float lDY = lY - lCluster.mu[1];
+            lValues[i] = lCluster.norm*expf(lCluster.scale[0]*lDX*lDX + lCluster.scale[1]*lDY*lDY);
+            lSum += lValues[i];
+        }
+
+        pStats.likelihood += lSampleWeight*log10f(max(lSum, lMin));
+
+        // Responsabilités de chaque cluster, pondérées par l'échantillon
+        float lInverse = 1.f/(lSum + lMin);
+        for(int i=0; i<mClusterCount; i++)
+        {
+            double lGamma = lSampleWeight*(lValues[i]*lInverse);
+            double lDX = lX - pClusters[i].mu[0];
+            double lDY = lY - pClusters[i].mu[1];
+
+            double* lSums = &pStats.sums[i*__GMM_SUMS__];
+            lSums[0] += lGamma;
+            lSums[1] += lGamma*lDX;
+            lSums[2] += lGamma*lDY;
+            lSums[3] += lGamma*lDX*lDX;
+            lSums[4] += lGamma*lDY*lDY;
+        }
+    }
+}
+
+#ifdef __SSE2__
+/***********************/
+int gmm::accumulateSSE(const std::vector<clusterConstants> &pClusters, int pFirst, int pLast, emStatistics &pStats)
+{
+    const __m128 lMin = _mm_set1_ps(numeric_limits<float>::min());
+    // Densités et sommes de chaque cluster, 4 échantillons à la fois
+    std::vector<float> lValues(mClusterCount*4);
+    std::vector<float> lSums(mClusterCount*__GMM_SUMS__*4);
+
+    int index = pFirst;
+    while(index+4 <= pLast)
+    {
+        // Les sommes d'un bloc restent en simple précision
+        int lBlockEnd = min(pLast, index + __GMM_SIMD_BLOCK__);
+        std::fill(lSums.begin(), lSums.end(), 0.f);
+        __m128 lLikelihood = _mm_setzero_ps();
+
+        for(; index+4<=lBlockEnd; index+=4)
+        {
+            __m128 lX = _mm_loadu_ps(&mSampleHues[index]);
+            __m128 lY = _mm_loadu_ps(&mSampleSats[index]);
+            __m128 lSampleWeight = _mm_loadu_ps(&mSampleWeights[index]);
+
+            // Densités
+            __m128 lSum = _mm_setzero_ps();
+            for(int i=0; i<mClusterCount; i++)
+            {
+                const clusterConstants &lCluster = pClusters[i];
+                __m128 lDX = _mm_sub_ps(lX, _mm_set1_ps(lCluster.mu[0]));
+                __m128 lDY = _mm_sub_ps(lY, _mm_set1_ps(lCluster.mu[1]));
+                __m128 lExponent = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(lCluster.scale[0]), _mm_mul_ps(lDX, lDX)),
+                                              _mm_mul_ps(_mm_set1_ps(lCluster.scale[1]), _mm_mul_ps(lDY, lDY)));
+                __m128 lValue = _mm_mul_ps(_mm_set1_ps(lCluster.norm), expSSE(lExponent));
+                _mm_storeu_ps(&lValues[i*4], lValue);
+                lSum = _mm_add_ps(lSum, lValue);
+            }
+
+            // Log-vraisemblance
+            lLikelihood = _mm_add_ps(lLikelihood, _mm_mul_ps(lSampleWeight, log10SSE(_mm_max_ps(lSum, lMin))));
+
+            // Responsabilités, et sommes du M-step
+            __m128 lInverse = _mm_div_ps(_mm_set1_ps(1.f), _mm_add_ps(lSum, lMin));
+            for(int i=0; i<mClusterCount; i++)
+            {
+                const clusterConstants &lCluster = pClusters[i];
+                __m128 lGamma = _mm_mul_ps(lSampleWeight, _mm_mul_ps(_mm_loadu_ps(&lValues[i*4]), lInverse));
+                __m128 lDX = _mm_sub_ps(lX, _mm_set1_ps(lCluster.mu[0]));
+                __m128 lDY = _mm_sub_ps(lY, _mm_set1_ps(lCluster.mu[1]));
+                __m128 lGammaX = _mm_mul_ps(lGamma, lDX);
+                __m128 lGammaY = _mm_mul_ps(lGamma, lDY);
+
+                float* lClusterSums = &lSums[i*__GMM_SUMS__*4];
+                _mm_storeu_ps(lClusterSums, _mm_add_ps(_mm_loadu_ps(lClusterSums), lGamma));
+                _mm_storeu_ps(lClusterSums+4, _mm_add_ps(_mm_loadu_ps(lClusterSums+4), lGammaX));
+                _mm_storeu_ps(lClusterSums+8, _mm_add_ps(_mm_loadu_ps(lClusterSums+8), lGammaY));
+                _mm_storeu_ps(lClusterSums+12, _mm_add_ps(_mm_loadu_ps(lClusterSums+12), _mm_mul_ps(lGammaX, lDX)));
+                _mm_storeu_ps(lClusterSums+16, _mm_add_ps(_mm_loadu_ps(lClusterSums+16), _mm_mul_ps(lGammaY, lDY)));
+            }
+        }
+
+        // Report du bloc en double précision
+        for(size_t a=0; a<pStats.sums.size(); a++)
+            pStats.sums[a] += sumSSE(_mm_loadu_ps(&lSums[a*4]));
+        pStats.likelihood += sumSSE(lLikelihood);
+    }
+
+    return index;
+}
+#endif
+
+/***********************/
+void gmm::getClusterConstants(cv::Mat &pMu, cv::Mat &pSigma, cv::Mat &pWeight, std::vector<clusterConstants> &pClusters)
+{
+    // Mêmes valeurs que getGaussian2DValueAt(), multipliée par le poids du cluster
+    pClusters.resize(mClusterCount);
+    for(int i=0; i<mClusterCount; i++)
+    {
+        clusterConstants &lCluster = pClusters[i];
+        float lSigmaX = pSigma.at<float>(i, 0);
+        float lSigmaY = pSigma.at<float>(i, 1);
+
+        lCluster.mu[0] = pMu.at<float>(i, 0);
+        lCluster.mu[1] = pMu.at<float>(i, 1);
+
+        // Gaussienne dégénérée : densité constante
+        if(lSigmaX == 0 || lSigmaY == 0)
+        {
+            lCluster.scale[0] = 0.f;
+            lCluster.scale[1] = 0.f;
+            lCluster.norm = pWeight.at<float>(i)*numeric_limits<float>::min();
+            continue;
+        }
+
+        lCluster.scale[0] = -1.f/(2*lSigmaX);
+        lCluster.scale[1] = -1.f/(2*lSigmaY);
+        lCluster.norm = pWeight.at<float>(i)*(1.f/(sqrtf(lSigmaX*lSigmaY)*2.f*M_PI));
+    }
+}
+
+/***********************/
+void gmm::weightedKMeans(cv::Mat &pSamples, cv::Mat &pSampleWeights, cv::TermCriteria pCriteria, int pAttempts, cv::Mat &pLabels, cv::Mat &pCenters)
+{
+    // Même principe que cv::kmeans avec KMEANS_PP_CENTERS, chaque échantillon
+    // comptant pour son poids, dans le choix des centres comme dans leur calcul
+    int lCount = pSamples.rows;
+    cv::RNG &lRng = cv::theRNG();
+
+    std::vector<float> lDistances(lCount);
+    cv::Mat lLabels(lCount, 1, CV_32S);
+    cv::Mat lCenters(mClusterCount, 2, CV_32F);
+    double lBestCompactness = numeric_limits<double>::max();
+
+    for(int a=0; a<pAttempts; a++)
+    {
+        // Initialisation kmeans++ : le premier centre est tiré selon les poids,
+        // les suivants selon le poids et le carré de la distance au centre le plus proche
+        for(int k=0; k<mClusterCount; k++)
+        {
+            double lTotal = 0.0;
+            for(int index=0; index<lCount; index++)
+                lTotal += pSampleWeights.at<float>(index) * (k == 0 ? 1.f : lDistances[index]);
+
+            // Si tous les échantillons sont déjà des centres, le premier est repris
+            double lThreshold = lRng.uniform(0.0, lTotal);
+            double lCumul = 0.0;
+            int lChosen = 0;
+            for(int index=0; index<lCount; index++)
+            {
+                lCumul += pSampleWeights.at<float>(index) * (k == 0 ? 1.f : lDistances[index]);
+                if(lCumul > lThreshold)
                 {
-                    lLocalHood = numeric_limits<float>::min();
+                    lChosen = index;
+                    break;
                 }
+            }
 
-                lLocalHood = log10f(lLocalHood);
-                lLikelihood = lLikelihood + lLocalHood;
+            lCenters.at<float>(k, 0) = pSamples.at<float>(lChosen, 0);
+            lCenters.at<float>(k, 1) = pSamples.at<float>(lChosen, 1);
+
+            for(int index=0; index<lCount; index++)
+            {
+                float lDX = pSamples.at<float>(index, 0) - lCenters.at<float>(k, 0);
+                float lDY = pSamples.at<float>(index, 1) - lCenters.at<float>(k, 1);
+                float lDistance = lDX*lDX + lDY*lDY;
+                if(k == 0 || lDistance < lDistances[index])
+                    lDistances[index] = lDistance;
             }
-        } );
+        }
+
+        // Itérations de Lloyd, avec des moyennes pondérées
+        for(int it=0; it<pCriteria.maxCount; it++)
+        {
+            assignSamples(pSamples, pSampleWeights, lCenters, lLabels);
+
+            std::vector<double> lSums(mClusterCount*3, 0.0);
+            for(int index=0; index<lCount; index++)
+            {
+                int lLabel = lLabels.at<int>(index);
+                float lSampleWeight = pSampleWeights.at<float>(index);
+                lSums[lLabel*3+0] += lSampleWeight*pSamples.at<float>(index, 0);
+                lSums[lLabel*3+1] += lSampleWeight*pSamples.at<float>(index, 1);
+                lSums[lLabel*3+2] += lSampleWeight;
+            }
+
+            // Un centre sans échantillon reste en place
+            float lMaxShift = 0.f;
+            for(int k=0; k<mClusterCount; k++)
+            {
+                if(lSums[k*3+2] == 0.0)
+                    continue;
+
+                float lX = (float)(lSums[k*3+0]/lSums[k*3+2]);
+                float lY = (float)(lSums[k*3+1]/lSums[k*3+2]);
+                float lDX = lX - lCenters.at<float>(k, 0);
+                float lDY = lY - lCenters.at<float>(k, 1);
+                lMaxShift = max(lMaxShift, lDX*lDX + lDY*lDY);
+                lCenters.at<float>(k, 0) = lX;
+                lCenters.at<float>(k, 1) = lY;
+            }
+
+            if(lMaxShift < pCriteria.epsilon*pCriteria.epsilon)
+                break;
+        }
+
+        double lCompactness = assignSamples(pSamples, pSampleWeights, lCenters, lLabels);
+        if(lCompactness < lBestCompactness)
+        {
+            lBestCompactness = lCompactness;
+            lLabels.copyTo(pLabels);
+            lCenters.copyTo(pCenters);
+        }
     }
-    for (int t = 0; t < __THREAD_COUNT__; ++t)
+}
+
+/***********************/
+double gmm::assignSamples(cv::Mat &pSamples, cv::Mat &pSampleWeights, cv::Mat &pCenters, cv::Mat &pLabels)
+{
+    double lCompactness = 0.0;
+    for(int index=0; index<pSamples.rows; index++)
     {
-        threads[t]->join();
-        delete threads[t];
+        float lBest = numeric_limits<float>::max();
+        int lLabel = 0;
+        for(int k=0; k<mClusterCount; k++)
+        {
+            float lDX = pSamples.at<float>(index, 0) - pCenters.at<float>(k, 0);
+            float lDY = pSamples.at<float>(index, 1) - pCenters.at<float>(k, 1);
+            float lDistance = lDX*lDX + lDY*lDY;
+            if(lDistance < lBest)
+            {
+                lBest = lDistance;
+                lLabel = k;
+            }
+        }
+
+        pLabels.at<int>(index) = lLabel;
+        lCompactness += pSampleWeights.at<float>(index)*lBest;
     }
 
-    lLikelihood = lLikelihood / pData.size[0];
+    return lCompactness;
+}
+
+#ifdef __DEBUG_GMM__
+/***********************/
+float gmm::getMixtureLikelihood(cv::Mat &pMask, std::vector<gaussian2D> &pMixture)
+{
+    double lLikelihood = 0.0;
+    int lCount = 0;
+    for(int y=0; y<mColorImg.rows; y++)
+    {
+        const cv::Vec3b* lImgRow = mColorImg.ptr<cv::Vec3b>(y);
+        const uchar* lMaskRow = pMask.ptr<uchar>(y);
+        for(int x=0; x<mColorImg.cols; x++)
+        {
+            if(lMaskRow[x] == 0)
+                continue;
+
+            float lProba = 0.f;
+            for(int i=0; i<mClusterCount; i++)
+                lProba += pMixture[i].weight*getGaussian2DValueAt(lImgRow[x][0]*2.f, lImgRow[x][1]/2.55f, pMixture[i].mu[0], pMixture[i].mu[1], pMixture[i].sigma[0], pMixture[i].sigma[1]);
+
+            lLikelihood += log10f(max(lProba, numeric_limits<float>::min()));
+            lCount++;
+        }
+    }
 
-    return lLikelihood;
+    return lCount > 0 ? (float)(lLikelihood/lCount) : 0.f;
 }
+#endif
 
 /***********************/
 float gmm::getGaussian2DValueAt(float pX, float pY, float pMuX, float pMuY, float pSigmaX, float pSigmaY)
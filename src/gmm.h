@@ -1,5 +1,7 @@
 /* Classe créant, à partir d'une image et d'un masque, une mixture de gaussienne
  * modélisant les zones non masquées. Celles-ci sont créées dans l'espace HSV
+ * (teinte et saturation), à partir de l'histogramme de ces deux composantes
+ * ou, au choix, directement à partir des pixels.
  * Le masque est une matrice en CV_16U, les images doivent être fournies en CV_8UC3
  * et de préférence en RGB.
  * Elle peut en outre retourner une matrice des probabilités selon un masque donné.
@@ -29,6 +31,11 @@ public:
     void setEMMinLikelihood(float pLikelihood);
     void setMaxEMLoop(unsigned int pLoop);
     void setMaxCost(int pCost);
+    // Ajustement sur l'histogramme teinte / saturation du masque (par défaut),
+    // ou sur chacun de ses pixels
+    void setHistogramFit(bool pHistogram);
+    // Passes de l'EM avec les noyaux SSE (par défaut), ou en scalaire
+    void setVectorized(bool pVectorized);
 
     // Spécifie l'image RGB sur laquelle on travaille
     void setRgbImg(cv::Mat &pImg);
@@ -46,6 +53,13 @@ public:
     // selon le modèle créé avec calcGmm()
     cv::Mat getCosts(cv::Mat &pMask);
 
+    // Durées (en ms) de la construction de la table des coûts lors du
+    // dernier calcGmm(), et du dernier getCosts()
+    void getDurations(float &pTable, float &pCosts);
+
+    // Débit (échantillons par seconde) des passes de l'EM lors du dernier calcGmm()
+    float getThroughput();
+
 private:
     /************/
     // Attribute
@@ -60,12 +74,72 @@ private:
     unsigned int mMaxEMLoop;
 
     int mMaxCost;
+    bool mIsHistogramFit;
+    bool mIsVectorized;
+
+    // Echantillons de l'EM en structure de tableaux (teinte, saturation, poids),
+    // conservés d'un calcGmm() à l'autre
+    std::vector<float> mSampleHues;
+    std::vector<float> mSampleSats;
+    std::vector<float> mSampleWeights;
+    float mThroughput;
+
+    // Coût de chaque couple teinte / saturation selon le modèle actuel,
+    // calculé une fois pour toutes après calcGmm()
+    std::vector<unsigned short> mCostTable;
+    float mTableDuration;
+    float mCostsDuration;
+
+    // Sommes accumulées lors d'une passe de l'EM, additionnables par tranches
+    struct emStatistics
+    {
+        std::vector<double> sums;
+        double likelihood;
+
+        emStatistics() : likelihood(0.0) {}
+        emStatistics& operator+=(const emStatistics &pOther)
+        {
+            if(sums.size() < pOther.sums.size())
+                sums.resize(pOther.sums.size(), 0.0);
+            for(size_t i=0; i<pOther.sums.size(); i++)
+                sums[i] += pOther.sums[i];
+            likelihood += pOther.likelihood;
+            return *this;
+        }
+    };
+
+    // Constantes d'un cluster, calculées une fois par passe de l'EM : sa
+    // densité pondérée vaut norm*exp(scale[0]*dH² + scale[1]*dS²)
+    struct clusterConstants
+    {
+        float mu[2];
+        float scale[2]; // -1/(2 sigma)
+        float norm; // poids/(2 pi sqrt(sigmaH sigmaS))
+    };
 
     /***********/
     // Méthodes
     /***********/
-    float getLikelihood(cv::Mat &pData, cv::Mat &pMu, cv::Mat &pSigma, cv::Mat &pWeight);
+    // Une passe de l'EM sur mSampleHues / mSampleSats, pondérés par mSampleWeights :
+    // somme pondérée des log-vraisemblances, et sommes du M-step
+    emStatistics getStatistics(const std::vector<clusterConstants> &pClusters, bool pVectorized);
+    void accumulateScalar(const std::vector<clusterConstants> &pClusters, int pFirst, int pLast, emStatistics &pStats);
+#ifdef __SSE2__
+    // Echantillons 4 par 4, renvoie l'indice du premier non traité
+    int accumulateSSE(const std::vector<clusterConstants> &pClusters, int pFirst, int pLast, emStatistics &pStats);
+#endif
+    void getClusterConstants(cv::Mat &pMu, cv::Mat &pSigma, cv::Mat &pWeight, std::vector<clusterConstants> &pClusters);
+    // kmeans avec initialisation kmeans++, pour des échantillons pondérés
+    void weightedKMeans(cv::Mat &pSamples, cv::Mat &pSampleWeights, cv::TermCriteria pCriteria, int pAttempts, cv::Mat &pLabels, cv::Mat &pCenters);
+    // Affectation de chaque échantillon au centre le plus proche, renvoie la
+    // somme pondérée des carrés des distances
+    double assignSamples(cv::Mat &pSamples, cv::Mat &pSampleWeights, cv::Mat &pCenters, cv::Mat &pLabels);
+#ifdef __DEBUG_GMM__
+    // Vraisemblance moyenne des pixels du masque selon pMixture
+    float getMixtureLikelihood(cv::Mat &pMask, std::vector<gaussian2D> &pMixture);
+#endif
     float getGaussian2DValueAt(float pX, float pY, float pMuX, float pMuY, float pSigmaX, float pSigmaY);
+    void buildCostTable();
 };
 
 #endif // GMM_H
@@ -0,0 +1,1194 @@
+#include "graphcut.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "threadpool.h"
+
+using namespace std;
+
+/***********************/
+graphCut::graphCut()
+    :mWidth(0),
+      mHeight(0),
+      mNodeCount(0),
+      mThreadCount(1),
+      mIsSparse(false),
+      mIsGeneral(false),
+      mArcCount(0),
+      mIsDynamic(false),
+      mIsReusable(false),
+      mAllocations(0),
+      mTimeBudget(0.f),
+      mIsConverged(true),
+      mResidual(0),
+      mAugmentations(0),
+      mOrphans(0)
+{
+}
+
+/***********************/
+graphCut::~graphCut()
+{
+}
+
+/***********************/
+void graphCut::setGrid(int pWidth, int pHeight)
+{
+    if(pWidth <= 0 || pHeight <= 0)
+        return;
+
+    // Le flot précédent n'a plus de sens si la grille change
+    if(pWidth != mWidth || pHeight != mHeight || mIsSparse || mIsGeneral)
+        reset();
+
+    mWidth = pWidth;
+    mHeight = pHeight;
+    mNodeCount = pWidth*pHeight;
+    mArcCount = mNodeCount*4;
+    mIsSparse = false;
+    mIsGeneral = false;
+
+    resizeNodes();
+}
+
+/***********************/
+void graphCut::setGrid(int pWidth, int pHeight, const unsigned char* pMask, int pStep)
+{
+    if(pWidth <= 0 || pHeight <= 0)
+        return;
+
+    bool lChanged = (pWidth != mWidth || pHeight != mHeight || !mIsSparse || mIsGeneral);
+
+    mWidth = pWidth;
+    mHeight = pHeight;
+    mIsSparse = true;
+    mIsGeneral = false;
+
+    // Numérotation des noeuds dans l'ordre des lignes, ce qui permet
+    // toujours un découpage en bandes pour la résolution parallèle
+    mNodeMap.resize(mWidth*mHeight);
+    int lNode = 0;
+    for(int y=0; y<mHeight; y++)
+    {
+        for(int x=0; x<mWidth; x++)
+        {
+            int lIndex = pMask[y*pStep + x] ? lNode++ : -1;
+            if(mNodeMap[y*mWidth + x] != lIndex)
+            {
+                mNodeMap[y*mWidth + x] = lIndex;
+                lChanged = true;
+            }
+        }
+    }
+
+    // Le flot précédent n'est réutilisable que si les noeuds sont les mêmes
+    if(lChanged)
+        reset();
+
+    mNodeCount = lNode;
+    mArcCount = mNodeCount*4;
+    resizeNodes();
+
+    mNeighbours.resize(mNodeCount*4);
+    for(int y=0; y<mHeight; y++)
+    {
+        for(int x=0; x<mWidth; x++)
+        {
+            int lIndex = mNodeMap[y*mWidth + x];
+            if(lIndex < 0)
+                continue;
+
+            mNeighbours[lIndex*4+0] = (x < mWidth-1) ? mNodeMap[y*mWidth + x+1] : -1;
+            mNeighbours[lIndex*4+1] = (x > 0) ? mNodeMap[y*mWidth + x-1] : -1;
+            mNeighbours[lIndex*4+2] = (y < mHeight-1) ? mNodeMap[(y+1)*mWidth + x] : -1;
+            mNeighbours[lIndex*4+3] = (y > 0) ? mNodeMap[(y-1)*mWidth + x] : -1;
+        }
+    }
+}
+
+/***********************/
+void graphCut::setGraph(int pNodeCount, const vector<pair<int, int> > &pEdges)
+{
+    // La structure change à chaque appel, le flot précédent est oublié
+    reset();
+
+    mWidth = 0;
+    mHeight = 0;
+    mIsSparse = false;
+    mIsGeneral = true;
+
+    mNodeCount = max(0, pNodeCount);
+    mArcCount = pEdges.size()*2;
+    resizeNodes();
+
+    // Les arcs sortant de chaque noeud sont consécutifs (format CSR)
+    mFirstArc.assign(mNodeCount+1, 0);
+    for(size_t e=0; e<pEdges.size(); e++)
+    {
+        mFirstArc[pEdges[e].first+1]++;
+        mFirstArc[pEdges[e].second+1]++;
+    }
+    for(int i=0; i<mNodeCount; i++)
+        mFirstArc[i+1] += mFirstArc[i];
+
+    // mDist sert ici de curseur d'écriture pour chaque noeud
+    for(int i=0; i<mNodeCount; i++)
+        mDist[i] = mFirstArc[i];
+
+    mNeighbours.resize(mArcCount);
+    mSisters.resize(mArcCount);
+    mEdgeArcs.resize(pEdges.size());
+    for(size_t e=0; e<pEdges.size(); e++)
+    {
+        int lFirst = pEdges[e].first;
+        int lSecond = pEdges[e].second;
+        int lArc = mDist[lFirst]++;
+        int lSisterArc = mDist[lSecond]++;
+
+        mNeighbours[lArc] = lSecond;
+        mNeighbours[lSisterArc] = lFirst;
+        mSisters[lArc] = lSisterArc;
+        mSisters[lSisterArc] = lArc;
+        mEdgeArcs[e] = lArc;
+    }
+
+    std::fill(mTermCap.begin(), mTermCap.begin()+mNodeCount, 0);
+    std::fill(mArcCap.begin(), mArcCap.begin()+mArcCount, 0);
+}
+
+/***********************/
+void graphCut::setNodeTerminal(int pNode, int pTerminal)
+{
+    setTerminal(pNode, pTerminal);
+}
+
+/***********************/
+void graphCut::setEdgeCapacity(int pEdge, int pCap)
+{
+    setEdge(mEdgeArcs[pEdge], pCap, pCap);
+}
+
+/***********************/
+int graphCut::getNodeCount()
+{
+    return mNodeCount;
+}
+
+/***********************/
+void graphCut::resizeNodes()
+{
+    // Les vecteurs ne sont jamais réduits : tant que la grille ne grandit pas,
+    // aucune allocation n'est faite d'une image à l'autre
+    size_t lCapacity = mArcCap.capacity() + mOrigArc.capacity();
+
+    mTermCap.resize(mNodeCount);
+    mArcCap.resize(mArcCount);
+
+    mParent.resize(mNodeCount);
+    mNext.resize(mNodeCount);
+    mTimestamp.resize(mNodeCount);
+    mDist.resize(mNodeCount);
+    mIsSink.resize(mNodeCount);
+
+    if(mIsDynamic)
+    {
+        mOrigTerm.resize(mNodeCount);
+        mOrigArc.resize(mArcCount);
+        mIsMarked.resize(mNodeCount, 0);
+    }
+
+    if(mArcCap.capacity() + mOrigArc.capacity() != lCapacity)
+        mAllocations++;
+}
+
+/***********************/
+unsigned int graphCut::getAllocationCount()
+{
+    return mAllocations;
+}
+
+/***********************/
+void graphCut::setThreadCount(unsigned int pCount)
+{
+    mThreadCount = max(1u, pCount);
+}
+
+/***********************/
+void graphCut::setDynamic(bool pDynamic)
+{
+    reset();
+    mIsDynamic = pDynamic;
+
+    if(mIsDynamic)
+    {
+        mOrigTerm.resize(mNodeCount);
+        mOrigArc.resize(mArcCount);
+        mIsMarked.resize(mNodeCount, 0);
+    }
+}
+
+/***********************/
+void graphCut::reset()
+{
+    mIsReusable = false;
+
+    for(size_t c=0; c<mChanged.size(); c++)
+        mIsMarked[mChanged[c]] = 0;
+    mChanged.clear();
+}
+
+/***********************/
+void graphCut::setCapacities(const int* pTerminals, const int* pLeft, const int* pRight,
+                             const int* pUp, const int* pDown, int pStep)
+{
+    for(int y=0; y<mHeight; y++)
+    {
+        for(int x=0; x<mWidth; x++)
+        {
+            int lNode = y*mWidth + x;
+            int lIndex = y*pStep + x;
+
+            setTerminal(lNode, pTerminals[lIndex]);
+
+            // Les arcs sortant de la grille sont nuls : c'est ce qui permet
+            // de ne pas tester les bords lors du parcours des voisins
+            if(x < mWidth-1)
+                setEdge(lNode*4+0, pRight[lIndex], pLeft[lIndex+1]);
+            else
+                mArcCap[lNode*4+0] = 0;
+            if(x == 0)
+                mArcCap[lNode*4+1] = 0;
+
+            if(y < mHeight-1)
+                setEdge(lNode*4+2, pDown[lIndex], pUp[lIndex+pStep]);
+            else
+                mArcCap[lNode*4+2] = 0;
+            if(y == 0)
+                mArcCap[lNode*4+3] = 0;
+        }
+    }
+}
+
+/***********************/
+void graphCut::setCapacities(const unsigned short* pTerminals, const unsigned short* pRight,
+                             const unsigned short* pDown, int pStep, int pOffset)
+{
+    for(int y=0; y<mHeight; y++)
+    {
+        for(int x=0; x<mWidth; x++)
+        {
+            int lIndex = y*pStep + x;
+            setNode(x, y, (int)pTerminals[lIndex] - pOffset, pRight[lIndex], pDown[lIndex]);
+        }
+    }
+}
+
+/***********************/
+void graphCut::setNode(int pX, int pY, int pTerminal, int pRight, int pDown)
+{
+    int lNode = pY*mWidth + pX;
+    if(mIsSparse)
+    {
+        lNode = mNodeMap[lNode];
+        if(lNode < 0)
+            return;
+    }
+
+    setTerminal(lNode, pTerminal);
+
+    // Pour une grille creuse, les arcs vers des pixels absents sont nuls,
+    // comme ceux qui sortent de la grille
+    if(mIsSparse ? mNeighbours[lNode*4+0] >= 0 : pX < mWidth-1)
+        setEdge(lNode*4+0, pRight, pRight);
+    else
+        mArcCap[lNode*4+0] = 0;
+    if(mIsSparse ? mNeighbours[lNode*4+1] < 0 : pX == 0)
+        mArcCap[lNode*4+1] = 0;
+
+    if(mIsSparse ? mNeighbours[lNode*4+2] >= 0 : pY < mHeight-1)
+        setEdge(lNode*4+2, pDown, pDown);
+    else
+        mArcCap[lNode*4+2] = 0;
+    if(mIsSparse ? mNeighbours[lNode*4+3] < 0 : pY == 0)
+        mArcCap[lNode*4+3] = 0;
+}
+
+/***********************/
+void graphCut::setTerminal(int pNode, int pCap)
+{
+    if(mIsReusable)
+    {
+        // Le flot déjà passé par ce noeud reste valide, seule la
+        // différence de capacité est reportée sur la capacité résiduelle
+        int lDelta = pCap - mOrigTerm[pNode];
+        if(lDelta != 0)
+        {
+            mTermCap[pNode] += lDelta;
+            markNode(pNode);
+        }
+    }
+    else
+        mTermCap[pNode] = pCap;
+
+    if(mIsDynamic)
+        mOrigTerm[pNode] = pCap;
+}
+
+/***********************/
+void graphCut::setEdge(int pArc, int pCap, int pSisterCap)
+{
+    int lSister = arcSister(pArc);
+
+    if(mIsReusable)
+    {
+        if(pCap == mOrigArc[pArc] && pSisterCap == mOrigArc[lSister])
+            return;
+
+        // Flot actuel de la queue vers la tête de l'arc
+        int lTail = arcTail(pArc);
+        int lHead = arcHead(pArc);
+        int lFlow = mOrigArc[pArc] - mArcCap[pArc];
+
+        // Si le flot dépasse la nouvelle capacité, l'excédent est reporté
+        // sur les liens aux terminaux des deux extrémités (Kohli et Torr)
+        if(lFlow > pCap)
+        {
+            mTermCap[lTail] += lFlow - pCap;
+            mTermCap[lHead] -= lFlow - pCap;
+            lFlow = pCap;
+        }
+        else if(-lFlow > pSisterCap)
+        {
+            mTermCap[lHead] += -lFlow - pSisterCap;
+            mTermCap[lTail] -= -lFlow - pSisterCap;
+            lFlow = -pSisterCap;
+        }
+
+        mArcCap[pArc] = pCap - lFlow;
+        mArcCap[lSister] = pSisterCap + lFlow;
+
+        markNode(lTail);
+        markNode(lHead);
+    }
+    else
+    {
+        mArcCap[pArc] = pCap;
+        mArcCap[lSister] = pSisterCap;
+    }
+
+    if(mIsDynamic)
+    {
+        mOrigArc[pArc] = pCap;
+        mOrigArc[lSister] = pSisterCap;
+    }
+}
+
+/***********************/
+void graphCut::markNode(int pNode)
+{
+    if(!mIsMarked[pNode])
+    {
+        mIsMarked[pNode] = 1;
+        mChanged.push_back(pNode);
+    }
+}
+
+/***********************/
+int graphCut::maxflow()
+{
+    int lFlow = 0;
+
+    mIsConverged = true;
+    mResidual = 0;
+    mAugmentations = 0;
+    mOrphans = 0;
+    if(mNodeCount == 0)
+        return lFlow;
+
+    mState.begin = 0;
+    mState.end = mNodeCount;
+
+    // Date limite de la résolution, commune à tous les threads
+    if(mTimeBudget > 0.f)
+        mDeadline = chrono::high_resolution_clock::now() + chrono::microseconds((long long)(mTimeBudget*1000.f));
+
+    // En mode dynamique, on repart des arbres de la résolution précédente
+    if(mIsReusable)
+    {
+        reuseTrees(mState);
+        solve(mState);
+        finishSolve();
+        return mState.flow;
+    }
+
+    // Résolution parallèle : chaque bande de lignes est résolue à part, sur
+    // le pool partagé, les arcs entre bandes étant ignorés. Le flot trouvé
+    // est valide pour la grille entière, et les arbres de recherche aussi :
+    // la dernière passe les reprend, et ne cherche que les chemins passant
+    // par les arcs entre bandes
+    // Une grille creuse ou un graphe quelconque sont découpés en bandes
+    // de noeuds consécutifs
+    int lBandCount = min((int)mThreadCount, mNodeCount/(MIN_BAND_HEIGHT*max(1, mWidth)));
+    if(lBandCount > 1)
+    {
+        vector<searchState> lStates(lBandCount);
+        for(int t=0; t<lBandCount; t++)
+        {
+            if(mIsSparse || mIsGeneral)
+            {
+                lStates[t].begin = mNodeCount*t/lBandCount;
+                lStates[t].end = mNodeCount*(t+1)/lBandCount;
+            }
+            else
+            {
+                lStates[t].begin = (mHeight*t/lBandCount)*mWidth;
+                lStates[t].end = (mHeight*(t+1)/lBandCount)*mWidth;
+            }
+        }
+
+        threadPool::getInstance().parallelFor(0, lBandCount, 1, [&] (int pFirst, int pLast)
+        {
+            for(int t=pFirst; t<pLast; t++)
+            {
+                initTrees(lStates[t]);
+                solve(lStates[t]);
+            }
+        } );
+
+        for(int t=0; t<lBandCount; t++)
+        {
+            lFlow += lStates[t].flow;
+            mAugmentations += lStates[t].augmentations;
+            mOrphans += lStates[t].adoptions;
+        }
+
+        mergeTrees(mState, lStates);
+    }
+    else
+        initTrees(mState);
+
+    // Passe sur la grille entière, qui reprend les capacités résiduelles
+    // Si elle va jusqu'au bout, la coupe est optimale même si les bandes
+    // ont été interrompues
+    solve(mState);
+    lFlow += mState.flow;
+
+    mIsReusable = mIsDynamic;
+    finishSolve();
+
+    return lFlow;
+}
+
+/***********************/
+void graphCut::finishSolve()
+{
+    mIsConverged = !mState.isInterrupted;
+    mResidual = mState.residual;
+    mAugmentations += mState.augmentations;
+    mOrphans += mState.adoptions;
+
+    // Le flot reste valide après une interruption, mais pas les arbres de
+    // recherche : la résolution suivante repartira de zéro
+    if(!mIsConverged)
+        mIsReusable = false;
+}
+
+/***********************/
+void graphCut::setTimeBudget(float pBudget)
+{
+    mTimeBudget = max(0.f, pBudget);
+}
+
+/***********************/
+bool graphCut::isConverged()
+{
+    return mIsConverged;
+}
+
+/***********************/
+int graphCut::getResidual()
+{
+    return mResidual;
+}
+
+/***********************/
+unsigned int graphCut::getAugmentationCount()
+{
+    return mAugmentations;
+}
+
+/***********************/
+unsigned int graphCut::getOrphanCount()
+{
+    return mOrphans;
+}
+
+/***********************/
+void graphCut::getLabels(unsigned char* pLabels, int pStep)
+{
+    // Un graphe quelconque n'a pas de pixels
+    if(mIsGeneral)
+        return;
+
+    for(int y=0; y<mHeight; y++)
+    {
+        for(int x=0; x<mWidth; x++)
+        {
+            int lNode = y*mWidth + x;
+            if(mIsSparse)
+            {
+                lNode = mNodeMap[lNode];
+                if(lNode < 0)
+                    continue;
+            }
+
+            // Les noeuds libres peuvent aller d'un côté comme de l'autre,
+            // on les laisse du côté de la source
+            if(mParent[lNode] != PARENT_NONE && mIsSink[lNode])
+                pLabels[y*pStep + x] = 0;
+            else
+                pLabels[y*pStep + x] = 1;
+        }
+    }
+}
+
+/***********************/
+unsigned char graphCut::getLabel(int pNode)
+{
+    if(mParent[pNode] != PARENT_NONE && mIsSink[pNode])
+        return 0;
+    else
+        return 1;
+}
+
+/***********************/
+void graphCut::solve(searchState &pState)
+{
+    pState.isInterrupted = false;
+    pState.residual = 0;
+
+    int lCurrent = -1;
+    int lIterations = 0;
+    while(true)
+    {
+        // Vérification régulière du budget de temps. L'arrêt se fait entre
+        // deux augmentations, le flot et les arbres sont donc cohérents
+        if(mTimeBudget > 0.f && (++lIterations & 255) == 0
+                && chrono::high_resolution_clock::now() > mDeadline)
+        {
+            pState.isInterrupted = true;
+            pState.residual = countActive(pState) + (lCurrent >= 0 ? 1 : 0);
+            break;
+        }
+
+        int lNode = lCurrent;
+        if(lNode >= 0)
+        {
+            mNext[lNode] = -1;
+            if(mParent[lNode] == PARENT_NONE)
+                lNode = -1;
+        }
+        if(lNode < 0)
+        {
+            lNode = nextActive(pState);
+            if(lNode < 0)
+                break;
+        }
+
+        // Croissance des arbres, jusqu'à trouver un chemin source -> puits
+        int lMiddleArc = grow(pState, lNode);
+
+        pState.time++;
+
+        if(lMiddleArc >= 0)
+        {
+            // Le noeud reste actif, on y reviendra directement
+            mNext[lNode] = lNode;
+            lCurrent = lNode;
+
+            pState.flow += augment(pState, lMiddleArc);
+            pState.augmentations++;
+            adopt(pState);
+        }
+        else
+            lCurrent = -1;
+    }
+}
+
+/***********************/
+int graphCut::countActive(searchState &pState)
+{
+    int lCount = 0;
+    for(int q=0; q<2; q++)
+    {
+        for(int i=pState.queueFirst[q]; i>=0; i=mNext[i])
+        {
+            lCount++;
+            if(mNext[i] == i)
+                break;
+        }
+    }
+
+    return lCount;
+}
+
+/***********************/
+void graphCut::initTrees(searchState &pState)
+{
+    pState.queueFirst[0] = pState.queueFirst[1] = -1;
+    pState.queueLast[0] = pState.queueLast[1] = -1;
+    pState.orphans.clear();
+    pState.time = 0;
+    pState.flow = 0;
+    pState.augmentations = 0;
+    pState.adoptions = 0;
+
+    for(int i=pState.begin; i<pState.end; i++)
+    {
+        mNext[i] = -1;
+        mTimestamp[i] = pState.time;
+
+        if(mTermCap[i] > 0)
+        {
+            // Noeud relié à la source
+            mIsSink[i] = 0;
+            mParent[i] = PARENT_TERMINAL;
+            mDist[i] = 1;
+            setActive(pState, i);
+        }
+        else if(mTermCap[i] < 0)
+        {
+            // Noeud relié au puits
+            mIsSink[i] = 1;
+            mParent[i] = PARENT_TERMINAL;
+            mDist[i] = 1;
+            setActive(pState, i);
+        }
+        else
+            mParent[i] = PARENT_NONE;
+    }
+}
+
+/***********************/
+void graphCut::mergeTrees(searchState &pState, vector<searchState> &pBands)
+{
+    pState.queueFirst[0] = pState.queueFirst[1] = -1;
+    pState.queueLast[0] = pState.queueLast[1] = -1;
+    pState.orphans.clear();
+    pState.flow = 0;
+    pState.augmentations = 0;
+    pState.adoptions = 0;
+
+    // Les distances datées par les bandes ne sont plus à jour pour la grille entière
+    pState.time = 0;
+    for(size_t b=0; b<pBands.size(); b++)
+        pState.time = max(pState.time, pBands[b].time);
+    pState.time++;
+
+    // Chaque bande terminée n'a plus de noeud actif pour ses propres arcs :
+    // seuls ceux de ses arbres reliés à une autre bande sont à reprendre, soit
+    // sur une grille pleine ses première et dernière lignes. Une bande
+    // interrompue garde en plus ses noeuds encore actifs
+    for(size_t b=0; b<pBands.size(); b++)
+    {
+        searchState &lBand = pBands[b];
+        bool lIsFull = lBand.isInterrupted || mIsSparse || mIsGeneral;
+        int lRanges[2][2] = {{lBand.begin, lIsFull ? lBand.end : min(lBand.end, lBand.begin + mWidth)},
+                             {lIsFull ? lBand.end : max(lBand.begin + mWidth, lBand.end - mWidth), lBand.end}};
+
+        for(int r=0; r<2; r++)
+        {
+            for(int i=lRanges[r][0]; i<lRanges[r][1]; i++)
+            {
+                bool lIsActive = (mNext[i] >= 0);
+                mNext[i] = -1;
+                if(mParent[i] == PARENT_NONE)
+                    continue;
+
+                for(int a=firstArc(i); a<lastArc(i) && !lIsActive; a++)
+                {
+                    int j = arcHead(a);
+                    lIsActive = (j >= 0 && (j < lBand.begin || j >= lBand.end));
+                }
+                if(lIsActive)
+                    setActive(pState, i);
+            }
+        }
+    }
+}
+
+/***********************/
+void graphCut::reuseTrees(searchState &pState)
+{
+    pState.queueFirst[0] = pState.queueFirst[1] = -1;
+    pState.queueLast[0] = pState.queueLast[1] = -1;
+    pState.orphans.clear();
+    pState.time++;
+    pState.flow = 0;
+    pState.augmentations = 0;
+    pState.adoptions = 0;
+
+    // Seuls les noeuds dont les capacités ont changé sont traités : ils deviennent
+    // racines de l'arbre correspondant à leur capacité résiduelle, ou orphelins
+    for(size_t c=0; c<mChanged.size(); c++)
+    {
+        int i = mChanged[c];
+        mIsMarked[i] = 0;
+        setActive(pState, i);
+
+        if(mTermCap[i] == 0)
+        {
+            if(mParent[i] != PARENT_NONE)
+            {
+                mParent[i] = PARENT_ORPHAN;
+                pState.orphans.push_back(i);
+            }
+            continue;
+        }
+
+        if(mTermCap[i] > 0)
+        {
+            if(mParent[i] == PARENT_NONE || mIsSink[i])
+            {
+                // Le noeud passe dans l'arbre de la source
+                mIsSink[i] = 0;
+                for(int a=firstArc(i); a<lastArc(i); a++)
+                {
+                    int j = arcHead(a);
+                    if(j < 0 || mIsMarked[j])
+                        continue;
+                    if(mParent[j] == arcSister(a))
+                    {
+                        mParent[j] = PARENT_ORPHAN;
+                        pState.orphans.push_back(j);
+                    }
+                    if(mParent[j] != PARENT_NONE && mIsSink[j] && mArcCap[a] > 0)
+                        setActive(pState, j);
+                }
+            }
+        }
+        else
+        {
+            if(mParent[i] == PARENT_NONE || !mIsSink[i])
+            {
+                // Le noeud passe dans l'arbre du puits
+                mIsSink[i] = 1;
+                for(int a=firstArc(i); a<lastArc(i); a++)
+                {
+                    int j = arcHead(a);
+                    if(j < 0 || mIsMarked[j])
+                        continue;
+                    if(mParent[j] == arcSister(a))
+                    {
+                        mParent[j] = PARENT_ORPHAN;
+                        pState.orphans.push_back(j);
+                    }
+                    if(mParent[j] != PARENT_NONE && !mIsSink[j] && mArcCap[arcSister(a)] > 0)
+                        setActive(pState, j);
+                }
+            }
+        }
+
+        mParent[i] = PARENT_TERMINAL;
+        mTimestamp[i] = pState.time;
+        mDist[i] = 1;
+    }
+    mChanged.clear();
+
+    adopt(pState);
+}
+
+/***********************/
+void graphCut::setActive(searchState &pState, int pNode)
+{
+    // Un noeud est actif si et seulement si mNext est positif
+    if(mNext[pNode] < 0)
+    {
+        if(pState.queueLast[1] >= 0)
+            mNext[pState.queueLast[1]] = pNode;
+        else
+            pState.queueFirst[1] = pNode;
+        pState.queueLast[1] = pNode;
+        mNext[pNode] = pNode;
+    }
+}
+
+/***********************/
+int graphCut::nextActive(searchState &pState)
+{
+    int lNode;
+
+    while(true)
+    {
+        lNode = pState.queueFirst[0];
+        if(lNode < 0)
+        {
+            pState.queueFirst[0] = lNode = pState.queueFirst[1];
+            pState.queueLast[0] = pState.queueLast[1];
+            pState.queueFirst[1] = -1;
+            pState.queueLast[1] = -1;
+            if(lNode < 0)
+                return -1;
+        }
+
+        // On retire le noeud de la liste
+        if(mNext[lNode] == lNode)
+            pState.queueFirst[0] = pState.queueLast[0] = -1;
+        else
+            pState.queueFirst[0] = mNext[lNode];
+        mNext[lNode] = -1;
+
+        // Un noeud de la liste n'est actif que s'il a un parent
+        if(mParent[lNode] != PARENT_NONE)
+            return lNode;
+    }
+}
+/***********************/
+int graphCut::grow(searchState &pState, int pNode)
+{
+    int lFirst = firstArc(pNode);
+    int lLast = lastArc(pNode);
+
+    if(!mIsSink[pNode])
+    {
+        for(int a=lFirst; a<lLast; a++)
+        {
+            if(mArcCap[a] == 0)
+                continue;
+
+            int lHead = arcHead(a);
+            if(lHead < pState.begin || lHead >= pState.end)
+                continue;
+
+            if(mParent[lHead] == PARENT_NONE)
+            {
+                mIsSink[lHead] = 0;
+                mParent[lHead] = arcSister(a);
+                mTimestamp[lHead] = mTimestamp[pNode];
+                mDist[lHead] = mDist[pNode] + 1;
+                setActive(pState, lHead);
+            }
+            else if(mIsSink[lHead])
+                return a;
+            else if(mTimestamp[lHead] <= mTimestamp[pNode] && mDist[lHead] > mDist[pNode])
+            {
+                // On raccourcit le chemin vers la source
+                mParent[lHead] = arcSister(a);
+                mTimestamp[lHead] = mTimestamp[pNode];
+                mDist[lHead] = mDist[pNode] + 1;
+            }
+        }
+    }
+    else
+    {
+        for(int a=lFirst; a<lLast; a++)
+        {
+            int lHead = arcHead(a);
+            if(lHead < pState.begin || lHead >= pState.end)
+                continue;
+
+            int lSister = arcSister(a);
+            if(mArcCap[lSister] == 0)
+                continue;
+
+            if(mParent[lHead] == PARENT_NONE)
+            {
+                mIsSink[lHead] = 1;
+                mParent[lHead] = lSister;
+                mTimestamp[lHead] = mTimestamp[pNode];
+                mDist[lHead] = mDist[pNode] + 1;
+                setActive(pState, lHead);
+            }
+            else if(!mIsSink[lHead])
+                return lSister;
+            else if(mTimestamp[lHead] <= mTimestamp[pNode] && mDist[lHead] > mDist[pNode])
+            {
+                mParent[lHead] = lSister;
+                mTimestamp[lHead] = mTimestamp[pNode];
+                mDist[lHead] = mDist[pNode] + 1;
+            }
+        }
+    }
+
+    return -1;
+}
+
+/***********************/
+int graphCut::augment(searchState &pState, int pMiddleArc)
+{
+    int lNode, lArc;
+
+    // Recherche de la capacité du goulot d'étranglement
+    // Côté source
+    int lBottleneck = mArcCap[pMiddleArc];
+    for(lNode=arcTail(pMiddleArc); ; lNode=arcHead(lArc))
+    {
+        lArc = mParent[lNode];
+        if(lArc == PARENT_TERMINAL)
+            break;
+        lBottleneck = min(lBottleneck, mArcCap[arcSister(lArc)]);
+    }
+    lBottleneck = min(lBottleneck, mTermCap[lNode]);
+
+    // Côté puits
+    for(lNode=arcHead(pMiddleArc); ; lNode=arcHead(lArc))
+    {
+        lArc = mParent[lNode];
+        if(lArc == PARENT_TERMINAL)
+            break;
+        lBottleneck = min(lBottleneck, mArcCap[lArc]);
+    }
+    lBottleneck = min(lBottleneck, -mTermCap[lNode]);
+
+    // Augmentation du flot le long du chemin
+    mArcCap[arcSister(pMiddleArc)] += lBottleneck;
+    mArcCap[pMiddleArc] -= lBottleneck;
+
+    for(lNode=arcTail(pMiddleArc); ; lNode=arcHead(lArc))
+    {
+        lArc = mParent[lNode];
+        if(lArc == PARENT_TERMINAL)
+            break;
+        int lSister = arcSister(lArc);
+        mArcCap[lArc] += lBottleneck;
+        mArcCap[lSister] -= lBottleneck;
+        if(mArcCap[lSister] == 0)
+        {
+            mParent[lNode] = PARENT_ORPHAN;
+            pState.orphans.push_front(lNode);
+        }
+    }
+    mTermCap[lNode] -= lBottleneck;
+    if(mTermCap[lNode] == 0)
+    {
+        mParent[lNode] = PARENT_ORPHAN;
+        pState.orphans.push_front(lNode);
+    }
+
+    for(lNode=arcHead(pMiddleArc); ; lNode=arcHead(lArc))
+    {
+        lArc = mParent[lNode];
+        if(lArc == PARENT_TERMINAL)
+            break;
+        mArcCap[arcSister(lArc)] += lBottleneck;
+        mArcCap[lArc] -= lBottleneck;
+        if(mArcCap[lArc] == 0)
+        {
+            mParent[lNode] = PARENT_ORPHAN;
+            pState.orphans.push_front(lNode);
+        }
+    }
+    mTermCap[lNode] += lBottleneck;
+    if(mTermCap[lNode] == 0)
+    {
+        mParent[lNode] = PARENT_ORPHAN;
+        pState.orphans.push_front(lNode);
+    }
+
+    return lBottleneck;
+}
+
+/***********************/
+void graphCut::adopt(searchState &pState)
+{
+    while(!pState.orphans.empty())
+    {
+        int lNode = pState.orphans.front();
+        pState.orphans.pop_front();
+        pState.adoptions++;
+
+        if(mIsSink[lNode])
+            processSinkOrphan(pState, lNode);
+        else
+            processSourceOrphan(pState, lNode);
+    }
+}
+
+/***********************/
+void graphCut::processSourceOrphan(searchState &pState, int pNode)
+{
+    const int lInfinite = numeric_limits<int>::max();
+
+    int lFirst = firstArc(pNode);
+    int lLast = lastArc(pNode);
+
+    int lMinArc = PARENT_NONE;
+    int lMinDist = lInfinite;
+
+    // Recherche d'un nouveau parent, toujours relié à la source
+    for(int a=lFirst; a<lLast; a++)
+    {
+        int lHead = arcHead(a);
+        if(lHead < pState.begin || lHead >= pState.end || mArcCap[arcSister(a)] == 0)
+            continue;
+
+        int j = lHead;
+        if(mIsSink[j] || mParent[j] == PARENT_NONE)
+            continue;
+
+        // On remonte jusqu'à l'origine de j
+        int lDist = 0;
+        while(true)
+        {
+            if(mTimestamp[j] == pState.time)
+            {
+                lDist += mDist[j];
+                break;
+            }
+            int lArc = mParent[j];
+            lDist++;
+            if(lArc == PARENT_TERMINAL)
+            {
+                mTimestamp[j] = pState.time;
+                mDist[j] = 1;
+                break;
+            }
+            if(lArc == PARENT_ORPHAN)
+            {
+                lDist = lInfinite;
+                break;
+            }
+            j = arcHead(lArc);
+        }
+
+        if(lDist < lInfinite)
+        {
+            if(lDist < lMinDist)
+            {
+                lMinArc = a;
+                lMinDist = lDist;
+            }
+
+            // On marque le chemin parcouru
+            for(j=lHead; mTimestamp[j]!=pState.time; j=arcHead(mParent[j]))
+            {
+                mTimestamp[j] = pState.time;
+                mDist[j] = lDist--;
+            }
+        }
+    }
+
+    mParent[pNode] = lMinArc;
+    if(lMinArc != PARENT_NONE)
+    {
+        mTimestamp[pNode] = pState.time;
+        mDist[pNode] = lMinDist + 1;
+    }
+    else
+    {
+        // Pas de parent trouvé, le noeud devient libre
+        // et ses voisins doivent être traités
+        for(int a=lFirst; a<lLast; a++)
+        {
+            int j = arcHead(a);
+            if(j < pState.begin || j >= pState.end)
+                continue;
+
+            int lArc = mParent[j];
+            if(mIsSink[j] || lArc == PARENT_NONE)
+                continue;
+
+            if(mArcCap[arcSister(a)] > 0)
+                setActive(pState, j);
+            if(lArc != PARENT_TERMINAL && lArc != PARENT_ORPHAN && arcHead(lArc) == pNode)
+            {
+                mParent[j] = PARENT_ORPHAN;
+                pState.orphans.push_back(j);
+            }
+        }
+    }
+}
+
+/***********************/
+void graphCut::processSinkOrphan(searchState &pState, int pNode)
+{
+    const int lInfinite = numeric_limits<int>::max();
+
+    int lFirst = firstArc(pNode);
+    int lLast = lastArc(pNode);
+
+    int lMinArc = PARENT_NONE;
+    int lMinDist = lInfinite;
+
+    // Recherche d'un nouveau parent, toujours relié au puits
+    for(int a=lFirst; a<lLast; a++)
+    {
+        if(mArcCap[a] == 0)
+            continue;
+        int lHead = arcHead(a);
+        if(lHead < pState.begin || lHead >= pState.end)
+            continue;
+
+        int j = lHead;
+        if(!mIsSink[j] || mParent[j] == PARENT_NONE)
+            continue;
+
+        int lDist = 0;
+        while(true)
+        {
+            if(mTimestamp[j] == pState.time)
+            {
+                lDist += mDist[j];
+                break;
+            }
+            int lArc = mParent[j];
+            lDist++;
+            if(lArc == PARENT_TERMINAL)
+            {
+                mTimestamp[j] = pState.time;
+                mDist[j] = 1;
+                break;
+            }
+            if(lArc == PARENT_ORPHAN)
+            {
+                lDist = lInfinite;
+                break;
+            }
+            j = arcHead(lArc);
+        }
+
+        if(lDist < lInfinite)
+        {
+            if(lDist < lMinDist)
+            {
+                lMinArc = a;
+                lMinDist = lDist;
+            }
+
+            for(j=lHead; mTimestamp[j]!=pState.time; j=arcHead(mParent[j]))
+            {
+                mTimestamp[j] = pState.time;
+                mDist[j] = lDist--;
+            }
+        }
+    }
+
+    mParent[pNode] = lMinArc;
+    if(lMinArc != PARENT_NONE)
+    {
+        mTimestamp[pNode] = pState.time;
+        mDist[pNode] = lMinDist + 1;
+    }
+    else
+    {
+        for(int a=lFirst; a<lLast; a++)
+        {
+            int j = arcHead(a);
+            if(j < pState.begin || j >= pState.end)
+                continue;
+
+            int lArc = mParent[j];
+            if(!mIsSink[j] || lArc == PARENT_NONE)
+                continue;
+
+            if(mArcCap[a] > 0)
+                setActive(pState, j);
+            if(lArc != PARENT_TERMINAL && lArc != PARENT_ORPHAN && arcHead(lArc) == pNode)
+            {
+                mParent[j] = PARENT_ORPHAN;
+                pState.orphans.push_back(j);
+            }
+        }
+    }
+}
@@ -0,0 +1,227 @@
+/* Classe résolvant un problème de max-flow / min-cut sur une grille 4-connexe,
+ * par l'algorithme de Boykov-Kolmogorov. L'adjacence est implicite (pas de
+ * liste d'arcs) et les capacités sont stockées dans des tableaux compacts,
+ * à raison de 4 arcs par noeud (droite, gauche, bas, haut).
+ * La grille peut aussi être creuse : seuls les pixels désignés par un masque
+ * deviennent des noeuds, numérotés de façon compacte, et leurs voisins sont
+ * alors stockés explicitement. Enfin, un graphe quelconque peut être donné
+ * par la liste de ses arêtes, les arcs étant alors stockés au format CSR.
+ * Elle remplace nppiGraphcut_32s8u lorsqu'aucun GPU CUDA n'est disponible,
+ * et en reprend les conventions : terminal = capacité source - capacité puits,
+ * label 1 pour les noeuds du côté de la source.
+ * La résolution peut être répartie sur plusieurs threads : chacun sature les
+ * chemins d'une bande de lignes, puis une dernière passe sur toute la grille
+ * termine le calcul à partir du flot et des arbres de recherche des bandes.
+ * En mode dynamique, le graphe résiduel et les arbres de recherche sont
+ * conservés d'une résolution à l'autre : seules les capacités modifiées sont
+ * mises à jour (Kohli et Torr), ce qui évite de tout recalculer lorsque deux
+ * images successives diffèrent peu.
+ */
+
+#ifndef GRAPHCUT_H
+#define GRAPHCUT_H
+
+#include <chrono>
+#include <deque>
+#include <utility>
+#include <vector>
+
+class graphCut
+{
+public:
+    graphCut();
+    ~graphCut();
+
+    // Dimensionnement de la grille
+    void setGrid(int pWidth, int pHeight);
+    // Grille creuse, dont les noeuds sont les pixels non nuls de pMask
+    void setGrid(int pWidth, int pHeight, const unsigned char* pMask, int pStep);
+    // Graphe quelconque de pNodeCount noeuds, pEdges donnant les extrémités de
+    // chaque arête. Les capacités sont ensuite spécifiées noeud par noeud et
+    // arête par arête, les arêtes étant symétriques
+    void setGraph(int pNodeCount, const std::vector<std::pair<int, int> > &pEdges);
+    void setNodeTerminal(int pNode, int pTerminal);
+    void setEdgeCapacity(int pEdge, int pCap);
+    // Nombre de noeuds du graphe
+    int getNodeCount();
+    // Nombre de fois où les tableaux ont dû être agrandis
+    unsigned int getAllocationCount();
+
+    // Nombre de threads utilisés pour la résolution
+    void setThreadCount(unsigned int pCount);
+
+    // Activation du mode dynamique
+    void setDynamic(bool pDynamic);
+    // Oubli du flot précédent : la prochaine résolution repart de zéro
+    void reset();
+
+    // Budget de temps de chaque résolution, en ms (0 pour aucune limite).
+    // Une fois dépassé, la résolution s'arrête et les labels sont ceux
+    // des arbres de recherche actuels
+    void setTimeBudget(float pBudget);
+    // Vrai si la dernière résolution est allée jusqu'au bout
+    bool isConverged();
+    // Nombre de noeuds encore actifs lors de l'arrêt de la dernière résolution
+    int getResidual();
+    // Nombre de chemins augmentants et d'orphelins traités lors de la dernière
+    // résolution, tous threads confondus
+    unsigned int getAugmentationCount();
+    unsigned int getOrphanCount();
+
+    // Spécification des capacités, selon la convention de nppiGraphcut_32s8u
+    // mais sans transposition de pLeft et pRight. pStep est exprimé en éléments
+    // Ces deux variantes ne concernent que les grilles pleines
+    void setCapacities(const int* pTerminals, const int* pLeft, const int* pRight,
+                       const int* pUp, const int* pDown, int pStep);
+    // Variante à partir des textures 16 bits du rendu GL : les terminaux sont
+    // décalés de pOffset, et les coûts vers la gauche et vers le haut se
+    // déduisent des coûts vers la droite et vers le bas
+    void setCapacities(const unsigned short* pTerminals, const unsigned short* pRight,
+                       const unsigned short* pDown, int pStep, int pOffset);
+    // Spécification des capacités d'un seul noeud, les arcs étant symétriques :
+    // pRight et pDown sont aussi les capacités vers la gauche / le haut
+    // des voisins de droite et du bas. Ignoré si le pixel n'est pas un noeud
+    void setNode(int pX, int pY, int pTerminal, int pRight, int pDown);
+
+    // Calcul du flot maximal, renvoie le flot ajouté lors de cet appel
+    // (le flot total si le graphe résiduel précédent n'est pas réutilisé)
+    int maxflow();
+
+    // Récupération des labels (1 = source, 0 = puits). Pour une grille
+    // creuse, les pixels qui ne sont pas des noeuds ne sont pas modifiés
+    void getLabels(unsigned char* pLabels, int pStep);
+    // Label d'un seul noeud, quel que soit le type de graphe
+    unsigned char getLabel(int pNode);
+
+private:
+    /***********/
+    // Attributs
+    /***********/
+    // Valeurs particulières de mParent
+    static const int PARENT_NONE = -1;
+    static const int PARENT_TERMINAL = -2;
+    static const int PARENT_ORPHAN = -3;
+
+    // Nombre minimal de lignes d'une bande en résolution parallèle
+    static const int MIN_BAND_HEIGHT = 16;
+
+    // Etat d'une recherche, sur la grille entière ou sur une bande de lignes
+    struct searchState
+    {
+        int begin, end; // noeuds concernés
+        int queueFirst[2], queueLast[2];
+        std::deque<int> orphans;
+        int time;
+        int flow;
+        bool isInterrupted;
+        int residual;
+        unsigned int augmentations, adoptions;
+    };
+
+    int mWidth, mHeight;
+    int mNodeCount;
+    unsigned int mThreadCount;
+
+    // Grille creuse : indice de noeud de chaque pixel (-1 si absent),
+    // et voisins de chaque noeud dans le même ordre que les arcs
+    bool mIsSparse;
+    std::vector<int> mNodeMap;
+    std::vector<int> mNeighbours;
+
+    // Graphe quelconque : les arcs du noeud i vont de mFirstArc[i] à mFirstArc[i+1],
+    // leur tête étant dans mNeighbours
+    bool mIsGeneral;
+    int mArcCount;
+    std::vector<int> mFirstArc;
+    std::vector<int> mSisters;
+    std::vector<int> mEdgeArcs; // arc correspondant à chaque arête
+
+    // Mode dynamique
+    bool mIsDynamic;
+    bool mIsReusable; // vrai si le graphe résiduel et les arbres sont réutilisables
+    std::vector<int> mOrigTerm; // capacités spécifiées lors de la dernière résolution
+    std::vector<int> mOrigArc;
+    std::vector<unsigned char> mIsMarked; // noeuds dont les capacités ont changé
+    std::vector<int> mChanged;
+
+    unsigned int mAllocations;
+
+    // Budget de temps
+    float mTimeBudget;
+    std::chrono::high_resolution_clock::time_point mDeadline;
+    bool mIsConverged;
+    int mResidual;
+    unsigned int mAugmentations;
+    unsigned int mOrphans;
+
+    // Capacités résiduelles des liens aux terminaux (source - puits)
+    std::vector<int> mTermCap;
+    // Capacités résiduelles des arcs, l'arc d du noeud i étant en i*4+d
+    // (sauf pour un graphe quelconque)
+    std::vector<int> mArcCap;
+
+    // Arbres de recherche
+    std::vector<int> mParent; // arc menant au parent, ou une des valeurs PARENT_*
+    std::vector<int> mNext; // liste chaînée des noeuds actifs (-1 si inactif)
+    std::vector<int> mTimestamp;
+    std::vector<int> mDist;
+    std::vector<unsigned char> mIsSink;
+
+    // Etat de la recherche sur la grille entière, conservé en mode dynamique
+    searchState mState;
+
+    /**********/
+    // Méthodes
+    /**********/
+    // Navigation dans la grille
+    inline int arcHead(int pArc) const
+    {
+        if(mIsSparse || mIsGeneral)
+            return mNeighbours[pArc];
+
+        static const int lOffsets[2] = {1, -1};
+        int lDir = pArc & 3;
+        int lHead = (pArc >> 2) + ((lDir < 2) ? lOffsets[lDir] : lOffsets[lDir-2]*mWidth);
+        if(lHead < 0 || lHead >= mNodeCount)
+            return -1;
+        return lHead;
+    }
+    inline int arcSister(int pArc) const
+    {
+        if(mIsGeneral)
+            return mSisters[pArc];
+        return arcHead(pArc)*4 + ((pArc & 3) ^ 1);
+    }
+    inline int arcTail(int pArc) const
+    {
+        if(mIsGeneral)
+            return mNeighbours[mSisters[pArc]];
+        return pArc >> 2;
+    }
+    inline int firstArc(int pNode) const {return mIsGeneral ? mFirstArc[pNode] : pNode*4;}
+    inline int lastArc(int pNode) const {return mIsGeneral ? mFirstArc[pNode+1] : pNode*4+4;}
+
+    // Mise à jour des capacités, en tenant compte du flot existant en mode dynamique
+    void setTerminal(int pNode, int pCap);
+    void setEdge(int pArc, int pCap, int pSisterCap);
+    void markNode(int pNode);
+    void resizeNodes();
+
+    // Etapes de l'algorithme, limitées aux noeuds de pState
+    void solve(searchState &pState);
+    void finishSolve();
+    int countActive(searchState &pState);
+    void initTrees(searchState &pState);
+    // Reprise, pour la grille entière, des arbres de recherche des bandes
+    void mergeTrees(searchState &pState, std::vector<searchState> &pBands);
+    void reuseTrees(searchState &pState);
+    void setActive(searchState &pState, int pNode);
+    int nextActive(searchState &pState);
+    int grow(searchState &pState, int pNode);
+    int augment(searchState &pState, int pMiddleArc);
+    void adopt(searchState &pState);
+    void processSourceOrphan(searchState &pState, int pNode);
+    void processSinkOrphan(searchState &pState, int pNode);
+};
+
+#endif // GRAPHCUT_H
@@ -0,0 +1,505 @@
+/* Vérification de graphCut : sur des grilles et des graphes aléatoires, dans
+ * chacun des modes (grille pleine ou creuse, graphe quelconque, dynamique,
+ * bandes parallèles, budget de temps), la capacité de la coupe donnée par
+ * les labels est comparée au flot maximal d'une implémentation de référence
+ * (Dinic). Renvoie 0 si toutes les coupes sont minimales.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <queue>
+#include <vector>
+
+#include "graphcut.h"
+
+// Nombre de problèmes tirés par mode, et de résolutions successives de chacun
+#define __CHECK_PROBLEMS__ 150
+#define __CHECK_FRAMES__ 4
+
+using namespace std;
+
+// Problème de coupe explicite : noeuds 0..n-1, la source en n et le puits en n+1
+struct problem
+{
+    struct arc
+    {
+        int tail, head, cap;
+    };
+
+    int nodes;
+    vector<arc> arcs;
+
+    problem(int pNodes) : nodes(pNodes) {}
+
+    void addTerminal(int pNode, int pTerminal)
+    {
+        if(pTerminal > 0)
+            addArc(nodes, pNode, pTerminal);
+        else if(pTerminal < 0)
+            addArc(pNode, nodes+1, -pTerminal);
+    }
+    void addArc(int pTail, int pHead, int pCap)
+    {
+        arc lArc = {pTail, pHead, pCap};
+        arcs.push_back(lArc);
+    }
+};
+
+// Flot maximal de référence, par l'algorithme de Dinic
+class dinic
+{
+public:
+    dinic(const problem &pProblem)
+        :mSource(pProblem.nodes),
+          mSink(pProblem.nodes+1),
+          mArcs(pProblem.nodes+2),
+          mLevel(pProblem.nodes+2),
+          mCurrent(pProblem.nodes+2)
+    {
+        for(size_t a=0; a<pProblem.arcs.size(); a++)
+        {
+            const problem::arc &lArc = pProblem.arcs[a];
+            mArcs[lArc.tail].push_back(mHeads.size());
+            mHeads.push_back(lArc.head);
+            mCaps.push_back(lArc.cap);
+            mArcs[lArc.head].push_back(mHeads.size());
+            mHeads.push_back(lArc.tail);
+            mCaps.push_back(0);
+        }
+    }
+
+    long long maxflow()
+    {
+        long long lFlow = 0;
+        while(buildLevels())
+        {
+            fill(mCurrent.begin(), mCurrent.end(), 0);
+            int lPushed;
+            while((lPushed = push(mSource, 1 << 30)) > 0)
+                lFlow += lPushed;
+        }
+        return lFlow;
+    }
+
+private:
+    int mSource, mSink;
+    vector<vector<int> > mArcs;
+    vector<int> mHeads;
+    vector<int> mCaps;
+    vector<int> mLevel;
+    vector<size_t> mCurrent;
+
+    bool buildLevels()
+    {
+        fill(mLevel.begin(), mLevel.end(), -1);
+        queue<int> lQueue;
+        lQueue.push(mSource);
+        mLevel[mSource] = 0;
+        while(!lQueue.empty())
+        {
+            int lNode = lQueue.front();
+            lQueue.pop();
+            for(size_t i=0; i<mArcs[lNode].size(); i++)
+            {
+                int lArc = mArcs[lNode][i];
+                if(mCaps[lArc] > 0 && mLevel[mHeads[lArc]] < 0)
+                {
+                    mLevel[mHeads[lArc]] = mLevel[lNode]+1;
+                    lQueue.push(mHeads[lArc]);
+                }
+            }
+        }
+        return mLevel[mSink] >= 0;
+    }
+
+    int push(int pNode, int pFlow)
+    {
+        if(pNode == mSink)
+            return pFlow;
+
+        for(; mCurrent[pNode]<mArcs[pNode].size(); mCurrent[pNode]++)
+        {
+            int lArc = mArcs[pNode][mCurrent[pNode]];
+            int lHead = mHeads[lArc];
+            if(mCaps[lArc] <= 0 || mLevel[lHead] != mLevel[pNode]+1)
+                continue;
+
+            int lPushed = push(lHead, min(pFlow, mCaps[lArc]));
+            if(lPushed > 0)
+            {
+                mCaps[lArc] -= lPushed;
+                mCaps[lArc^1] += lPushed;
+                return lPushed;
+            }
+        }
+        return 0;
+    }
+};
+
+static int gChecks = 0;
+static int gFailures = 0;
+
+/***********************/
+// Capacité des arcs allant du côté source (label 1) au côté puits
+long long getCutCapacity(const problem &pProblem, const vector<unsigned char> &pLabels)
+{
+    long long lCut = 0;
+    for(size_t a=0; a<pProblem.arcs.size(); a++)
+    {
+        const problem::arc &lArc = pProblem.arcs[a];
+        bool lTailSource = (lArc.tail == pProblem.nodes) || (lArc.tail < pProblem.nodes && pLabels[lArc.tail] == 1);
+        bool lHeadSource = (lArc.head == pProblem.nodes) || (lArc.head < pProblem.nodes && pLabels[lArc.head] == 1);
+        if(lTailSource && !lHeadSource)
+            lCut += lArc.cap;
+    }
+    return lCut;
+}
+
+/***********************/
+void checkCut(const char* pMode, int pIndex, int pFrame, const problem &pProblem, const vector<unsigned char> &pLabels)
+{
+    long long lReference = dinic(pProblem).maxflow();
+    long long lCut = getCutCapacity(pProblem, pLabels);
+
+    gChecks++;
+    if(lCut != lReference)
+    {
+        gFailures++;
+        cerr << pMode << ": problem " << pIndex << ", frame " << pFrame << ": cut " << lCut
+             << " against a maximum flow of " << lReference << endl;
+    }
+}
+
+/***********************/
+// Tirage d'un réglage du solveur : nombre de threads, et mode dynamique
+void setRandomOptions(graphCut &pGraph)
+{
+    pGraph.setThreadCount(1 + rand()%8);
+    pGraph.setDynamic(rand()%2 == 0);
+}
+
+/***********************/
+// Modification d'une partie des capacités entre deux résolutions
+void perturb(vector<int> &pValues, int pRange, int pOffset)
+{
+    int lCount = pValues.size()/5 + 1;
+    for(int i=0; i<lCount; i++)
+        pValues[rand()%pValues.size()] = rand()%pRange - pOffset;
+}
+
+/***********************/
+// Grille pleine, arcs symétriques donnés noeud par noeud
+void checkDenseGrid()
+{
+    for(int p=0; p<__CHECK_PROBLEMS__; p++)
+    {
+        int lWidth = 1 + rand()%60;
+        int lHeight = 1 + rand()%70;
+        int lCount = lWidth*lHeight;
+        vector<int> lTerminals(lCount), lRight(lCount), lDown(lCount);
+        for(int i=0; i<lCount; i++)
+        {
+            lTerminals[i] = rand()%200 - 100;
+            lRight[i] = rand()%60;
+            lDown[i] = rand()%60;
+        }
+
+        graphCut lGraph;
+        setRandomOptions(lGraph);
+        for(int f=0; f<__CHECK_FRAMES__; f++)
+        {
+            lGraph.setGrid(lWidth, lHeight);
+            problem lProblem(lCount);
+            for(int y=0; y<lHeight; y++)
+            {
+                for(int x=0; x<lWidth; x++)
+                {
+                    int i = y*lWidth + x;
+                    lGraph.setNode(x, y, lTerminals[i], lRight[i], lDown[i]);
+                    lProblem.addTerminal(i, lTerminals[i]);
+                    if(x < lWidth-1)
+                    {
+                        lProblem.addArc(i, i+1, lRight[i]);
+                        lProblem.addArc(i+1, i, lRight[i]);
+                    }
+                    if(y < lHeight-1)
+                    {
+                        lProblem.addArc(i, i+lWidth, lDown[i]);
+                        lProblem.addArc(i+lWidth, i, lDown[i]);
+                    }
+                }
+            }
+            lGraph.maxflow();
+
+            vector<unsigned char> lLabels(lCount);
+            lGraph.getLabels(lLabels.data(), lWidth);
+            checkCut("dense grid", p, f, lProblem, lLabels);
+
+            perturb(lTerminals, 200, 100);
+            perturb(lRight, 60, 0);
+            perturb(lDown, 60, 0);
+        }
+    }
+}
+
+/***********************/
+// Grille pleine, arcs asymétriques donnés par tableaux
+void checkCapacities()
+{
+    for(int p=0; p<__CHECK_PROBLEMS__; p++)
+    {
+        int lWidth = 1 + rand()%20;
+        int lHeight = 1 + rand()%50;
+        int lCount = lWidth*lHeight;
+        vector<int> lTerminals(lCount), lLeft(lCount), lRight(lCount), lUp(lCount), lDown(lCount);
+        for(int i=0; i<lCount; i++)
+        {
+            lTerminals[i] = rand()%41 - 20;
+            lLeft[i] = rand()%10;
+            lRight[i] = rand()%10;
+            lUp[i] = rand()%10;
+            lDown[i] = rand()%10;
+        }
+
+        graphCut lGraph;
+        setRandomOptions(lGraph);
+        lGraph.setGrid(lWidth, lHeight);
+        for(int f=0; f<__CHECK_FRAMES__; f++)
+        {
+            if(f > 0 && rand()%8 == 0)
+                lGraph.reset();
+            lGraph.setCapacities(lTerminals.data(), lLeft.data(), lRight.data(), lUp.data(), lDown.data(), lWidth);
+
+            problem lProblem(lCount);
+            for(int y=0; y<lHeight; y++)
+            {
+                for(int x=0; x<lWidth; x++)
+                {
+                    int i = y*lWidth + x;
+                    lProblem.addTerminal(i, lTerminals[i]);
+                    if(x > 0)
+                        lProblem.addArc(i, i-1, lLeft[i]);
+                    if(x < lWidth-1)
+                        lProblem.addArc(i, i+1, lRight[i]);
+                    if(y > 0)
+                        lProblem.addArc(i, i-lWidth, lUp[i]);
+                    if(y < lHeight-1)
+                        lProblem.addArc(i, i+lWidth, lDown[i]);
+                }
+            }
+            lGraph.maxflow();
+
+            vector<unsigned char> lLabels(lCount);
+            lGraph.getLabels(lLabels.data(), lWidth);
+            checkCut("capacities", p, f, lProblem, lLabels);
+
+            perturb(lTerminals, 41, 20);
+            perturb(lLeft, 10, 0);
+            perturb(lRight, 10, 0);
+            perturb(lUp, 10, 0);
+            perturb(lDown, 10, 0);
+        }
+    }
+}
+
+/***********************/
+// Grille creuse : seuls les pixels du masque sont des noeuds, les autres
+// labels ne devant pas être modifiés
+void checkSparseGrid()
+{
+    for(int p=0; p<__CHECK_PROBLEMS__; p++)
+    {
+        int lWidth = 1 + rand()%60;
+        int lHeight = 1 + rand()%70;
+        int lCount = lWidth*lHeight;
+        vector<int> lTerminals(lCount), lRight(lCount), lDown(lCount);
+        vector<unsigned char> lMask(lCount);
+        for(int i=0; i<lCount; i++)
+        {
+            lTerminals[i] = rand()%200 - 100;
+            lRight[i] = rand()%60;
+            lDown[i] = rand()%60;
+            lMask[i] = (rand()%4 != 0);
+        }
+
+        graphCut lGraph;
+        setRandomOptions(lGraph);
+        for(int f=0; f<__CHECK_FRAMES__; f++)
+        {
+            if(rand()%3 == 0)
+                for(int k=0; k<5; k++)
+                    lMask[rand()%lCount] ^= 1;
+
+            lGraph.setGrid(lWidth, lHeight, lMask.data(), lWidth);
+            problem lProblem(lCount);
+            for(int y=0; y<lHeight; y++)
+            {
+                for(int x=0; x<lWidth; x++)
+                {
+                    int i = y*lWidth + x;
+                    lGraph.setNode(x, y, lTerminals[i], lRight[i], lDown[i]);
+                    if(!lMask[i])
+                        continue;
+                    lProblem.addTerminal(i, lTerminals[i]);
+                    if(x < lWidth-1 && lMask[i+1])
+                    {
+                        lProblem.addArc(i, i+1, lRight[i]);
+                        lProblem.addArc(i+1, i, lRight[i]);
+                    }
+                    if(y < lHeight-1 && lMask[i+lWidth])
+                    {
+                        lProblem.addArc(i, i+lWidth, lDown[i]);
+                        lProblem.addArc(i+lWidth, i, lDown[i]);
+                    }
+                }
+            }
+            lGraph.maxflow();
+
+            vector<unsigned char> lLabels(lCount, 7);
+            lGraph.getLabels(lLabels.data(), lWidth);
+            for(int i=0; i<lCount; i++)
+            {
+                if(!lMask[i] && lLabels[i] != 7)
+                {
+                    gFailures++;
+                    cerr << "sparse grid: problem " << p << ", frame " << f << ": label written outside the mask" << endl;
+                    break;
+                }
+            }
+            checkCut("sparse grid", p, f, lProblem, lLabels);
+
+            perturb(lTerminals, 200, 100);
+            perturb(lRight, 60, 0);
+            perturb(lDown, 60, 0);
+        }
+    }
+}
+
+/***********************/
+// Graphe quelconque, au format CSR, l'objet étant réutilisé d'un graphe à l'autre
+void checkGeneralGraph()
+{
+    graphCut lGraph;
+    for(int p=0; p<__CHECK_PROBLEMS__*4; p++)
+    {
+        int lCount = 1 + rand()%80;
+        int lEdgeCount = rand()%(3*lCount+1);
+        vector<pair<int, int> > lEdges;
+        vector<int> lCaps;
+        for(int e=0; e<lEdgeCount; e++)
+        {
+            int lFirst = rand()%lCount;
+            int lSecond = rand()%lCount;
+            if(lFirst == lSecond)
+                continue;
+            lEdges.push_back(make_pair(lFirst, lSecond));
+            lCaps.push_back(rand()%10);
+        }
+
+        // Passage par une grille de temps en temps, pour réutiliser les tableaux
+        if(p%5 == 0)
+            lGraph.setGrid(3, 4);
+        setRandomOptions(lGraph);
+        lGraph.setGraph(lCount, lEdges);
+
+        problem lProblem(lCount);
+        for(int i=0; i<lCount; i++)
+        {
+            int lTerminal = rand()%41 - 20;
+            lGraph.setNodeTerminal(i, lTerminal);
+            lProblem.addTerminal(i, lTerminal);
+        }
+        for(size_t e=0; e<lEdges.size(); e++)
+        {
+            lGraph.setEdgeCapacity(e, lCaps[e]);
+            lProblem.addArc(lEdges[e].first, lEdges[e].second, lCaps[e]);
+            lProblem.addArc(lEdges[e].second, lEdges[e].first, lCaps[e]);
+        }
+        lGraph.maxflow();
+
+        vector<unsigned char> lLabels(lCount);
+        for(int i=0; i<lCount; i++)
+            lLabels[i] = lGraph.getLabel(i);
+        checkCut("general graph", p, 0, lProblem, lLabels);
+    }
+}
+
+/***********************/
+// Budget de temps : une résolution interrompue, puis reprise sans limite,
+// doit donner la coupe minimale
+void checkTimeBudget()
+{
+    int lWidth = 400;
+    int lHeight = 400;
+    int lCount = lWidth*lHeight;
+    vector<int> lTerminals(lCount), lRight(lCount), lDown(lCount);
+    for(int i=0; i<lCount; i++)
+    {
+        lTerminals[i] = rand()%2001 - 1000;
+        lRight[i] = rand()%300;
+        lDown[i] = rand()%300;
+    }
+
+    problem lProblem(lCount);
+    for(int y=0; y<lHeight; y++)
+    {
+        for(int x=0; x<lWidth; x++)
+        {
+            int i = y*lWidth + x;
+            lProblem.addTerminal(i, lTerminals[i]);
+            if(x < lWidth-1)
+            {
+                lProblem.addArc(i, i+1, lRight[i]);
+                lProblem.addArc(i+1, i, lRight[i]);
+            }
+            if(y < lHeight-1)
+            {
+                lProblem.addArc(i, i+lWidth, lDown[i]);
+                lProblem.addArc(i+lWidth, i, lDown[i]);
+            }
+        }
+    }
+
+    for(int d=0; d<2; d++)
+    {
+        graphCut lGraph;
+        lGraph.setDynamic(d == 1);
+        lGraph.setThreadCount(2);
+        for(int f=0; f<2; f++)
+        {
+            // Budget très court, puis aucune limite
+            lGraph.setTimeBudget(f == 0 ? 0.1f : 0.f);
+            lGraph.setGrid(lWidth, lHeight);
+            for(int y=0; y<lHeight; y++)
+                for(int x=0; x<lWidth; x++)
+                    lGraph.setNode(x, y, lTerminals[y*lWidth+x], lRight[y*lWidth+x], lDown[y*lWidth+x]);
+            lGraph.maxflow();
+        }
+
+        if(!lGraph.isConverged())
+        {
+            gFailures++;
+            cerr << "time budget: unlimited solve not converged" << endl;
+        }
+
+        vector<unsigned char> lLabels(lCount);
+        lGraph.getLabels(lLabels.data(), lWidth);
+        checkCut(d == 1 ? "time budget, dynamic" : "time budget", 0, 1, lProblem, lLabels);
+    }
+}
+
+/***********************/
+int main(int argc, char** argv)
+{
+    srand(argc > 1 ? atoi(argv[1]) : 1);
+
+    checkDenseGrid();
+    checkCapacities();
+    checkSparseGrid();
+    checkGeneralGraph();
+    checkTimeBudget();
+
+    cout << gChecks << " cuts checked, " << gFailures << " failures" << endl;
+    return gFailures == 0 ? 0 : 1;
+}
@@ -1,5 +1,4 @@
 #include <iostream>
-#include <thread>
 #include <chrono>
 
 #include "opencv2/opencv.hpp"
@@ -8,15 +7,36 @@
 #include "kinect.h"
 #include "zsegment.h"
 #include "gmm.h"
+#include "threadpool.h"
 #include "seed.h"
 #include "colorsegment.h"
 
+// Attente maximale d'une segmentation, en ms
+#define __SEGMENT_TIMEOUT__ 1000
+
 using namespace std;
 
 int main(int argc, char** argv)
 {
     bool lRecording = false;
     bool lShow = false;
+    bool lCpu = false;
+    bool lNative = false;
+    bool lNarrowBand = false;
+    unsigned int lPyramid = 0;
+    unsigned int lSuperpixels = 0;
+    float lBudget = 0.f;
+    bool lDynamic = false;
+    bool lPolling = false;
+    bool lHeadless = false;
+    unsigned int lThreads = 1;
+    bool lMulti = false;
+    unsigned int lObjectCount = 1;
+    bool lBatch = false;
+    bool lMetrics = false;
+    bool lSpawn = false;
+    bool lPixelFit = false;
+    bool lScalar = false;
 
     if(argc > 1)
     {
@@ -26,6 +46,41 @@ int main(int argc, char** argv)
                 lRecording = true;
             else if(strcmp(argv[i], "--show") == 0)
                 lShow = true;
+            else if(strcmp(argv[i], "--cpu") == 0)
+                lCpu = true;
+            else if(strcmp(argv[i], "--native") == 0)
+                lNative = true;
+            else if(strcmp(argv[i], "--narrowband") == 0)
+                lNarrowBand = true;
+            else if(strcmp(argv[i], "--pyramid") == 0 && i+1 < argc)
+                lPyramid = boost::lexical_cast<unsigned int>(argv[++i]);
+            else if(strcmp(argv[i], "--superpixels") == 0 && i+1 < argc)
+                lSuperpixels = boost::lexical_cast<unsigned int>(argv[++i]);
+            else if(strcmp(argv[i], "--budget") == 0 && i+1 < argc)
+                lBudget = boost::lexical_cast<float>(argv[++i]);
+            else if(strcmp(argv[i], "--dynamic") == 0)
+                lDynamic = true;
+            else if(strcmp(argv[i], "--poll") == 0)
+                lPolling = true;
+            else if(strcmp(argv[i], "--headless") == 0)
+                lHeadless = true;
+            else if(strcmp(argv[i], "--threads") == 0 && i+1 < argc)
+                lThreads = boost::lexical_cast<unsigned int>(argv[++i]);
+            else if(strcmp(argv[i], "--multi") == 0 && i+1 < argc)
+            {
+                lMulti = true;
+                lObjectCount = std::max(1u, boost::lexical_cast<unsigned int>(argv[++i]));
+            }
+            else if(strcmp(argv[i], "--batch") == 0)
+                lBatch = true;
+            else if(strcmp(argv[i], "--metrics") == 0)
+                lMetrics = true;
+            else if(strcmp(argv[i], "--spawn") == 0)
+                lSpawn = true;
+            else if(strcmp(argv[i], "--pixelfit") == 0)
+                lPixelFit = true;
+            else if(strcmp(argv[i], "--scalar") == 0)
+                lScalar = true;
         }
     }
 
@@ -61,28 +116,85 @@ int main(int argc, char** argv)
     lZSegment.setMax(2000);
     lZSegment.setFGSmoothing(3);
 
-    gmm lBGGmm, lFGGmm;
-    lBGGmm.setClusterCount(3);
-    lBGGmm.setEMMinLikelihood(0.01f);
-    lBGGmm.setMaxEMLoop(30);
-    lBGGmm.setMaxCost(100);
-
-    lFGGmm.setClusterCount(3);
-    lFGGmm.setEMMinLikelihood(0.01f);
-    lFGGmm.setMaxEMLoop(100);
-    lFGGmm.setMaxCost(100);
-
     seed lSeed;
     lSeed.setMinimumSize(128);
     lSeed.setDilatationSize(8);
 
-    colorSegment lColorSegment;
-    lColorSegment.init(640, 480);
-    lColorSegment.setMaxSmoothCost(50);
+    // GLFW ne gère qu'une fenêtre : en mode multi-objets, chaque segmentation
+    // construit son graphe sur CPU
+    bool lFBO = !lNative && !lNarrowBand && lPyramid == 0 && lSuperpixels == 0;
+    if(lMulti && lFBO)
+    {
+        cerr << "Multi-object mode: using native graphs." << endl;
+        lNative = true;
+    }
+
+    // Les objets peuvent aussi être résolus ensemble, par une seule segmentation
+    if(lBatch && !lMulti)
+        lBatch = false;
+
+    // Les GMM, et leur calcul par objet, créent leurs threads à chaque boucle
+    // au lieu d'utiliser le pool partagé (comparaison de la colonne gmm)
+    threadPool::getInstance().setSpawning(lSpawn);
+
+    // Un couple de GMM, et une segmentation, par objet traité
+    std::vector<boost::shared_ptr<gmm> > lBGGmms, lFGGmms;
+    std::vector<boost::shared_ptr<colorSegment> > lColorSegments;
+    for(unsigned int i=0; i<lObjectCount; i++)
+    {
+        boost::shared_ptr<gmm> lBGGmm(new gmm());
+        lBGGmm->setClusterCount(3);
+        lBGGmm->setEMMinLikelihood(0.01f);
+        lBGGmm->setMaxEMLoop(30);
+        lBGGmm->setMaxCost(100);
+        lBGGmm->setHistogramFit(!lPixelFit);
+        lBGGmm->setVectorized(!lScalar);
+        lBGGmms.push_back(lBGGmm);
+
+        boost::shared_ptr<gmm> lFGGmm(new gmm());
+        lFGGmm->setClusterCount(3);
+        lFGGmm->setEMMinLikelihood(0.01f);
+        lFGGmm->setMaxEMLoop(100);
+        lFGGmm->setMaxCost(100);
+        lFGGmm->setHistogramFit(!lPixelFit);
+        lFGGmm->setVectorized(!lScalar);
+        lFGGmms.push_back(lFGGmm);
+
+        if(lBatch && i > 0)
+            continue;
+
+        boost::shared_ptr<colorSegment> lColorSegment(new colorSegment());
+        if(lCpu)
+            lColorSegment->setSolver(colorSegment::SOLVER_CPU);
+        lColorSegment->setThreadCount(lThreads);
+        if(lNative)
+            lColorSegment->setGraphType(colorSegment::GRAPH_NATIVE);
+        if(lNarrowBand)
+            lColorSegment->setGraphType(colorSegment::GRAPH_NARROWBAND);
+        if(lPyramid > 0)
+        {
+            lColorSegment->setGraphType(colorSegment::GRAPH_PYRAMID);
+            lColorSegment->setPyramidScale(lPyramid);
+        }
+        if(lSuperpixels > 0)
+        {
+            lColorSegment->setGraphType(colorSegment::GRAPH_SUPERPIXEL);
+            lColorSegment->setSuperpixelSize(lSuperpixels);
+        }
+        lColorSegment->setDynamic(lDynamic);
+        lColorSegment->setTimeBudget(lBudget);
+        lColorSegment->setPolling(lPolling);
+        if(!lColorSegment->setHeadless(lHeadless))
+            cerr << "Falling back to a GL window." << endl;
+        lColorSegment->init(640, 480);
+        lColorSegment->setMaxSmoothCost(50);
+        lColorSegments.push_back(lColorSegment);
+    }
 
     cv::Mat lRGB;
     cv::Mat lDepth;
     cv::Mat lSegment;
+    cv::Mat lObjectLabels; // numéro de l'objet de chaque pixel, en mode multi-objets
 
     bool lCalibrate = false;
     bool lInitBG = false;
@@ -99,6 +211,7 @@ int main(int argc, char** argv)
     while(1)
     {
         grabDuration = presegmentDuration = gmmDuration = segDuration = totalDuration = 0;
+        unsigned int lObjects = 0;
 
         auto startTime = chrono::high_resolution_clock::now();
 
@@ -157,40 +270,103 @@ int main(int argc, char** argv)
             }
 
             std::vector<seedObject> lSeeds = lSeed.getSeeds();
-            if(lSeeds.size() > 0)
+            lObjects = std::min((unsigned int)lSeeds.size(), lObjectCount);
+            if(lObjects > 0)
             {
-                // Calcul de la mixture de gaussienne pour la
-                // plus grosse graîne
-                cv::Mat lBGCosts, lFGCosts;
-                thread firstGMM([&] ()
-                {
-                    lBGGmm.setRgbImg(lRGB);
-                    lBGGmm.calcGmm(lSeeds[0].background);
-                    lBGCosts = lBGGmm.getCosts(lSeeds[0].unknown);
-                } );
-                
-                thread secondGMM([&] ()
+                // Calcul des mixtures de gaussienne des plus grosses
+                // graînes, deux par objet, réparties sur le pool partagé
+                // (chaque calcul y soumet lui-même ses propres boucles)
+                std::vector<cv::Mat> lBGCosts(lObjects), lFGCosts(lObjects);
+                threadPool::getInstance().parallelFor(0, 2*lObjects, 1, [&] (int pFirst, int pLast)
                 {
-                    lFGGmm.setRgbImg(lRGB);
-                    lFGGmm.calcGmm(lSeeds[0].foreground);
-                    lFGCosts = lFGGmm.getCosts(lSeeds[0].unknown);
+                    for(int t=pFirst; t<pLast; t++)
+                    {
+                        unsigned int i = t/2;
+                        if(t%2 == 0)
+                        {
+                            lBGGmms[i]->setRgbImg(lRGB);
+                            lBGGmms[i]->calcGmm(lSeeds[i].background);
+                            lBGCosts[i] = lBGGmms[i]->getCosts(lSeeds[i].unknown);
+                        }
+                        else
+                        {
+                            lFGGmms[i]->setRgbImg(lRGB);
+                            lFGGmms[i]->calcGmm(lSeeds[i].foreground);
+                            lFGCosts[i] = lFGGmms[i]->getCosts(lSeeds[i].unknown);
+                        }
+                    }
                 } );
 
-                firstGMM.join();
-                secondGMM.join();
-
                 auto gmmTime = chrono::high_resolution_clock::now();
                 gmmDuration = chrono::duration_cast<chrono::microseconds>(gmmTime - presegmentTime).count();
 
-                lColorSegment.setCosts(lRGB, lBGCosts, lFGCosts, lSeeds[0].background+lSeeds[0].mask, lSeeds[0].foreground,
-                                       lSeeds[0].x_min, lSeeds[0].x_max, 480-lSeeds[0].y_max, 480-lSeeds[0].y_min);
+                // Tous les objets sont envoyés avant d'attendre le premier :
+                // chaque segmentation les résout dans son propre thread.
+                // En mode groupé, ils forment un seul graphe, dont la
+                // segmentation porte déjà le numéro de chaque objet
+                std::vector<unsigned int> lTickets(lObjects);
+                if(lBatch)
+                {
+                    std::vector<colorSegment::costRegion> lRegions(lObjects);
+                    for(unsigned int i=0; i<lObjects; i++)
+                    {
+                        lRegions[i].bgCosts = lBGCosts[i];
+                        lRegions[i].fgCosts = lFGCosts[i];
+                        lRegions[i].bg = lSeeds[i].background+lSeeds[i].mask;
+                        lRegions[i].fg = lSeeds[i].foreground;
+                        lRegions[i].xMin = lSeeds[i].x_min;
+                        lRegions[i].xMax = lSeeds[i].x_max;
+                        lRegions[i].yMin = 480-lSeeds[i].y_max;
+                        lRegions[i].yMax = 480-lSeeds[i].y_min;
+                    }
+                    lTickets.resize(1);
+                    lTickets[0] = lColorSegments[0]->setCosts(lRGB, lRegions);
+                }
+                else
+                {
+                    for(unsigned int i=0; i<lObjects; i++)
+                        lTickets[i] = lColorSegments[i]->setCosts(lRGB, lBGCosts[i], lFGCosts[i], lSeeds[i].background+lSeeds[i].mask, lSeeds[i].foreground,
+                                                                  lSeeds[i].x_min, lSeeds[i].x_max, 480-lSeeds[i].y_max, 480-lSeeds[i].y_min);
+                }
 
-                if(lColorSegment.getSegment(lSegment))
+                // On attend la segmentation de cette image : segDuration est
+                // alors la latence réelle entre l'envoi des coûts et le masque
+                // En mode multi-objets, les masques (où le FG vaut 0) sont
+                // fusionnés dans une image portant le numéro de chaque objet
+                bool lIsSegmented = false;
+                if(lBatch)
+                    lIsSegmented = lColorSegments[0]->getSegment(lObjectLabels, lTickets[0], __SEGMENT_TIMEOUT__);
+                else if(lMulti)
+                    lObjectLabels = cv::Mat::zeros(480, 640, CV_8UC1);
+                for(unsigned int i=0; i<lTickets.size() && !lBatch; i++)
                 {
+                    // En mode multi-objets, seule la zone de chaque objet est copiée
+                    if(lMulti)
+                    {
+                        cv::Rect lRoi;
+                        if(!lColorSegments[i]->getSegment(lSegment, lRoi, lTickets[i], __SEGMENT_TIMEOUT__))
+                            continue;
+
+                        cv::Mat lObjectRoi = lObjectLabels(lRoi);
+                        lObjectRoi.setTo(i+1, lSegment == 0);
+                    }
+                    else if(!lColorSegments[i]->getSegment(lSegment, lTickets[i], __SEGMENT_TIMEOUT__))
+                        continue;
+
+                    lIsSegmented = true;
+                }
+
+                if(lIsSegmented)
+                {
+                    cv::Mat lResult = lMulti ? lObjectLabels : lSegment;
+
                     if (lShow)
                     {
-                        cv::flip(lSegment, lSegment, 0);
-                        cv::imshow("segment!", lSegment);
+                        cv::flip(lResult, lResult, 0);
+                        if(lMulti)
+                            cv::imshow("segment!", cv::Mat(lResult * (255/lObjectCount)));
+                        else
+                            cv::imshow("segment!", lResult);
                     }
 
                     auto segTime = chrono::high_resolution_clock::now();
@@ -201,7 +377,7 @@ int main(int argc, char** argv)
                         std::string lName = "./grab/segment_";
                         lName += boost::lexical_cast<std::string>(time(NULL));
                         lName += std::string(".png");
-                        cv::imwrite(lName, lSegment);
+                        cv::imwrite(lName, lResult);
                     }
                 }
             }
@@ -211,11 +387,48 @@ int main(int argc, char** argv)
         totalDuration = chrono::duration_cast<chrono::microseconds>(endTime - startTime).count();
         int size = 0;
         float ratio = 0.f;
-        lColorSegment.getInfos(size, ratio);
+        float solveDuration = 0.f;
+        bool converged = true;
+        int residual = 0;
+        colorSegment &lColorSegment = *lColorSegments[0];
+        lColorSegment.getInfos(size, ratio, solveDuration, converged, residual);
+        unsigned int allocations = lColorSegment.getFrameAllocations();
+        float wakeLatency = 0.f;
+        float workerLoad = 0.f;
+        lColorSegment.getWorkerInfos(wakeLatency, workerLoad);
+        float renderDuration = 0.f;
+        float readbackWait = 0.f;
+        float readbackCopy = 0.f;
+        lColorSegment.getDrawInfos(renderDuration, readbackWait, readbackCopy);
+        unsigned int uploadBytes = 0;
+        unsigned int readbackBytes = 0;
+        unsigned int labelBytes = 0;
+        unsigned int inputBytes = 0;
+        lColorSegment.getTrafficInfos(uploadBytes, readbackBytes, labelBytes, inputBytes);
 
         std::cout << frameNumber << " " << grabDuration/1000 << " " << presegmentDuration/1000
             << " " << gmmDuration/1000 << " " << segDuration/1000 << " " << totalDuration/1000
-            << " " << size << " " << ratio << std::endl << std::flush;
+            << " " << size << " " << ratio << " " << solveDuration << " " << allocations
+            << " " << converged << " " << residual << " " << wakeLatency << " " << workerLoad
+            << " " << renderDuration << " " << readbackWait << " " << readbackCopy
+            << " " << uploadBytes << " " << readbackBytes << " " << labelBytes << " " << lObjects << " " << inputBytes
+            << std::endl << std::flush;
+
+        // Détail de la dernière image résolue, sur la sortie d'erreur
+        if(lMetrics)
+        {
+            colorSegment::frameMetrics lFrameMetrics = lColorSegment.getMetrics();
+            float lBGTable, lBGCosts, lFGTable, lFGCosts;
+            lBGGmms[0]->getDurations(lBGTable, lBGCosts);
+            lFGGmms[0]->getDurations(lFGTable, lFGCosts);
+            cerr << "metrics " << lFrameMetrics.ticket << " " << lFrameMetrics.queueWait << " " << lFrameMetrics.costBuild
+                << " " << lFrameMetrics.upload << " " << lFrameMetrics.render << " " << lFrameMetrics.readback
+                << " " << lFrameMetrics.graphSetup << " " << lFrameMetrics.maxflow << " " << lFrameMetrics.labelCopy
+                << " " << lFrameMetrics.augmentations << " " << lFrameMetrics.orphans
+                << " " << lFrameMetrics.allocations << " " << lFrameMetrics.allocatedBytes
+                << " " << lBGTable << " " << lBGCosts << " " << lFGTable << " " << lFGCosts
+                << " " << lBGGmms[0]->getThroughput() << " " << lFGGmms[0]->getThroughput() << endl;
+        }
 
         if (lShow)
         {
@@ -237,6 +450,9 @@ int main(int argc, char** argv)
 
     cerr << "Stopping..." << endl;
 
+    for(size_t i=0; i<lColorSegments.size(); i++)
+        lColorSegments[i]->stop();
+
     cv::destroyAllWindows();
 
     try
@@ -0,0 +1,159 @@
+#include "threadpool.h"
+
+using namespace std;
+
+/***********************/
+threadPool& threadPool::getInstance()
+{
+    // Le thread appelant complète le pool
+    static threadPool lInstance(max(1u, thread::hardware_concurrency()));
+    return lInstance;
+}
+
+/***********************/
+threadPool::threadPool(unsigned int pThreadCount)
+    :mIsStopping(false),
+      mIsSpawning(false)
+{
+    for(unsigned int t=1; t<max(1u, pThreadCount); t++)
+        mWorkers.push_back(thread(&threadPool::workerLoop, this));
+}
+
+/***********************/
+threadPool::~threadPool()
+{
+    mMutex.lock();
+    mIsStopping = true;
+    mMutex.unlock();
+    mJobCondition.notify_all();
+
+    for(size_t t=0; t<mWorkers.size(); t++)
+        mWorkers[t].join();
+}
+
+/***********************/
+unsigned int threadPool::getThreadCount()
+{
+    return mWorkers.size() + 1;
+}
+
+/***********************/
+void threadPool::setSpawning(bool pSpawning)
+{
+    mIsSpawning = pSpawning;
+}
+
+/***********************/
+void threadPool::parallelFor(int pBegin, int pEnd, int pGrain, const function<void(int, int)> &pBody)
+{
+    int lCount = pEnd - pBegin;
+    if(lCount <= 0)
+        return;
+
+    job lJob;
+    lJob.body = &pBody;
+    lJob.begin = pBegin;
+    lJob.end = pEnd;
+    lJob.chunkCount = min((lCount + max(1, pGrain) - 1)/max(1, pGrain), (int)getThreadCount()*CHUNKS_PER_THREAD);
+    lJob.next = 0;
+    lJob.remaining = lJob.chunkCount;
+
+    // Une seule tranche : inutile de passer par le pool
+    if(lJob.chunkCount == 1)
+    {
+        pBody(pBegin, pEnd);
+        return;
+    }
+
+    // Ancien comportement : des threads créés pour cette boucle seulement
+    if(mIsSpawning)
+    {
+        vector<thread> lThreads;
+        int lThreadCount = min(lJob.chunkCount, (int)getThreadCount());
+        for(int t=0; t<lThreadCount; t++)
+        {
+            lThreads.push_back(thread([&, t] ()
+            {
+                for(int c=t; c<lJob.chunkCount; c+=lThreadCount)
+                    runChunk(lJob, c);
+            } ));
+        }
+        for(int t=0; t<lThreadCount; t++)
+            lThreads[t].join();
+        return;
+    }
+
+    unique_lock<mutex> lLock(mMutex);
+    mJobs.push_back(&lJob);
+    mJobCondition.notify_all();
+
+    // L'appelant traite lui aussi les tranches de sa boucle, puis attend
+    // celles encore en cours dans le pool
+    int lChunk;
+    while(claimChunk(lJob, lChunk))
+    {
+        lLock.unlock();
+        runChunk(lJob, lChunk);
+        lLock.lock();
+        lJob.remaining--;
+    }
+
+    while(lJob.remaining > 0)
+        mDoneCondition.wait(lLock);
+}
+
+/***********************/
+void threadPool::workerLoop()
+{
+    unique_lock<mutex> lLock(mMutex);
+    while(true)
+    {
+        while(!mIsStopping && mJobs.empty())
+            mJobCondition.wait(lLock);
+        if(mIsStopping)
+            return;
+
+        job &lJob = *mJobs.front();
+        int lChunk;
+        if(!claimChunk(lJob, lChunk))
+            continue;
+
+        lLock.unlock();
+        runChunk(lJob, lChunk);
+        lLock.lock();
+
+        // L'appelant ne peut pas libérer la boucle avant que le verrou soit
+        // rendu : après ce point, elle n'est plus utilisée ici
+        lJob.remaining--;
+        if(lJob.remaining == 0)
+            mDoneCondition.notify_all();
+    }
+}
+
+/***********************/
+bool threadPool::claimChunk(job &pJob, int &pChunk)
+{
+    if(pJob.next >= pJob.chunkCount)
+        return false;
+
+    pChunk = pJob.next++;
+
+    // Toutes les tranches sont distribuées : la boucle quitte la file
+    if(pJob.next == pJob.chunkCount)
+    {
+        deque<job*>::iterator lIt = find(mJobs.begin(), mJobs.end(), &pJob);
+        if(lIt != mJobs.end())
+            mJobs.erase(lIt);
+    }
+
+    return true;
+}
+
+/***********************/
+void threadPool::runChunk(job &pJob, int pChunk)
+{
+    long long lCount = pJob.end - pJob.begin;
+    int lFirst = pJob.begin + (int)(lCount*pChunk/pJob.chunkCount);
+    int lLast = pJob.begin + (int)(lCount*(pChunk+1)/pJob.chunkCount);
+    (*pJob.body)(lFirst, lLast);
+}
@@ -0,0 +1,107 @@
+/* Pool de threads persistant, partagé par les objets qui parallélisent des
+ * boucles (les GMM notamment), afin de ne plus créer et détruire des threads
+ * à chaque étape de calcul. Le pool compte autant de threads que de coeurs,
+ * le thread appelant participant lui-même au travail.
+ * Plusieurs threads peuvent lui soumettre des boucles en même temps : leurs
+ * tranches sont alors traitées dans l'ordre de soumission.
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class threadPool
+{
+public:
+    // Pool partagé, dimensionné selon le nombre de coeurs
+    static threadPool& getInstance();
+
+    threadPool(unsigned int pThreadCount);
+    ~threadPool();
+
+    // Nombre de threads travaillant sur une boucle, appelant compris
+    unsigned int getThreadCount();
+
+    // Création de nouveaux threads à chaque boucle, au lieu d'utiliser ceux
+    // du pool (ancien comportement, pour comparaison)
+    void setSpawning(bool pSpawning);
+
+    // Appel de pBody(début, fin) sur des tranches de [pBegin, pEnd[ d'au moins
+    // pGrain éléments, réparties entre le pool et le thread appelant.
+    // Ne rend la main qu'une fois toutes les tranches traitées
+    void parallelFor(int pBegin, int pEnd, int pGrain, const std::function<void(int, int)> &pBody);
+
+    // Somme, à partir de pInit, des résultats de pBody sur des tranches de
+    // [pBegin, pEnd[. Les tranches ne dépendent que du nombre de threads, et
+    // leurs résultats sont additionnés dans l'ordre : le résultat ne dépend
+    // pas de l'ordonnancement
+    template<typename T>
+    T reduce(int pBegin, int pEnd, T pInit, const std::function<T(int, int)> &pBody);
+
+private:
+    /***********/
+    // Attributs
+    /***********/
+    // Nombre maximal de tranches par thread : assez pour équilibrer la charge,
+    // assez peu pour que leur distribution reste négligeable
+    static const int CHUNKS_PER_THREAD = 4;
+
+    // Boucle soumise au pool, allouée sur la pile de l'appelant
+    struct job
+    {
+        const std::function<void(int, int)>* body;
+        int begin, end;
+        int chunkCount;
+        int next; // prochaine tranche à distribuer
+        int remaining; // tranches non terminées
+    };
+
+    std::vector<std::thread> mWorkers;
+    std::deque<job*> mJobs; // boucles dont des tranches restent à distribuer
+    std::mutex mMutex; // protège mJobs et l'état des boucles
+    std::condition_variable mJobCondition;
+    std::condition_variable mDoneCondition;
+    bool mIsStopping;
+    bool mIsSpawning;
+
+    /**********/
+    // Méthodes
+    /**********/
+    void workerLoop();
+    // Attribution d'une tranche de pJob, mMutex devant être verrouillé
+    bool claimChunk(job &pJob, int &pChunk);
+    void runChunk(job &pJob, int pChunk);
+};
+
+/***********************/
+template<typename T>
+T threadPool::reduce(int pBegin, int pEnd, T pInit, const std::function<T(int, int)> &pBody)
+{
+    int lCount = pEnd - pBegin;
+    if(lCount <= 0)
+        return pInit;
+
+    int lChunks = std::min(lCount, (int)getThreadCount()*CHUNKS_PER_THREAD);
+    std::vector<T> lPartials(lChunks, T());
+
+    parallelFor(0, lChunks, 1, [&] (int pFirst, int pLast)
+    {
+        for(int c=pFirst; c<pLast; c++)
+            lPartials[c] = pBody(pBegin + (int)((long long)lCount*c/lChunks), pBegin + (int)((long long)lCount*(c+1)/lChunks));
+    } );
+
+    T lResult = pInit;
+    for(int c=0; c<lChunks; c++)
+        lResult += lPartials[c];
+
+    return lResult;
+}
+
+#endif // THREADPOOL_H